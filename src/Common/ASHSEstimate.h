@@ -0,0 +1,189 @@
+/*===================================================================
+
+  Program:   ASHS (Automatic Segmentation of Hippocampal Subfields)
+  Module:    $Id$
+  Language:  C++ program
+  Copyright (c) 2012 Paul A. Yushkevich, University of Pennsylvania
+
+  This file is part of ASHS
+
+  ASHS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =================================================================== */
+
+#ifndef __ASHSEstimate_h_
+#define __ASHSEstimate_h_
+
+/*
+ * Support for the --estimate mode of the ASHS programs, which predicts the peak
+ * memory and the run time of a job from the sizes of its inputs, without running
+ * it, so that cluster jobs can request just enough resources. The models count
+ * the large buffers and the inner loop operations of each program. The rates
+ * below are rough, and the operation count is printed as well, so that the
+ * run time can be recalibrated on a given machine.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+// Inner loop operations per second and per thread
+#define ASHS_ESTIMATE_OPS_PER_SECOND   1.0e9
+
+// Rate of reading (and decompressing) images, in bytes per second
+#define ASHS_ESTIMATE_READ_PER_SECOND  1.0e8
+
+// Memory used by the program itself, in bytes
+#define ASHS_ESTIMATE_BASE_BYTES       (64.0 * 1024 * 1024)
+
+/**
+ * The estimate for one job, printed as JSON. The inputs of the model and the
+ * parts of the memory are listed along with the totals.
+ */
+class ASHSEstimate
+{
+public:
+  ASHSEstimate(const std::string &program)
+    : m_Program(program), m_PeakBytes(0), m_ReadBytes(0), m_Operations(0), m_Threads(1) {}
+
+  /** Record an input of the model, such as a voxel count */
+  void SetInput(const std::string &name, double value)
+    { m_Inputs.push_back(std::make_pair(name, value)); }
+
+  /** Record the size of a buffer or of a group of buffers */
+  void SetMemory(const std::string &name, double bytes)
+    { m_Memory.push_back(std::make_pair(name, bytes)); }
+
+  /** The memory in use at the peak, not counting the program itself */
+  void SetPeakMemory(double bytes)
+    { m_PeakBytes = bytes; }
+
+  /** The bytes of image data read from disk */
+  void SetReadBytes(double bytes)
+    { m_ReadBytes = bytes; }
+
+  /** The inner loop operations, and the threads that share them */
+  void SetOperations(double ops, int threads)
+    { m_Operations = ops; m_Threads = std::max(threads, 1); }
+
+  double GetPeakMemoryMB() const
+    { return (m_PeakBytes + ASHS_ESTIMATE_BASE_BYTES) / (1024.0 * 1024.0); }
+
+  double GetRuntimeSeconds() const
+    { 
+    return m_ReadBytes / ASHS_ESTIMATE_READ_PER_SECOND 
+      + m_Operations / (ASHS_ESTIMATE_OPS_PER_SECOND * m_Threads); 
+    }
+
+  void WriteJSON(std::ostream &os) const
+    {
+    os << std::setprecision(8);
+    os << "{" << std::endl;
+    os << "  \"program\": \"" << m_Program << "\"," << std::endl;
+
+    os << "  \"inputs\": {";
+    for(size_t i = 0; i < m_Inputs.size(); i++)
+      os << (i ? ", " : "") << std::endl << "    \"" << m_Inputs[i].first << "\": " << m_Inputs[i].second;
+    os << std::endl << "  }," << std::endl;
+
+    os << "  \"memory_mb\": {";
+    for(size_t i = 0; i < m_Memory.size(); i++)
+      os << (i ? ", " : "") << std::endl << "    \"" << m_Memory[i].first << "\": " 
+         << m_Memory[i].second / (1024.0 * 1024.0);
+    os << std::endl << "  }," << std::endl;
+
+    os << "  \"peak_memory_mb\": " << GetPeakMemoryMB() << "," << std::endl;
+    os << "  \"read_mb\": " << m_ReadBytes / (1024.0 * 1024.0) << "," << std::endl;
+    os << "  \"operations\": " << m_Operations << "," << std::endl;
+    os << "  \"threads\": " << m_Threads << "," << std::endl;
+    os << "  \"runtime_seconds\": " << GetRuntimeSeconds() << std::endl;
+    os << "}" << std::endl;
+    }
+
+private:
+  typedef std::vector<std::pair<std::string, double> > ValueList;
+  std::string m_Program;
+  ValueList m_Inputs, m_Memory;
+  double m_PeakBytes, m_ReadBytes, m_Operations;
+  int m_Threads;
+};
+
+/**
+ * Discards what is written to standard output, from construction until Restore()
+ * is called or the object is destroyed, so that in estimate mode the output of a
+ * program only holds the estimate. Errors still go to standard error.
+ */
+class ASHSQuietOutput
+{
+public:
+  ASHSQuietOutput(bool quiet) : m_Saved(NULL)
+    {
+    if(quiet)
+      m_Saved = std::cout.rdbuf(NULL);
+    }
+
+  ~ASHSQuietOutput()
+    { Restore(); }
+
+  void Restore()
+    {
+    if(m_Saved)
+      std::cout.rdbuf(m_Saved);
+    m_Saved = NULL;
+    }
+
+private:
+  std::streambuf *m_Saved;
+};
+
+/**
+ * Replace each value of an image, stored first dimension fastest, by the maximum
+ * over a box of the given radius. This is done one dimension at a time, so that
+ * dilations can be counted quickly without running the programs.
+ */
+template <class T>
+void ASHSBoxMaximum(std::vector<T> &data, const std::vector<long> &size, const std::vector<long> &radius)
+{
+  std::vector<T> line;
+  long stride = 1;
+  for(size_t d = 0; d < size.size(); d++)
+    {
+    long n = size[d], r = radius[d];
+    if(r > 0 && n > 1)
+      {
+      line.resize(n);
+      long nLines = data.size() / n;
+      for(long l = 0; l < nLines; l++)
+        {
+        long start = (l / stride) * stride * n + (l % stride);
+        for(long i = 0; i < n; i++)
+          line[i] = data[start + i * stride];
+        for(long i = 0; i < n; i++)
+          {
+          long a = std::max(0L, i - r), b = std::min(n - 1, i + r);
+          T m = line[a];
+          for(long j = a + 1; j <= b; j++)
+            if(line[j] > m)
+              m = line[j];
+          data[start + i * stride] = m;
+          }
+        }
+      }
+    stride *= n;
+    }
+}
+
+#endif
@@ -0,0 +1,217 @@
+/*===================================================================
+
+  Program:   ASHS (Automatic Segmentation of Hippocampal Subfields)
+  Module:    $Id$
+  Language:  C++ program
+  Copyright (c) 2012 Paul A. Yushkevich, University of Pennsylvania
+
+  This file is part of ASHS
+
+  ASHS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =================================================================== */
+
+#ifndef __ASHSHeartbeat_h_
+#define __ASHSHeartbeat_h_
+
+/*
+ * Progress heartbeat for long runs on a cluster. A background thread reports the
+ * current phase, the work done out of the total, the current rate and the time
+ * left, every few seconds, whether or not the program makes progress, so that
+ * stuck jobs can be told apart from slow ones. The report is a line on standard
+ * error, or a one-line JSON status file that is replaced at each report.
+ */
+
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <cstdio>
+#include <ctime>
+#include <pthread.h>
+#include <sys/time.h>
+
+class ASHSHeartbeat
+{
+public:
+  ASHSHeartbeat(const std::string &program)
+    : m_Program(program), m_Interval(60.0), m_Running(false)
+    {
+    pthread_mutex_init(&m_Mutex, NULL);
+    pthread_cond_init(&m_Cond, NULL);
+    m_StartTime = m_PhaseTime = m_LastTime = Now();
+    m_Total = m_Done = m_LastDone = 0;
+    }
+
+  ~ASHSHeartbeat()
+    {
+    Stop();
+    pthread_cond_destroy(&m_Cond);
+    pthread_mutex_destroy(&m_Mutex);
+    }
+
+  /** 
+   * Start reporting every interval seconds, to a status file, or to standard
+   * error if the file name is "-" 
+   */
+  void Start(const std::string &target, double interval)
+    {
+    if(m_Running)
+      return;
+    m_Target = target;
+    m_Interval = interval > 0 ? interval : 60.0;
+    m_Running = true;
+    if(pthread_create(&m_Thread, NULL, &ASHSHeartbeat::ThreadMain, this) != 0)
+      m_Running = false;
+    }
+
+  /** Stop the reports, with a last one in the phase "done" */
+  void Stop()
+    {
+    if(!m_Running)
+      return;
+
+    pthread_mutex_lock(&m_Mutex);
+    m_Running = false;
+    pthread_cond_signal(&m_Cond);
+    pthread_mutex_unlock(&m_Mutex);
+    pthread_join(m_Thread, NULL);
+
+    StartPhase("done", 0, "");
+    pthread_mutex_lock(&m_Mutex);
+    Report();
+    pthread_mutex_unlock(&m_Mutex);
+    }
+
+  /** 
+   * Begin a phase of the program, with the total amount of work in the given 
+   * units, or zero if it is not known. The phase is reported right away
+   */
+  void StartPhase(const std::string &phase, double total, const std::string &units)
+    {
+    pthread_mutex_lock(&m_Mutex);
+    m_Phase = phase;
+    m_Units = units;
+    m_Total = total;
+    m_Done = m_LastDone = 0;
+    m_PhaseTime = m_LastTime = Now();
+    if(m_Running)
+      Report();
+    pthread_mutex_unlock(&m_Mutex);
+    }
+
+  /** Add to the work done in the current phase. May be called from any thread */
+  void Add(double done)
+    {
+    pthread_mutex_lock(&m_Mutex);
+    m_Done += done;
+    pthread_mutex_unlock(&m_Mutex);
+    }
+
+  /** Set the work done in the current phase */
+  void SetDone(double done)
+    {
+    pthread_mutex_lock(&m_Mutex);
+    m_Done = done;
+    pthread_mutex_unlock(&m_Mutex);
+    }
+
+private:
+  static double Now()
+    {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1.0e-6 * tv.tv_usec;
+    }
+
+  static std::string FormatTime(double sec)
+    {
+    long s = (long) (sec + 0.5);
+    std::ostringstream oss;
+    oss << s / 3600 << ":" << std::setfill('0') << std::setw(2) << (s / 60) % 60 
+        << ":" << std::setw(2) << s % 60;
+    return oss.str();
+    }
+
+  static void *ThreadMain(void *arg)
+    {
+    ASHSHeartbeat *self = static_cast<ASHSHeartbeat *>(arg);
+    pthread_mutex_lock(&self->m_Mutex);
+    while(self->m_Running)
+      {
+      double tNext = Now() + self->m_Interval;
+      struct timespec ts;
+      ts.tv_sec = (time_t) tNext;
+      ts.tv_nsec = (long) ((tNext - ts.tv_sec) * 1.0e9);
+      pthread_cond_timedwait(&self->m_Cond, &self->m_Mutex, &ts);
+      if(self->m_Running && Now() >= tNext)
+        self->Report();
+      }
+    pthread_mutex_unlock(&self->m_Mutex);
+    return NULL;
+    }
+
+  /** 
+   * Write a report. The rate is over the time since the last report, and the time
+   * left uses the average rate of the phase, which is steadier. Called with the
+   * mutex held
+   */
+  void Report()
+    {
+    double t = Now();
+    double rate = t > m_LastTime ? (m_Done - m_LastDone) / (t - m_LastTime) : 0.0;
+    double avgRate = t > m_PhaseTime ? m_Done / (t - m_PhaseTime) : 0.0;
+    double eta = (m_Total > 0 && avgRate > 0) ? (m_Total - m_Done) / avgRate : -1.0;
+    m_LastTime = t;
+    m_LastDone = m_Done;
+
+    if(m_Target == "-")
+      {
+      std::ostringstream oss;
+      oss << m_Program << ": " << m_Phase;
+      if(m_Total > 0)
+        oss << " " << (long) m_Done << "/" << (long) m_Total << " " << m_Units << " ("
+            << std::fixed << std::setprecision(1) << 100.0 * m_Done / m_Total << "%), "
+            << std::setprecision(0) << rate << " " << m_Units << "/s, ETA " << (eta < 0 ? std::string("unknown") : FormatTime(eta));
+      oss << ", elapsed " << FormatTime(t - m_StartTime);
+      std::cerr << oss.str() << std::endl;
+      }
+    else
+      {
+      // Write a new file and move it over the old one, so readers never see half a report
+      std::string fnTemp = m_Target + ".tmp";
+      std::ofstream fout(fnTemp.c_str());
+      fout << std::setprecision(10)
+           << "{\"program\": \"" << m_Program << "\", \"phase\": \"" << m_Phase << "\""
+           << ", \"done\": " << m_Done << ", \"total\": " << m_Total 
+           << ", \"units\": \"" << m_Units << "\", \"rate\": " << rate 
+           << ", \"eta_seconds\": " << eta << ", \"phase_seconds\": " << t - m_PhaseTime
+           << ", \"elapsed_seconds\": " << t - m_StartTime << ", \"time\": " << (long) t 
+           << "}" << std::endl;
+      fout.close();
+      if(fout.good())
+        rename(fnTemp.c_str(), m_Target.c_str());
+      }
+    }
+
+  std::string m_Program, m_Target, m_Phase, m_Units;
+  double m_Interval, m_StartTime, m_PhaseTime, m_LastTime;
+  double m_Total, m_Done, m_LastDone;
+  bool m_Running;
+  pthread_t m_Thread;
+  pthread_mutex_t m_Mutex;
+  pthread_cond_t m_Cond;
+};
+
+#endif
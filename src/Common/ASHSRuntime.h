@@ -0,0 +1,204 @@
+/*===================================================================
+
+  Program:   ASHS (Automatic Segmentation of Hippocampal Subfields)
+  Module:    $Id$
+  Language:  C++ program
+  Copyright (c) 2012 Paul A. Yushkevich, University of Pennsylvania
+
+  This file is part of ASHS
+
+  ASHS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =================================================================== */
+
+#ifndef __ASHSRuntime_h_
+#define __ASHSRuntime_h_
+
+/*
+ * Runtime settings shared by the ASHS programs. By default ITK starts one thread
+ * per core of the node, which oversubscribes the node when several jobs share it.
+ * Here the number of threads is the number of CPUs that the process may actually
+ * use: the smallest of its CPU affinity mask, the CPU quota of its cgroup and the
+ * SLURM_CPUS_PER_TASK allocation.
+ */
+
+#include "itkMultiThreader.h"
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+/** Read the first line of a file. Returns false if the file can not be read */
+inline bool ASHSReadFirstLine(const std::string &fn, std::string &line)
+{
+  std::ifstream fin(fn.c_str());
+  return fin.good() && std::getline(fin, line);
+}
+
+/** Number of CPUs in the affinity mask of the process, or 0 if unknown */
+inline int ASHSGetAffinityCPUCount()
+{
+#ifdef __linux__
+  cpu_set_t set;
+  if(sched_getaffinity(0, sizeof(set), &set) != 0)
+    return 0;
+
+  int n = 0;
+  for(int c = 0; c < CPU_SETSIZE; c++)
+    if(CPU_ISSET(c, &set))
+      n++;
+  return n;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * CPU quota of a cgroup directory, in CPUs, or 0 if there is no quota. Reads
+ * cpu.max in cgroup v2 and cpu.cfs_quota_us / cpu.cfs_period_us in cgroup v1
+ */
+inline double ASHSReadCgroupCPUQuota(const std::string &dir)
+{
+  std::string line;
+  if(ASHSReadFirstLine(dir + "/cpu.max", line))
+    {
+    // The line is "quota period", and the quota is "max" when there is none
+    char quota[64];
+    double period;
+    if(sscanf(line.c_str(), "%63s %lf", quota, &period) == 2 && strcmp(quota, "max") && period > 0)
+      return atof(quota) / period;
+    return 0;
+    }
+
+  std::string lq, lp;
+  if(ASHSReadFirstLine(dir + "/cpu.cfs_quota_us", lq) && ASHSReadFirstLine(dir + "/cpu.cfs_period_us", lp))
+    {
+    double quota = atof(lq.c_str()), period = atof(lp.c_str());
+    if(quota > 0 && period > 0)
+      return quota / period;
+    }
+  return 0;
+}
+
+/** CPU limit of the cgroup of the process, rounded up, or 0 if there is none */
+inline int ASHSGetCgroupCPULimit()
+{
+  double limit = 0;
+  std::ifstream fin("/proc/self/cgroup");
+  std::string line;
+  while(std::getline(fin, line))
+    {
+    // Lines are "id:controllers:path", and the v2 hierarchy has no controllers
+    size_t c1 = line.find(':');
+    size_t c2 = (c1 == std::string::npos) ? c1 : line.find(':', c1 + 1);
+    if(c2 == std::string::npos)
+      continue;
+
+    std::string controllers = "," + line.substr(c1 + 1, c2 - c1 - 1) + ",";
+    std::string path = line.substr(c2 + 1), root;
+    if(controllers == ",,")
+      root = "/sys/fs/cgroup";
+    else if(controllers.find(",cpu,") != std::string::npos)
+      root = "/sys/fs/cgroup/cpu";
+    else
+      continue;
+
+    // The quota may be set on any of the parent groups
+    while(true)
+      {
+      double quota = ASHSReadCgroupCPUQuota(root + path);
+      if(quota > 0 && (limit == 0 || quota < limit))
+        limit = quota;
+      if(path.empty() || path == "/")
+        break;
+      path = path.substr(0, path.rfind('/'));
+      }
+    }
+
+  return limit > 0 ? std::max(1, (int) ceil(limit - 1e-6)) : 0;
+}
+
+/**
+ * The number of threads to use when none is given on the command line. If the
+ * source string is passed, it is set to what determined the number.
+ */
+inline int ASHSGetDefaultNumberOfThreads(std::string *source = NULL)
+{
+  // A number set explicitly for ITK is used as is
+  const char *itkThreads = getenv("ITK_GLOBAL_DEFAULT_NUMBER_OF_THREADS");
+  if(itkThreads && atoi(itkThreads) > 0)
+    {
+    if(source)
+      *source = "ITK_GLOBAL_DEFAULT_NUMBER_OF_THREADS";
+    return atoi(itkThreads);
+    }
+
+  int n = itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  std::string from = "all cores";
+
+  int nAffinity = ASHSGetAffinityCPUCount();
+  if(nAffinity > 0 && nAffinity < n)
+    {
+    n = nAffinity;
+    from = "CPU affinity";
+    }
+
+  int nCgroup = ASHSGetCgroupCPULimit();
+  if(nCgroup > 0 && nCgroup < n)
+    {
+    n = nCgroup;
+    from = "cgroup CPU quota";
+    }
+
+  const char *slurmCPUs = getenv("SLURM_CPUS_PER_TASK");
+  if(slurmCPUs && atoi(slurmCPUs) > 0 && atoi(slurmCPUs) < n)
+    {
+    n = atoi(slurmCPUs);
+    from = "SLURM_CPUS_PER_TASK";
+    }
+
+  if(source)
+    *source = from;
+  return std::max(n, 1);
+}
+
+/**
+ * Set the number of threads used by ITK. A number below 1 means the default
+ * number above. Returns the number of threads, and sets the source string if
+ * it is passed.
+ */
+inline int ASHSSetNumberOfThreads(int threads, std::string *source = NULL)
+{
+  int n = threads;
+  if(n > 0)
+    {
+    if(source)
+      *source = "-threads";
+    }
+  else
+    n = ASHSGetDefaultNumberOfThreads(source);
+
+  itk::MultiThreader::SetGlobalMaximumNumberOfThreads(n);
+  itk::MultiThreader::SetGlobalDefaultNumberOfThreads(n);
+  return n;
+}
+
+#endif
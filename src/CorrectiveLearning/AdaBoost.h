@@ -12,6 +12,7 @@ A few improvements that significantly speedup the code were made by Paul Yushkev
 #include <cmath>
 #include <algorithm>
 #include<time.h>
+#include "ASHSHeartbeat.h"
 using namespace std;
 
 typedef struct {
@@ -121,7 +122,9 @@ void transpose(RandomIterator first, RandomIterator last, long m)
 // NFeature: # of features used to describe each sample.
 // iterN: # of AdaBoost learning iterations.
 // fileName: the file names of the learning output. 
-int AdaBoostTrain(double* X, int* Y, int NSample, int NFeature, int iterN, char* fileName){
+// heartbeat: optional progress reports of the sorting and the learning iterations.
+int AdaBoostTrain(double* X, int* Y, int NSample, int NFeature, int iterN, char* fileName,
+                  ASHSHeartbeat *heartbeat = NULL){
 
 
     // PY: performance can be improved by transposing the array X. The costliest part of
@@ -179,8 +182,12 @@ int AdaBoostTrain(double* X, int* Y, int NSample, int NFeature, int iterN, char*
     sort_index_pair *sip = new sort_index_pair[NSample];
     int *ipos = sortidx;
     double *xpos = X;
+    if(heartbeat)
+      heartbeat->StartPhase("sort", NFeature, "features");
     for(i = 0; i < NFeature; i++)
       {
+      if(heartbeat)
+        heartbeat->SetDone(i);
       for(j = 0; j < NSample; j++)
         {
         sip[j].first = *xpos++;
@@ -193,7 +200,11 @@ int AdaBoostTrain(double* X, int* Y, int NSample, int NFeature, int iterN, char*
 
     cout<<NSample<<" "<<NFeature<<" "<<iterN<<" "<<fileName<<endl;
     time_t second1=time(NULL),second2;
+    if(heartbeat)
+      heartbeat->StartPhase("boost", iterN, "iterations");
     while (CC<iterN){
+        if(heartbeat)
+            heartbeat->SetDone(CC);
         CC++;
         bwl.weightedRate=-1;
         ipos = sortidx;
@@ -4,6 +4,7 @@ Hongzhi Wang, 07/18/2010
 */
 #include "util.h"
 #include "AdaBoost.h"
+#include "ASHSRuntime.h"
 using namespace std;
 
 int usage()
@@ -41,7 +42,15 @@ int usage()
        << "                                      Feature images for the training subjects. The number of feautres for each"<<endl
        << "                                      subject should  equal featureChannel." << endl
        << "  -m mask1 ... maskN:                 Specify labels' working ROI for the training images." <<endl
-       << "                                      ROI will be derived by performing dilation on this mask then."<<endl;
+       << "                                      ROI will be derived by performing dilation on this mask then."<<endl
+       << "  -threads N                          Limit number of threads to N. Default: the number of CPUs this"<<endl
+       << "                                      process may use (CPU affinity, cgroup quota, SLURM)"<<endl
+       << "  --estimate                          Do not train. Read the automatic segmentations and print the"<<endl
+       << "                                      predicted peak memory and run time in JSON format"<<endl
+       << "  --heartbeat status.json             Report the progress every few seconds: the phase, the subjects"<<endl
+       << "                                      loaded or AdaBoost iterations done, the rate and the time left."<<endl
+       << "                                      With -, the reports are printed to standard error"<<endl
+       << "  --heartbeat-interval s              Seconds between heartbeat reports. Default: 60"<<endl;
 
   return -1;
 }
@@ -62,9 +71,16 @@ struct BLParam
   int DilateR;
   double sampleRate;
   int iteration,DX,DY,DZ;
+  int threads;
+  bool estimate;
+  string fnHeartbeat;
+  double heartbeatInterval;
 
   BLParam()
     {
+    threads = 0;
+    estimate = false;
+    heartbeatInterval = 60;
     featureChannel = 0;
     DilateR = 1;
     sampleRate = 1;
@@ -93,12 +109,75 @@ struct BLParam
   }
 };
 
+// Predict the peak memory and the run time of the training without running it. Only the
+// automatic segmentations are read, to count the samples, and the estimate is printed as JSON.
+// The sample matrix grows by doubling, so up to three times its size is in memory while it
+// is built, and the training adds the sorted feature indices.
+template <unsigned int VDim>
+int EstimateBiasLearn(const BLParam<VDim> &p)
+{
+  int NFeature = ((1+p.featureChannel)*(p.DX*2+1)*(p.DY*2+1)*(p.DZ*2+1)+3)*4-3;
+  double nSamples=0, nVoxels=0, bImages=0, bRead=0;
+  for (size_t mi=0;mi<p.fnManual.size();mi++)
+  {
+    ReaderType::Pointer autoSeg = ReaderType::New();
+    autoSeg->SetFileName(p.fnAuto[mi]);
+    try
+    {
+      autoSeg->Update();
+    }
+    catch ( itk::ExceptionObject &err)
+    {
+      cerr << "ExceptionObject caught !" << std::endl;
+      cerr << err << std::endl;
+      return -1;
+    }
+    ImageType::Pointer seg = autoSeg->GetOutput();
+    double n = seg->GetBufferedRegion().GetNumberOfPixels();
+    nSamples += p.sampleRate * CountROIVoxels(seg, p.targetLabel, seg, p.DilateR, p.DX, p.DY, p.DZ);
+    nVoxels += n;
+
+    // features, manual and automatic segmentations, the two ROI masks and the dilation buffer
+    bImages = std::max(bImages, 4.0 * n * (p.featureChannel + 5));
+    bRead += 4.0 * n * (p.featureChannel + 2);
+  }
+
+  double bSamples = 8.0 * nSamples * NFeature;
+  double bTrain = 4.0 * nSamples * NFeature + 64.0 * nSamples;
+
+  ASHSEstimate est("bl");
+  est.SetInput("subjects", p.fnManual.size());
+  est.SetInput("image_voxels", nVoxels);
+  est.SetInput("samples", nSamples);
+  est.SetInput("features", NFeature);
+  est.SetInput("iterations", p.iteration);
+  est.SetMemory("images", bImages);
+  est.SetMemory("samples", bSamples);
+  est.SetMemory("training", bTrain);
+  est.SetPeakMemory(std::max(bImages + 3 * bSamples, 2 * bSamples + bTrain));
+  est.SetReadBytes(bRead);
+
+  // Features of each sample, sorting each feature, and one pass over the sorted features
+  // for each iteration. The training runs in a single thread
+  double logS = nSamples > 1 ? log(nSamples) / log(2.0) : 1.0;
+  est.SetOperations(nSamples * NFeature * (1 + logS + 2 * p.iteration) + nVoxels, 1);
+
+  est.WriteJSON(cout);
+  return 0;
+}
+
 template <unsigned int VDim>
 int lfapp(int argc, char *argv[])
 {
   // Parameter vector
   BLParam<VDim> p;
 
+  // In estimate mode, only the estimate is printed
+  for(int j = 2; j < argc-1; j++)
+    if(!strcmp(argv[j], "--estimate"))
+      p.estimate = true;
+  ASHSQuietOutput quiet(p.estimate);
+
   // Read the parameters from command line
   p.fnOutput = argv[argc-1];
   int argend = argc-2;
@@ -161,6 +240,22 @@ int lfapp(int argc, char *argv[])
       {
       p.iteration = atoi(argv[++j]);
       }
+    else if(arg == "-threads" && j < argend)
+      {
+      p.threads = atoi(argv[++j]);
+      }
+    else if(arg == "--estimate")
+      {
+      p.estimate = true;
+      }
+    else if(arg == "--heartbeat" && j < argend)
+      {
+      p.fnHeartbeat = argv[++j];
+      }
+    else if(arg == "--heartbeat-interval" && j < argend)
+      {
+      p.heartbeatInterval = atof(argv[++j]);
+      }
     else if(arg == "-rf" && j < argend)
       {
       string rstr(argv[++j]);
@@ -200,6 +295,17 @@ int lfapp(int argc, char *argv[])
   cout << "segAdapter PARAMETERS:" << endl;
   p.Print(cout);
 
+  // Use the threads parameter, or the number of CPUs available to the process
+  string threadSource;
+  int nThreads = ASHSSetNumberOfThreads(p.threads, &threadSource);
+  cout << " threads: " << nThreads << " (" << threadSource << ")" << endl;
+
+  if(p.estimate)
+    {
+    quiet.Restore();
+    return EstimateBiasLearn(p);
+    }
+
   std::vector<ImageType::Pointer> ims;
   std::vector<IteratorType> imits;
   std::vector<NeighborhoodIteratorType> imnits;
@@ -227,8 +333,21 @@ int lfapp(int argc, char *argv[])
   vector<int> Y;
   int j, k, l, r, c, d,  iNFeature=0, iNFeature1=0;
   int totalSample=0;
+
+  // Optional progress heartbeat, over the subjects and then the AdaBoost iterations
+  ASHSHeartbeat heartbeat("bl");
+  ASHSHeartbeat *pHeartbeat = NULL;
+  if (p.fnHeartbeat.size())
+  {
+    pHeartbeat = &heartbeat;
+    heartbeat.Start(p.fnHeartbeat, p.heartbeatInterval);
+    heartbeat.StartPhase("samples", p.fnManual.size(), "subjects");
+  }
+
   for (size_t mi=0;mi<p.fnManual.size();mi++)
   {
+    if (pHeartbeat)
+      heartbeat.SetDone(mi);
     std::vector<ImageType::Pointer> ims;
     std::vector<IteratorType> imits;
     std::vector<NeighborhoodIteratorType> imnits;
@@ -505,7 +624,7 @@ int lfapp(int argc, char *argv[])
   AdaBoostParamFile.close();
   sprintf (fileName, "%s-AdaBoostResults-Tlabel%d",p.fnOutput.c_str(),p.targetLabel);
 
-  AdaBoostTrain(&X[0],&Y[0],totalSample,NFeature,p.iteration,fileName);
+  AdaBoostTrain(&X[0],&Y[0],totalSample,NFeature,p.iteration,fileName,pHeartbeat);
 
   return 0;
 }
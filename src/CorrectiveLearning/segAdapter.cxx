@@ -7,8 +7,91 @@ Hongzhi Wang, 07/18/2010
 
 #include "util.h"
 #include "AdaBoost.h"
+#include "ASHSRuntime.h"
 using namespace std;
 
+// Predict the peak memory and the run time of the corrections without running them. The
+// input segmentation, the ROI masks and the AdaBoost files are read, the feature images
+// are not. The estimate is printed as JSON.
+int EstimateSegAdapter(ImageType::Pointer autoseg, const char *prefix, const vector<string> &featurefn,
+                       int maskFlag, const string &maskFn, map<int, string> &fnExclusion)
+{
+  char tfn[1024];
+  double n = autoseg->GetBufferedRegion().GetNumberOfPixels();
+  double nVoxels=0, nLabels=0, ops=0, bRead=4.0*n;
+  int ML=0;
+  const float *pSeg = autoseg->GetBufferPointer();
+  for (long i=0;i<(long)n;i++)
+    if (pSeg[i]>ML)
+      ML=int(pSeg[i]);
+
+  for (int Tlabel=0;Tlabel<=ML;Tlabel++)
+  {
+    // the training parameters and the number of weak learners (7 numbers each)
+    int dilateR,DX,DY,DZ,featureChannel;
+    sprintf(tfn,"%s-AdaBoostResults-param-Tlabel%d",prefix,Tlabel);
+    ifstream ifs ( tfn , ifstream::in );
+    if (!ifs.good())
+      continue;
+    ifs>>dilateR>>DX>>DY>>DZ>>featureChannel;
+    ifs.close();
+
+    sprintf(tfn,"%s-AdaBoostResults-Tlabel%d",prefix,Tlabel);
+    ifstream ifr ( tfn , ifstream::in );
+    if (!ifr.good())
+      continue;
+    double t, LC=0;
+    while (ifr >> t)
+      LC++;
+    LC /= 7;
+
+    long nROI;
+    if (maskFlag){
+      char buffer[4096];
+      sprintf(buffer, maskFn.data(), Tlabel);
+      ReaderType::Pointer ROIMask = ReaderType::New();
+      ROIMask->SetFileName( buffer );
+      try
+      {
+        ROIMask->Update();
+      }
+      catch ( itk::ExceptionObject &err)
+      {
+        std::cerr << "ExceptionObject caught !" << std::endl;
+        std::cerr << err << std::endl;
+        return -1;
+      }
+      nROI = CountROIVoxels(ROIMask->GetOutput(), -1, autoseg, dilateR, DX, DY, DZ);
+      bRead += 4.0*n;
+    }else{
+      nROI = CountROIVoxels(autoseg, Tlabel, autoseg, dilateR, DX, DY, DZ);
+    }
+
+    // the features and the classifier at each voxel of the ROI, and the dilations
+    int NFeature = ((1+featurefn.size())*(DX*2+1)*(DY*2+1)*(DZ*2+1)+3)*4-3;
+    ops += nROI*(NFeature+LC) + 6.0*n*(2*dilateR+1) + 2.0*n*featurefn.size();
+    bRead += 4.0*n*(featurefn.size() + (fnExclusion.count(Tlabel) ? 1 : 0));
+    nVoxels += nROI;
+    nLabels++;
+  }
+
+  // the segmentation, the six result and ROI images, the dilation buffer, the feature
+  // images of one label and the exclusion and ROI masks if given
+  double nImages = 8 + featurefn.size() + (fnExclusion.size() ? 1 : 0) + (maskFlag ? 1 : 0);
+
+  ASHSEstimate est("sa");
+  est.SetInput("image_voxels", n);
+  est.SetInput("labels", nLabels);
+  est.SetInput("features", featurefn.size());
+  est.SetInput("roi_voxels", nVoxels);
+  est.SetMemory("images", 4.0*n*nImages);
+  est.SetPeakMemory(4.0*n*nImages);
+  est.SetReadBytes(bRead);
+  est.SetOperations(ops, 1);
+  est.WriteJSON(cout);
+  return 0;
+}
+
 int main( int argc, char ** argv )
 {
   if ( argc < 4 )
@@ -35,9 +118,23 @@ int main( int argc, char ** argv )
               << "                        voxel belongs to each label) as images. The number of " << endl
               << "                        images saved equals the number of labels. The filename" << endl
               << "                        pattern must be in C printf format, e.g. posterior%04d.nii.gz" << endl
+              << "  -threads N            Limit number of threads to N. Default: the number of CPUs" << endl
+              << "                        this process may use (CPU affinity, cgroup quota, SLURM)" << endl
+              << "  --estimate            Do not correct. Read the segmentation, masks and AdaBoost files" << endl
+              << "                        and print the predicted peak memory and run time in JSON format" << endl
+              << "  --heartbeat file      Report the progress every few seconds: the labels processed, the" << endl
+              << "                        rate and the time left. With -, the reports go to standard error" << endl
+              << "  --heartbeat-interval s  Seconds between heartbeat reports. Default: 60" << endl
               << std::endl;
     return -1;
     }
+    // In estimate mode, only the estimate is printed
+    bool estimate = false;
+    for(int j = 4; j < argc; j++)
+      if(!strcmp(argv[j], "--estimate"))
+        estimate = true;
+    ASHSQuietOutput quiet(estimate);
+
     WriterType::Pointer writer = WriterType::New();
 
     int r=0,c=0,d=0,maskFlag=0,j,k;
@@ -50,6 +147,9 @@ int main( int argc, char ** argv )
     vector<string> featurefn;
     vector<int> featurefnflag;
     map<int, string> fnExclusion;
+    int threads = 0;
+    string fnHeartbeat;
+    double heartbeatInterval = 60;
     char buffer[4096];
     cout<<argv[1]<<endl;
     autoseg->SetFileName( argv[1] );
@@ -90,12 +190,26 @@ int main( int argc, char ** argv )
         maskFlag=1;
       }else if(arg == "-p"){
         posteriorFn=argv[++j];
+      }else if(arg == "-threads" && j+1 < argc){
+        threads=atoi(argv[++j]);
+      }else if(arg == "--heartbeat" && j+1 < argc){
+        fnHeartbeat=argv[++j];
+      }else if(arg == "--heartbeat-interval" && j+1 < argc){
+        heartbeatInterval=atof(argv[++j]);
       }
 
     }
+    string threadSource;
+    int nThreads = ASHSSetNumberOfThreads(threads, &threadSource);
+    cout<<"threads: "<<nThreads<<" ("<<threadSource<<")"<<endl;
     cout<<"feature #:"<<featurefn.size()<<endl;
     cout<<"maskFlag:"<<maskFlag<<"  "<<maskFn<<endl;
 
+    if (estimate){
+      quiet.Restore();
+      return EstimateSegAdapter(autoseg->GetOutput(), argv[2], featurefn, maskFlag, maskFn, fnExclusion);
+    }
+
     ImageType::Pointer nseg = ImageType::New();
     ImageType::Pointer cseg = ImageType::New();
     ImageType::Pointer emask = ImageType::New();
@@ -181,7 +295,16 @@ int main( int argc, char ** argv )
     double t;
     int DX,DY,DZ,MD,dilateR,featureChannel;
     time_t second1=time(NULL),second2;
+
+    // Optional progress heartbeat over the labels
+    ASHSHeartbeat heartbeat("sa");
+    if (fnHeartbeat.size()){
+      heartbeat.Start(fnHeartbeat, heartbeatInterval);
+      heartbeat.StartPhase("labels", ML+1, "labels");
+    }
+
     for (int Tlabel=0;Tlabel<=ML;Tlabel++){
+	heartbeat.SetDone(Tlabel);
 	if (fnExclusion[Tlabel]!=""){
 	    exclusionMask->SetFileName( fnExclusion[Tlabel] );
 	    try
@@ -451,6 +574,7 @@ int main( int argc, char ** argv )
        second1=second2;
     } 
 
+    heartbeat.StartPhase("write", 0, "");
     cout<<"saving corrected segmentation to "<<argv[3]<<endl;
     // write the corrected segmentation into the output file
     writer->SetFileName( argv[3] );
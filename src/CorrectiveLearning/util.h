@@ -21,6 +21,7 @@ Hongzhi Wang 07/19/2010
 #include <string>
 #include <cmath>
 #include <algorithm>
+#include "ASHSEstimate.h"
 using namespace std;
 
 const unsigned int Dimension = 3;
@@ -35,6 +36,35 @@ typedef itk::NeighborhoodIterator< ImageType > NeighborhoodIteratorType;
 typedef itk::ImageRegionIteratorWithIndex< ImageType > IndexIteratorType;
 typedef itk::ImageRegionIterator< ImageType>        IteratorType;
 
+// count the voxels that are used for a label, without building the ROI images: the voxels 
+// in both the ROI of roi (as computed by myDilate with Tlabel) and the ROI of all non-background 
+// labels of seg, which are at least DX, DY, DZ voxels away from the edges of the image.
+// Used to estimate the work of bl and sa.
+long CountROIVoxels(ImageType::Pointer roi, int Tlabel, ImageType::Pointer seg, int R, int DX, int DY, int DZ){
+    ImageType::SizeType size = seg->GetBufferedRegion().GetSize();
+    std::vector<long> dims(3), radius(3, R);
+    for (int d=0;d<3;d++)
+      dims[d]=size[d];
+
+    long n = seg->GetBufferedRegion().GetNumberOfPixels();
+    const float *pRoi = roi->GetBufferPointer(), *pSeg = seg->GetBufferPointer();
+    std::vector<float> droi(n), dseg(n);
+    for (long i=0;i<n;i++){
+      droi[i] = ((Tlabel>=0 && pRoi[i]==Tlabel) || (Tlabel<0 && pRoi[i]>0)) ? 1 : 0;
+      dseg[i] = pSeg[i]>0 ? 1 : 0;
+    }
+    ASHSBoxMaximum(droi, dims, radius);
+    ASHSBoxMaximum(dseg, dims, radius);
+
+    long tc=0, i=0;
+    for (long z=0;z<dims[2];z++)
+      for (long y=0;y<dims[1];y++)
+        for (long x=0;x<dims[0];x++,i++)
+          if (x>=DX && x<dims[0]-DX && y>=DY && y<dims[1]-DY && z>=DZ && z<dims[2]-DZ && droi[i]>0 && dseg[i]>0)
+            tc++;
+    return tc;
+}
+
 // perform thresholding and dilation to obtain region of interest for some segmentation label
 // im: input image
 // dmask: the resulting region of interest mask. Value 0 represents background, 1 is the ROI.  
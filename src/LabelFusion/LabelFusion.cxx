@@ -33,14 +33,25 @@
   =================================================================== */
   
 
-#include "WeightedVotingLabelFusionImageFilter.h"
+#include "LabelFusionDriver.h"
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 #include "itkImageRegionIteratorWithIndex.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkImageRegionIterator.h"
+#include "LabelFusionProfile.h"
+#include "ASHSRuntime.h"
+#include "ASHSEstimate.h"
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <set>
+#include <cmath>
 
 #include "itkMirrorPadImageFilter.h"
 #include "itkCropImageFilter.h"
+#include "itkRegionOfInterestImageFilter.h"
 #include "WeightedVotingLabelFusionImageFilter.txx"
 
 using namespace std;
@@ -50,6 +61,7 @@ int usage()
   cout << "label_fusion: " << endl;
   cout << "usage: " << endl;
   cout << "  label_fusion [dim] [options] target_image output_image" << endl;
+  cout << "  label_fusion [dim] [options] --batch jobs.tsv" << endl;
   cout << endl; 
   cout << "required options:" << endl;
   cout << "  dim                             Image dimension (2 or 3)" << endl;
@@ -68,6 +80,11 @@ int usage()
   cout << "                                  Default: 3x3x3" << endl;
   cout << "  -rs radius                      Search radius for correcting registration." << endl;
   cout << "                                  Default: 3x3x3" << endl;
+  cout << "  --patch-mm r                    Use an ellipsoidal patch with semi-axes r in mm (scalar or" << endl;
+  cout << "                                  vector AxBxC), instead of the -rp box. The voxel extent" << endl;
+  cout << "                                  follows from the target image spacing" << endl;
+  cout << "  --search-mm r                   Use an ellipsoidal search neighborhood with semi-axes r" << endl;
+  cout << "                                  in mm, instead of the -rs box" << endl;
   cout << "  -pd radius                      Additional boundary padding for the images (use only if " << endl;
   cout << "                                  the segmentation extends all the way to image boundaries." << endl;
   cout << "  -x label image.nii              Specify an exclusion region for the given label. " << endl;
@@ -84,7 +101,86 @@ int usage()
   cout << "                                  When this is not specified, the mask will be automatically computed" << endl;
   cout << "                                  based on whether there are more than one labels that could be" << endl;
   cout << "                                  potentially assigned to a given voxel" << endl;
-  cout << "  -threads N                      Limit number of threads to N" << endl;
+  cout << "  -threads N                      Limit number of threads to N. Default: the number of CPUs" << endl;
+  cout << "                                  this process may use, from its CPU affinity, its cgroup" << endl;
+  cout << "                                  CPU quota and SLURM_CPUS_PER_TASK" << endl;
+  cout << "  --weight-stride s               Estimate the weights only on a lattice of voxels with" << endl;
+  cout << "                                  spacing s (scalar or vector AxBxC) and let the patch" << endl;
+  cout << "                                  voting fill in the voxels in between. Voxels that" << endl;
+  cout << "                                  receive no votes get the full estimation. Default: 1" << endl;
+  cout << "  --auto-search f                 Pick the search radius for each atlas with a pilot search" << endl;
+  cout << "                                  on a sample of voxels: the smallest radius (at most -rs)" << endl;
+  cout << "                                  that holds the fraction f of the best matches, e.g. 0.99" << endl;
+  cout << "  --patchmatch                    Use an approximate search modelled on PatchMatch, which" << endl;
+  cout << "                                  starts from the best matches of the neighboring voxels" << endl;
+  cout << "                                  and tests random offsets in shrinking windows. This makes" << endl;
+  cout << "                                  large -rs affordable" << endl;
+  cout << "  --patchmatch-check f            Check the PatchMatch search against the exhaustive search" << endl;
+  cout << "                                  on the fraction f of the voxels, and report how often the" << endl;
+  cout << "                                  best matches differ. Each check costs an exhaustive search." << endl;
+  cout << "                                  Default: 0 (no checks)" << endl;
+  cout << "  --pca-search K[:M]              Rank the search candidates by descriptors made of K PCA" << endl;
+  cout << "                                  components of the target patches (e.g., 8 to 16), and" << endl;
+  cout << "                                  only compare the best M (default 4) to the target patch" << endl;
+  cout << "                                  in full. Needs K+1 floats of memory per atlas voxel" << endl;
+  cout << "  --cascade m                     Do majority voting first, and only run joint fusion at" << endl;
+  cout << "                                  voxels where the margin between the two most frequent" << endl;
+  cout << "                                  labels is below m times the number of atlases (0 < m <= 1)" << endl;
+  cout << "  --tile s                        Visit the voxels in tiles of size s (scalar or AxBxC)" << endl;
+  cout << "                                  and search the atlases one at a time over each tile, which" << endl;
+  cout << "                                  makes better use of the cache with many atlases. The" << endl;
+  cout << "                                  results are the same up to round-off in the vote sums." << endl;
+  cout << "                                  Small tiles (e.g., 4) work best" << endl;
+  cout << "  --numa                          On machines with several NUMA nodes, pin the threads to" << endl;
+  cout << "                                  the nodes and move the part of the images that each thread" << endl;
+  cout << "                                  reads to its node. The placement is reported in --profile" << endl;
+  cout << "                                  With --checkpoint, the images are only interleaved over" << endl;
+  cout << "                                  the nodes, and the threads are not pinned" << endl;
+  cout << "  --simd-solve                    Solve for the weights of several voxels at once, one" << endl;
+  cout << "                                  voxel per SIMD lane. The weights are the same up to" << endl;
+  cout << "                                  round-off" << endl;
+  cout << "  --solve-fallback svd|ridge[:N]  How to solve for the weights when the error matrix is" << endl;
+  cout << "                                  badly conditioned. 'svd' uses the SVD. 'ridge' retries" << endl;
+  cout << "                                  Cholesky up to N times (default 4) with alpha increased" << endl;
+  cout << "                                  tenfold each time before using the SVD. Default: svd" << endl;
+  cout << "  --partition i/N                 Only estimate the weights in the i-th of N slabs (i = 0..N-1)" << endl;
+  cout << "                                  of the region, for splitting label fusion over several" << endl;
+  cout << "                                  nodes. Instead of the segmentation, the sums of the votes" << endl;
+  cout << "                                  are written using output_image as the prefix, and the" << endl;
+  cout << "                                  partitions are then combined by label_fusion_merge" << endl;
+  cout << "  --checkpoint file               Process the region in slabs (layers of tiles with --tile)" << endl;
+  cout << "                                  and save the votes of the finished slabs to file every" << endl;
+  cout << "                                  few minutes, so that a killed run can be resumed. The" << endl;
+  cout << "                                  file is removed when label fusion is done" << endl;
+  cout << "  --checkpoint-interval s         Seconds between checkpoints. Default: 600" << endl;
+  cout << "  --heartbeat status.json         Report the progress every few seconds: the phase, the" << endl;
+  cout << "                                  voxels fused out of the total, the voxels per second and" << endl;
+  cout << "                                  the time left. The file holds one line of JSON and is" << endl;
+  cout << "                                  replaced at each report. With -, the reports are printed" << endl;
+  cout << "                                  to standard error, and no progress dots are printed" << endl;
+  cout << "  --heartbeat-interval s          Seconds between heartbeat reports. Default: 60" << endl;
+  cout << "  --resume                        Resume from the checkpoint file, if it was written by" << endl;
+  cout << "                                  a run with the same inputs and options" << endl;
+  cout << "  --sweep a1,b1 ... aN,bN         Run joint fusion for several (alpha, beta) pairs at once." << endl;
+  cout << "                                  The search is shared, so this costs little more than" << endl;
+  cout << "                                  one run. The output_image must then be a printf pattern" << endl;
+  cout << "                                  that takes the index of the pair, e.g. seg_%02d.nii.gz," << endl;
+  cout << "                                  and the -p pattern takes the index of the pair and the" << endl;
+  cout << "                                  label, e.g. posterior_%02d_%04d.nii.gz" << endl;
+  cout << "  --profile out.json              Write a profiling report (time spent in each phase, " << endl;
+  cout << "                                  voxels per thread, SVD fallbacks, peak memory and the" << endl;
+  cout << "                                  histogram of search distances) in JSON format" << endl;
+  cout << "  --estimate                      Do not run label fusion. Read the image headers and the" << endl;
+  cout << "                                  segmentations, and print the predicted peak memory and" << endl;
+  cout << "                                  run time of the job in JSON format" << endl;
+  cout << "  --batch jobs.tsv                Run several label fusion jobs in one process. Each line" << endl;
+  cout << "                                  of the file has tab-separated columns:" << endl;
+  cout << "                                    target output [atlases [labels [options]]]" << endl;
+  cout << "                                  Atlases and labels are space-separated lists, and options" << endl;
+  cout << "                                  are label_fusion options for that job. Empty columns or" << endl;
+  cout << "                                  '-' use the values given on the command line. A job's" << endl;
+  cout << "                                  -threads applies to that job only. Images used by several" << endl;
+  cout << "                                  jobs are only read once." << endl;
   cout << "Parameters for -m Gauss option:" << endl;
   cout << "  sigma                           Standard deviation of Gaussian" << endl;
   cout << "                                  Default: X.XX" << endl;
@@ -97,142 +193,145 @@ int usage()
   return -1;
 }
 
-enum LFMethod
-{
-  JOINT, GAUSSIAN, INVERSE 
-};
-
-template<unsigned int VDim> 
-struct LFParam
+/**
+ * Cache of loaded images for batch mode. Images that are used by more than one
+ * job (e.g., atlases shared between targets) are loaded once and kept in memory
+ * until the last job that uses them is done.
+ */
+template <unsigned int VDim>
+class LFImageCache
 {
-  vector<string> fnAtlas;
-  vector<string> fnLabel;
-  string fnTarget;
-  string fnOutput;
-  string fnPosterior;
-  string fnWeight;
-  LFMethod method;
-  string fnMask;
-
-  map<int, string> fnExclusion;
-
-  double alpha, beta, sigma;
-  itk::Size<VDim> r_patch, r_search;
-  
-  bool padding;
-  itk::Size<VDim> paddingSize;
+public:
+  typedef itk::Image<float, VDim> ImageType;
+  typedef typename ImageType::Pointer ImagePointer;
 
-  int threads;
+  /** Note that a job will use an image */
+  void AddReference(const string &key)
+    { m_RefCount[key]++; }
 
-  LFParam()
+  /** Get a cached image, or NULL if it is not in the cache */
+  ImagePointer Get(const string &key)
     {
-    alpha = 0.1;
-    beta = 2;
-    sigma = 0.5;
-    r_patch.Fill(3);
-    r_search.Fill(3);
-    method = JOINT;
-    padding = false;
-    threads = 0;
+    typename map<string, ImagePointer>::iterator it = m_Images.find(key);
+    return it == m_Images.end() ? ImagePointer() : it->second;
     }
 
-  void Print(std::ostream &oss)
+  /** Whether more than one job uses an image */
+  bool IsShared(const string &key) const
     {
-    oss << "Target image: " << fnTarget << endl;
-    oss << "Output image: " << fnOutput << endl;
-    oss << "Mask image  : " << fnMask << endl;
-    oss << "Atlas images: " << endl;
-    for(size_t i = 0; i < fnAtlas.size(); i++)
-      {
-      if(fnLabel.size())
-        oss << "    " << i << "\t" << fnAtlas[i] << " | " << fnLabel[i] << endl;
-      else
-        oss << "    " << i << "\t" << fnAtlas[i] << endl;
-      }
-    if(method == GAUSSIAN)
-      {
-      oss << "Method:     Gaussian" << endl;
-      oss << "    Sigma:  " << sigma << endl;
-      }
-    else if(method == JOINT)
-      {
-      oss << "Method:     Joint" << endl;
-      oss << "    Alpha:  " << alpha << endl;
-      oss << "    Beta:  " << beta << endl;
-      }
-    else if(method == INVERSE)
-      {
-      oss << "Method:     Inverse" << endl;
-      oss << "    Beta:  " << beta << endl;
-      }
-    oss << "Search Radius: " << r_search << endl;
-    oss << "Patch Radius: " << r_patch << endl;
-    if(fnPosterior.size())
-      oss << "Posterior Filename Pattern: " << fnPosterior << endl;
-    if(fnWeight.size())
-      oss << "Weight Map Filename Pattern: " << fnWeight << endl;
-
-    oss << "Padding Enabled: " << padding << endl;
-    if(padding)
-      oss << "Padding Radius: " << paddingSize << endl;
+    map<string, int>::const_iterator it = m_RefCount.find(key);
+    return it != m_RefCount.end() && it->second > 1;
     }
-};
 
+  /** Store an image, if it will be used again */
+  void Put(const string &key, ImageType *image)
+    {
+    if(IsShared(key))
+      m_Images[key] = image;
+    }
 
-template <unsigned int VDim>
-void ExpandRegion(itk::ImageRegion<VDim> &r, bool &isinit, const itk::Index<VDim> &idx)
-{
-  if(!isinit)
+  /** Note that a job is done with an image, and drop it if no one needs it */
+  void Release(const string &key)
     {
-    for(size_t d = 0; d < VDim; d++)
+    if(--m_RefCount[key] <= 0)
       {
-      r.SetIndex(d, idx[d]);
-      r.SetSize(d,1);
+      m_RefCount.erase(key);
+      m_Images.erase(key);
       }
-    isinit = true;
     }
-  else
+
+  /** The key for an image depends on the padding applied to it */
+  static string GetKey(const string &filename, const LFParam<VDim> &param)
     {
-    for(size_t d = 0; d < VDim; d++)
-      {
-      int x = r.GetIndex(d), s = r.GetSize(d);
-      if(idx[d] < x)
-        {
-        r.SetSize(d, s + x - idx[d]);
-        r.SetIndex(d, idx[d]);
-        }
-      else if(idx[d] >= x + s)
-        {
-        r.SetSize(d, 1 + idx[d] - x);
-        } 
-      }
+    ostringstream oss;
+    oss << filename;
+    if(param.padding)
+      for(int d = 0; d < VDim; d++)
+        oss << (d ? "x" : "|") << param.paddingSize[d];
+    return oss.str();
     }
+
+private:
+  map<string, int> m_RefCount;
+  map<string, ImagePointer> m_Images;
+};
+
+/**
+ * Keep only a region of an image in memory. The largest possible region is kept,
+ * so the indices and the physical positions of the voxels do not change
+ */
+template <unsigned int VDim>
+typename itk::Image<float, VDim>::Pointer
+CropToRegion(itk::Image<float, VDim> *image, const itk::ImageRegion<VDim> &region)
+{
+  typedef itk::Image<float, VDim> ImageType;
+  if(image->GetBufferedRegion() == region)
+    return image;
+
+  typename ImageType::Pointer out = ImageType::New();
+  out->CopyInformation(image);
+  out->SetBufferedRegion(region);
+  out->SetRequestedRegion(region);
+  out->Allocate();
+
+  itk::ImageRegionConstIterator<ImageType> itSrc(image, region);
+  itk::ImageRegionIterator<ImageType> itDst(out, region);
+  for(; !itSrc.IsAtEnd(); ++itSrc, ++itDst)
+    itDst.Set(itSrc.Get());
+
+  return out;
 }
 
-template <class TImage>
-void ExpandRegion(TImage *image, typename TImage::RegionType &r, bool &isinit)
+/** Read the header of an image, without its voxels */
+template <unsigned int VDim>
+typename itk::Image<float, VDim>::Pointer
+ReadImageInformation(string filename)
 {
-  for(itk::ImageRegionIteratorWithIndex<TImage> it(image, image->GetBufferedRegion()); 
-    !it.IsAtEnd(); ++it)
-    {
-    if(it.Get())
-      {
-      ExpandRegion<TImage::ImageDimension>(r, isinit, it.GetIndex());
-      }
-    }
+  typedef itk::Image<float, VDim> ImageType;
+  typedef itk::ImageFileReader<ImageType> ReaderType;
+  typename ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(filename.c_str());
+  reader->UpdateOutputInformation();
+  return reader->GetOutput();
 }
 
+/**
+ * Read an image, padding it if requested. If a region is given, only that region
+ * of the image is kept in memory, and it is streamed from the file unless the
+ * whole image is cached for other jobs.
+ */
 template <unsigned int VDim>
 typename itk::Image<float, VDim>::Pointer
-LoadAndPadImage(string filename, const LFParam<VDim> &param)
+LoadAndPadImage(string filename, const LFParam<VDim> &param, LFImageCache<VDim> *cache = NULL,
+                const itk::ImageRegion<VDim> *region = NULL)
 {
   // Image type
   typedef itk::Image<float, VDim> ImageType;
 
+  // Check the cache first
+  string key;
+  if(cache)
+    {
+    key = LFImageCache<VDim>::GetKey(filename, param);
+    typename ImageType::Pointer cached = cache->Get(key);
+    if(cached)
+      return region ? CropToRegion<VDim>(cached, *region) : cached;
+    }
+
   // Set up the image reader
   typedef itk::ImageFileReader<ImageType> ReaderType;
   typename ReaderType::Pointer reader = ReaderType::New();
   reader->SetFileName(filename.c_str());
+
+  // Only read the region from the file. Padding needs the whole image
+  bool streamed = region && !param.padding && !(cache && cache->IsShared(key));
+  if(streamed)
+    {
+    reader->UpdateOutputInformation();
+    itk::ImageRegion<VDim> rRead = *region;
+    rRead.Crop(reader->GetOutput()->GetLargestPossibleRegion());
+    reader->GetOutput()->SetRequestedRegion(rRead);
+    }
   reader->Update();
 
   // Read the image
@@ -250,58 +349,59 @@ LoadAndPadImage(string filename, const LFParam<VDim> &param)
     image = padTarget->GetOutput();
     }
 
+  if(cache)
+    cache->Put(key, image);
+
+  // Crop to the region, also after a streamed read, since the readers of formats
+  // that can not stream (e.g., compressed NIfTI) read the whole image anyway
+  if(region)
+    image = CropToRegion<VDim>(image, *region);
+
   return image;
 }
 
 
-template<unsigned int VDim>
-bool
-parse_vector(char *text, itk::Size<VDim> &s)
+
+template <unsigned int VDim>
+typename itk::Image<float, VDim>::Pointer
+CropPadding(itk::Image<float, VDim> *image, const LFParam<VDim> &param)
 {
-  char *t = strtok(text,"x");
-  size_t i = 0;
-  while(t && i < VDim)
-    {
-    s[i++] = atoi(t);
-    t = strtok(NULL, "x");
-    }
+  typedef itk::Image<float, VDim> ImageType;
+  typename ImageType::Pointer out = image;
 
-  if(i == VDim)
-    return true;
-  else if(i == 1)
+  // Remove the padding added by LoadAndPadImage
+  if(param.padding)
     {
-    s.Fill(s[0]);
-    return true;
+    typedef itk::CropImageFilter<ImageType, ImageType> CropFilter;
+    typename CropFilter::Pointer fltCrop = CropFilter::New();
+    fltCrop->SetInput(image);
+    fltCrop->SetUpperBoundaryCropSize(param.paddingSize);
+    fltCrop->SetLowerBoundaryCropSize(param.paddingSize);
+    fltCrop->Update();
+    out = fltCrop->GetOutput();
     }
-  return false;
+
+  return out;
 }
 
 template <unsigned int VDim>
-int lfapp(int argc, char *argv[])
+int ParseOptions(LFParam<VDim> &p, char *argv[], int jstart, int argend)
 {
-  // Parameter vector
-  LFParam<VDim> p;
-
-  // Read the parameters from command line
-  p.fnOutput = argv[argc-1];
-  p.fnTarget = argv[argc-2];
-  int argend = argc-2;
-
-  for(int j = 2; j < argc-2; j++)
+  for(int j = jstart; j < argend; j++)
     {
     string arg = argv[j];
     
     if(arg == "-g")
       {
       // Read the following options as images
-      while(argv[j+1][0] != '-' && j < argend-1)
+      while(j < argend-1 && argv[j+1][0] != '-')
         p.fnAtlas.push_back(argv[++j]);
       }
 
     else if(arg == "-l")
       {
       // Read the following options as images
-      while(argv[j+1][0] != '-' && j < argend-1)
+      while(j < argend-1 && argv[j+1][0] != '-')
         p.fnLabel.push_back(argv[++j]);
       }
 
@@ -333,6 +433,21 @@ int lfapp(int argc, char *argv[])
       p.fnMask = image;
       }
 
+    else if(arg == "--profile")
+      {
+      p.fnProfile = argv[++j];
+      }
+
+    else if(arg == "--estimate")
+      {
+      p.estimate = true;
+      }
+
+    else if(arg == "--batch" && j < argend-1)
+      {
+      p.fnBatch = argv[++j];
+      }
+
     else if(arg == "-m" && j < argend-1)
       {
       char *parm = argv[++j];
@@ -371,6 +486,24 @@ int lfapp(int argc, char *argv[])
         }
       }
     
+    else if(arg == "--search-mm" && j < argend-1)
+      {
+      if(!parse_vector<VDim>(argv[++j], p.r_search_mm))
+        {
+        cerr << "Bad vector spec " << argv[j] << endl;
+        return -1;
+        }
+      }
+
+    else if(arg == "--patch-mm" && j < argend-1)
+      {
+      if(!parse_vector<VDim>(argv[++j], p.r_patch_mm))
+        {
+        cerr << "Bad vector spec " << argv[j] << endl;
+        return -1;
+        }
+      }
+
     else if(arg == "-rp" && j < argend-1)
       {
       if(!parse_vector<VDim>(argv[++j], p.r_patch))
@@ -380,6 +513,177 @@ int lfapp(int argc, char *argv[])
         }
       }
 
+    else if(arg == "--weight-stride" && j < argend-1)
+      {
+      if(!parse_vector<VDim>(argv[++j], p.weightStride))
+        {
+        cerr << "Bad vector spec " << argv[j] << endl;
+        return -1;
+        }
+      for(int d = 0; d < VDim; d++)
+        {
+        if(p.weightStride[d] < 1)
+          {
+          cerr << "Weight stride must be positive" << endl;
+          return -1;
+          }
+        }
+      }
+
+    else if(arg == "--auto-search" && j < argend-1)
+      {
+      p.autoSearch = atof(argv[++j]);
+      if(p.autoSearch <= 0 || p.autoSearch > 1)
+        {
+        cerr << "Automatic search fraction must be between 0 and 1" << endl;
+        return -1;
+        }
+      }
+
+    else if(arg == "--cascade" && j < argend-1)
+      {
+      p.cascadeMargin = atof(argv[++j]);
+      if(p.cascadeMargin <= 0 || p.cascadeMargin > 1)
+        {
+        cerr << "Cascade margin must be between 0 and 1" << endl;
+        return -1;
+        }
+      }
+
+    else if(arg == "--tile" && j < argend-1)
+      {
+      if(!parse_vector<VDim>(argv[++j], p.tileSize))
+        {
+        cerr << "Bad vector spec " << argv[j] << endl;
+        return -1;
+        }
+      for(int d = 0; d < VDim; d++)
+        {
+        if(p.tileSize[d] < 1)
+          {
+          cerr << "Tile size must be positive" << endl;
+          return -1;
+          }
+        }
+      }
+
+    else if(arg == "--partition" && j < argend-1)
+      {
+      if(sscanf(argv[++j], "%d/%d", &p.partIndex, &p.partCount) != 2 
+        || p.partCount < 1 || p.partIndex < 0 || p.partIndex >= p.partCount)
+        {
+        cerr << "Bad partition spec " << argv[j] << ", expected i/N with 0 <= i < N" << endl;
+        return -1;
+        }
+      }
+
+    else if(arg == "--checkpoint" && j < argend-1)
+      {
+      p.fnCheckpoint = argv[++j];
+      }
+
+    else if(arg == "--checkpoint-interval" && j < argend-1)
+      {
+      p.checkpointInterval = atof(argv[++j]);
+      if(p.checkpointInterval < 0)
+        {
+        cerr << "Checkpoint interval must not be negative" << endl;
+        return -1;
+        }
+      }
+
+    else if(arg == "--heartbeat" && j < argend-1)
+      {
+      p.fnHeartbeat = argv[++j];
+      }
+
+    else if(arg == "--heartbeat-interval" && j < argend-1)
+      {
+      p.heartbeatInterval = atof(argv[++j]);
+      if(p.heartbeatInterval <= 0)
+        {
+        cerr << "Heartbeat interval must be positive" << endl;
+        return -1;
+        }
+      }
+
+    else if(arg == "--resume")
+      {
+      p.resume = true;
+      }
+
+    else if(arg == "--sweep")
+      {
+      // Read the following options as alpha,beta pairs
+      while(j < argend-1 && argv[j+1][0] != '-')
+        {
+        double alpha, beta;
+        if(sscanf(argv[++j], "%lf,%lf", &alpha, &beta) != 2)
+          {
+          cerr << "Bad sweep spec " << argv[j] << ", expected alpha,beta" << endl;
+          return -1;
+          }
+        p.sweep.push_back(make_pair(alpha, beta));
+        }
+      }
+
+    else if(arg == "--patchmatch")
+      {
+      p.patchMatch = true;
+      }
+
+    else if(arg == "--patchmatch-check" && j < argend-1)
+      {
+      p.patchMatchCheck = atof(argv[++j]);
+      if(p.patchMatchCheck < 0 || p.patchMatchCheck > 1)
+        {
+        cerr << "PatchMatch check fraction must be between 0 and 1" << endl;
+        return -1;
+        }
+      }
+
+    else if(arg == "--pca-search" && j < argend-1)
+      {
+      int nRead = sscanf(argv[++j], "%d:%d", &p.pcaComponents, &p.pcaCandidates);
+      if(nRead < 1 || p.pcaComponents < 1 || p.pcaCandidates < 1 || p.pcaCandidates > 32)
+        {
+        cerr << "Bad PCA search spec " << argv[j] << ", expected K or K:M with 1 <= M <= 32" << endl;
+        return -1;
+        }
+      }
+
+    else if(arg == "--numa")
+      {
+      p.numa = true;
+      }
+
+    else if(arg == "--simd-solve")
+      {
+      p.simdSolve = true;
+      }
+
+    else if(arg == "--solve-fallback" && j < argend-1)
+      {
+      string mode = argv[++j];
+      if(mode == "svd")
+        {
+        p.ridgeRetries = 0;
+        }
+      else if(mode == "ridge")
+        {
+        p.ridgeRetries = 4;
+        }
+      else if(mode.compare(0, 6, "ridge:") == 0 && atoi(mode.c_str() + 6) > 0)
+        {
+        p.ridgeRetries = atoi(mode.c_str() + 6);
+        }
+      else
+        {
+        cerr << "Unknown solve fallback " << mode << endl;
+        return -1;
+        }
+      }
+
     else if(arg == "-pd" && j < argend-1)
       {
       if(!parse_vector<VDim>(argv[++j], p.paddingSize))
@@ -399,7 +703,12 @@ int lfapp(int argc, char *argv[])
       }
     }
 
-  // We have the parameters now. Check for validity
+  return 0;
+}
+
+template <unsigned int VDim>
+int CheckParameters(const LFParam<VDim> &p)
+{
   if(p.fnAtlas.size() != p.fnLabel.size() && p.fnLabel.size() > 0)
     {
     cerr << "Number of atlases and segmentations does not match" << endl;
@@ -435,255 +744,842 @@ int lfapp(int argc, char *argv[])
       }
 
     itk::Size<VDim> zeroSize; zeroSize.Fill(0);
-    if(p.r_search != zeroSize)
+    if(p.r_search != zeroSize || p.r_search_mm.GetNorm() > 0)
       {
       cerr << "Weight maps can only be used with zero search radius! Use -rs 0x0x0" << endl;
       return -1;
       }
     }
 
-  // Print parametes
-  cout << "LABEL FUSION PARAMETERS:" << endl;
-  p.Print(cout);
+  if(p.patchMatch && p.pcaComponents > 0)
+    {
+    cerr << "--patchmatch and --pca-search can not be combined" << endl;
+    return -1;
+    }
+
+  if(p.sweep.size())
+    {
+    if(p.method != JOINT || p.fnLabel.size() == 0)
+      {
+      cerr << "--sweep requires joint fusion with atlas segmentations" << endl;
+      return -1;
+      }
+
+    if(p.partCount > 0 || p.fnWeight.size())
+      {
+      cerr << "--sweep can not be combined with --partition or -w" << endl;
+      return -1;
+      }
+
+    // The output takes the index of the pair, and the posteriors the pair and label
+    char buffer[4096];
+    sprintf(buffer, p.fnOutput.c_str(), 100);
+    if(strcmp(buffer, p.fnOutput.c_str()) == 0)
+      {
+      cerr << "With --sweep, the output must be a filename pattern, e.g. seg_%02d.nii.gz" << endl;
+      return -1;
+      }
+
+    if(p.fnPosterior.size())
+      {
+      char b1[4096], b2[4096], b3[4096];
+      sprintf(b1, p.fnPosterior.c_str(), 1, 2);
+      sprintf(b2, p.fnPosterior.c_str(), 3, 2);
+      sprintf(b3, p.fnPosterior.c_str(), 1, 3);
+      if(strcmp(b1, b2) == 0 || strcmp(b1, b3) == 0)
+        {
+        cerr << "With --sweep, the posterior filename pattern must take the pair index and"
+          << " the label, e.g. posterior_%02d_%04d.nii.gz" << endl;
+        return -1;
+        }
+      }
+    }
 
-  // Use the threads parameter
-  if(p.threads > 0)
+  if(p.resume && p.fnCheckpoint.empty())
     {
-    std::cout << "Limiting the number of threads to " << p.threads << std::endl;
-    itk::MultiThreader::SetGlobalMaximumNumberOfThreads(p.threads);
+    cerr << "--resume requires --checkpoint" << endl;
+    return -1;
     }
-  else
+
+  if(p.partCount > 0)
     {
-    std::cout << "Executing with the default number of threads: " << itk::MultiThreader::GetGlobalDefaultNumberOfThreads() << std::endl;
+    if(p.fnLabel.size() == 0)
+      {
+      cerr << "Partitions require atlas segmentations" << endl;
+      return -1;
+      }
+
+    if(p.fnPosterior.size() || p.fnWeight.size())
+      {
+      cerr << "Posterior and weight maps can not be saved by a partition. Use the -p option" 
+        << " of label_fusion_merge for the posteriors" << endl;
+      return -1;
+      }
+
+    for(int d = 0; d < VDim; d++)
+      {
+      if(p.weightStride[d] > 1)
+        {
+        cerr << "Partitions can not be used with --weight-stride" << endl;
+        return -1;
+        }
+      }
     }
 
-  // Configure the filter
+  return 0;
+}
+
+/** 
+ * Write the segmentation and the optional weight and posterior maps. For a parameter
+ * sweep, the segmentation and the posterior maps of each pair are written, with the
+ * index of the pair filled into the filename patterns.
+ */
+template <unsigned int VDim>
+int WriteResult(const LFParam<VDim> &p, LFResult<VDim> &out)
+{
   typedef itk::Image<float, VDim> ImageType;
   typedef typename ImageType::Pointer ImagePointer;
-  typedef WeightedVotingLabelFusionImageFilter<ImageType, ImageType> VoterType;
-  typename VoterType::Pointer voter = VoterType::New();
+  typedef itk::ImageFileWriter<ImageType> WriterType;
+
+  for(size_t s = 0; s < std::max((size_t) 1, p.sweep.size()); s++)
+    {
+    ImagePointer seg = s ? out.sweepSegmentation[s-1] : out.segmentation;
+    const map<int, ImagePointer> &posterior = s ? out.sweepPosterior[s-1] : out.posterior;
+
+    // Get the filename
+    char buffer[4096];
+    string fnOutput = p.fnOutput;
+    if(p.sweep.size())
+      {
+      sprintf(buffer, p.fnOutput.c_str(), (int) s);
+      fnOutput = buffer;
+      cout << "Sweep pair " << s << " (alpha = " << p.sweep[s].first << ", beta = " 
+        << p.sweep[s].second << "): " << fnOutput << endl;
+      }
+
+    // Write the segmentation, cropping it if the image was padded
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetInput(CropPadding<VDim>(seg, p));
+    writer->SetFileName(fnOutput.c_str());
+    writer->Update();
+
+    // Store the posterior maps
+    for(typename map<int, ImagePointer>::const_iterator it = posterior.begin(); 
+      it != posterior.end(); it++)
+      {
+      if(p.sweep.size())
+        sprintf(buffer, p.fnPosterior.c_str(), (int) s, it->first);
+      else
+        sprintf(buffer, p.fnPosterior.c_str(), it->first);
+
+      typename WriterType::Pointer writer = WriterType::New();
+      writer->SetInput(CropPadding<VDim>(it->second, p));
+      writer->SetFileName(buffer);
+      writer->Update();
+      }
+    }
+
+  // Store the weight maps
+  for(size_t i = 0; i < out.weight.size(); i++)
+    {
+    // Get the filename
+    char buffer[4096];
+    sprintf(buffer, p.fnWeight.c_str(), (int) i);
+
+    // Create writer
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetInput(CropPadding<VDim>(out.weight[i], p));
+    writer->SetFileName(buffer);
+    writer->Update();
+    }
+
+  return 0;
+}
+
+/** Write the part of an image inside a region, cropping the padding if any */
+template <unsigned int VDim>
+void WriteImageRegion(itk::Image<float, VDim> *image, itk::ImageRegion<VDim> region, 
+                      const LFParam<VDim> &param, const string &filename)
+{
+  typedef itk::Image<float, VDim> ImageType;
+
+  // Take the padding off the region
+  if(param.padding)
+    {
+    itk::ImageRegion<VDim> rCrop = image->GetLargestPossibleRegion();
+    for(int d = 0; d < VDim; d++)
+      {
+      rCrop.SetIndex(d, rCrop.GetIndex(d) + param.paddingSize[d]);
+      rCrop.SetSize(d, rCrop.GetSize(d) - 2 * param.paddingSize[d]);
+      }
+    region.Crop(rCrop);
+    }
+
+  typedef itk::RegionOfInterestImageFilter<ImageType, ImageType> ROIFilter;
+  typename ROIFilter::Pointer roi = ROIFilter::New();
+  roi->SetInput(image);
+  roi->SetRegionOfInterest(region);
 
-  // Set inputs
-  typedef itk::ImageFileReader<ImageType> ReaderType;
   typedef itk::ImageFileWriter<ImageType> WriterType;
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetInput(roi->GetOutput());
+  writer->SetFileName(filename.c_str());
+  writer->Update();
+}
+
+/**
+ * Write the result of a partition for label_fusion_merge. The output filename is
+ * used as a prefix. The sums of the votes for each label and the counter cover the
+ * slab with its halo, and the segmentation and voting mask cover the slab itself.
+ * The voxels are matched up by physical position when merging. The partition number
+ * and labels are listed in the text file prefix.txt.
+ */
+template <unsigned int VDim>
+int WritePartition(const LFParam<VDim> &p, LFResult<VDim> &out)
+{
+  typedef itk::Image<float, VDim> ImageType;
+  typedef typename ImageType::Pointer ImagePointer;
+  string prefix = p.fnOutput;
+
+  WriteImageRegion<VDim>(out.segmentation, out.core, p, prefix + "_seg.nii.gz");
+  WriteImageRegion<VDim>(out.votingMask, out.core, p, prefix + "_mask.nii.gz");
+  WriteImageRegion<VDim>(out.counter, out.region, p, prefix + "_counter.nii.gz");
 
-  // Read the target image
-  ImagePointer target = LoadAndPadImage(p.fnTarget, p);
-  voter->SetTargetImage(target);
+  ofstream fout((prefix + ".txt").c_str());
+  if(!fout.good())
+    {
+    cerr << "Can not write partition list to " << prefix << ".txt" << endl;
+    return -1;
+    }
+
+  fout << "partition " << p.partIndex << " " << p.partCount << endl;
+  fout << "labels";
+  for(typename map<int, ImagePointer>::const_iterator it = out.posterior.begin(); 
+    it != out.posterior.end(); it++)
+    {
+    char buffer[4096];
+    sprintf(buffer, "%s_post%04d.nii.gz", prefix.c_str(), it->first);
+    WriteImageRegion<VDim>(it->second, out.region, p, buffer);
+    fout << " " << it->first;
+    }
+  fout << endl;
+
+  return 0;
+}
+
+template <unsigned int VDim>
+int RunJob(const LFParam<VDim> &p, LFImageCache<VDim> *cache = NULL)
+{
+  // Optional profiling
+  LabelFusionProfile profile;
+  LabelFusionProfile *pProfile = NULL;
+  if(p.fnProfile.size())
+    {
+    pProfile = &profile;
+    profile.SetInfo("target", p.fnTarget);
+    profile.SetInfo("output", p.fnOutput);
+    profile.StartPhase("load");
+    }
 
-  // Compute the output region by merging all segmentations
-  itk::ImageRegion<VDim> rMask;
-  bool isMaskInit = false;
+  // Optional progress heartbeat
+  ASHSHeartbeat heartbeat("label_fusion");
+  ASHSHeartbeat *pHeartbeat = NULL;
+  if(p.fnHeartbeat.size())
+    {
+    pHeartbeat = &heartbeat;
+    heartbeat.Start(p.fnHeartbeat, p.heartbeatInterval);
+    heartbeat.StartPhase("load", (p.fnMask.length() ? 1 : 0) + p.fnLabel.size() + 1 
+                         + p.fnAtlas.size() + p.fnExclusion.size(), "images");
+    }
 
-  // Read the mask image
+  // Read the mask and the segmentations first. They determine the region of the
+  // images that label fusion reads, so that only that region of the other images
+  // has to be read. With padding, the images are read whole
+  LFInputs<VDim> in;
   if(p.fnMask.length())
     {
-    // Read the mask image
-    ImagePointer mask = LoadAndPadImage(p.fnMask, p);
-    voter->SetMaskImage(mask);
+    in.mask = LoadAndPadImage(p.fnMask, p, cache);
+    if(pHeartbeat)
+      heartbeat.Add(1);
+    }
+
+  for(size_t i = 0; i < p.fnLabel.size(); i++)
+    {
+    in.label.push_back(LoadAndPadImage(p.fnLabel[i], p, cache));
+    if(pHeartbeat)
+      heartbeat.Add(1);
+    }
 
-    // Initialize the mask region based on the mask
-    ExpandRegion(mask.GetPointer(), rMask, isMaskInit);
+  itk::ImageRegion<VDim> rLoad;
+  const itk::ImageRegion<VDim> *pLoad = NULL;
+  if(!p.padding && (in.mask || in.label.size()))
+    {
+    rLoad = GetFusionInputRegion(p, in, ReadImageInformation<VDim>(p.fnTarget).GetPointer());
+    pLoad = &rLoad;
+    std::cout << "Reading the images in region " << rLoad.GetIndex() << ", " << rLoad.GetSize() 
+      << " (" << rLoad.GetNumberOfPixels() << " pixels)" << std::endl;
+    if(pProfile)
+      profile.SetCounter("load_voxels", rLoad.GetNumberOfPixels());
+
+    // Release the parts of the segmentations outside of the region
+    if(in.mask)
+      in.mask = CropToRegion<VDim>(in.mask, rLoad);
+    for(size_t i = 0; i < in.label.size(); i++)
+      in.label[i] = CropToRegion<VDim>(in.label[i], rLoad);
     }
 
-  std::vector<typename ReaderType::Pointer> rAtlas, rLabel;
+  // Read the target, atlases and exclusions in that region
+  in.target = LoadAndPadImage(p.fnTarget, p, cache, pLoad);
+  if(pHeartbeat)
+    heartbeat.Add(1);
+
   for(size_t i = 0; i < p.fnAtlas.size(); i++)
     {
-    if(p.fnLabel.size())
+    in.atlas.push_back(LoadAndPadImage(p.fnAtlas[i], p, cache, pLoad));
+    if(pHeartbeat)
+      heartbeat.Add(1);
+    }
+
+  for(typename map<int,string>::const_iterator xit = p.fnExclusion.begin(); xit != p.fnExclusion.end(); ++xit)
+    {
+    in.exclusion[xit->first] = LoadAndPadImage(xit->second, p, cache, pLoad);
+    if(pHeartbeat)
+      heartbeat.Add(1);
+    }
+
+  if(p.fnProfile.size())
+    profile.EndPhase();
+
+  // Run label fusion
+  LFResult<VDim> out;
+  RunLabelFusion(p, in, out, pProfile, NULL, pHeartbeat);
+
+  if(p.fnProfile.size())
+    profile.StartPhase("write");
+  if(pHeartbeat)
+    heartbeat.StartPhase("write", 0, "");
+
+  // Write the segmentation and the maps, or the sums of the votes for a partition
+  if((p.partCount > 0 ? WritePartition(p, out) : WriteResult(p, out)) != 0)
+    return -1;
+
+  // Write the profiling report
+  if(p.fnProfile.size())
+    {
+    profile.EndPhase();
+    ofstream fout(p.fnProfile.c_str());
+    if(!fout.good())
       {
-      ImagePointer imgAtlas = LoadAndPadImage(p.fnAtlas[i], p);
-      ImagePointer imgLabel = LoadAndPadImage(p.fnLabel[i], p);
-      voter->AddAtlas(imgAtlas, imgLabel);
-      
-      // Update the mask region
-      ExpandRegion(imgLabel.GetPointer(), rMask, isMaskInit);
+      cerr << "Can not write profile to " << p.fnProfile << endl;
+      return -1;
       }
-    else
+    profile.WriteJSON(fout);
+    }
+
+  return 0;
+}
+
+/** 
+ * The number of offsets in a patch or search neighborhood, as in the filter's
+ * ComputeNeighborhood: the box, or the part of it inside the ellipsoid given in mm
+ */
+template <unsigned int VDim>
+unsigned long CountNeighborhood(const itk::Size<VDim> &radius, 
+                                const typename itk::Image<float, VDim>::SpacingType &spacing,
+                                const itk::Vector<double, VDim> &radiusPhysical)
+{
+  bool ellipsoid = false;
+  unsigned long nBox = 1;
+  for(int d = 0; d < VDim; d++)
+    {
+    nBox *= 2 * radius[d] + 1;
+    if(radiusPhysical[d] > 0)
+      ellipsoid = true;
+    }
+  if(!ellipsoid)
+    return nBox;
+
+  unsigned long n = 0;
+  for(unsigned long k = 0; k < nBox; k++)
+    {
+    double r2 = 0.0;
+    bool inside = true;
+    for(unsigned long d = 0, rest = k; d < VDim; rest /= 2 * radius[d] + 1, d++)
       {
-      ImagePointer imgAtlas = LoadAndPadImage(p.fnAtlas[i], p);
-      voter->AddAtlas(imgAtlas);
+      long off = (long) (rest % (2 * radius[d] + 1)) - (long) radius[d];
+      if(radiusPhysical[d] > 0)
+        {
+        double x = off * spacing[d] / radiusPhysical[d];
+        r2 += x * x;
+        }
+      else if(off != 0)
+        inside = false;
       }
+    if(inside && r2 <= 1.0 + 1.0e-6)
+      n++;
+    }
+  return n;
+}
 
-    // Unload the image if needed (so that memory is freed up)
-    // PY: I DON'T UNDERSTAND THIS - IT'S CAUSING A BUG!
-    // rl->GetOutput()->ReleaseData();
+/**
+ * The voxels of a region where the filter estimates the weights. With a mask, these
+ * are the voxels in the mask. Otherwise, they are the voxels where the atlas labels
+ * in the search box are not all the same, which is found from the smallest and the
+ * largest label of the atlases at each voxel, spread over the search box.
+ */
+template <unsigned int VDim>
+unsigned long CountFusedVoxels(const LFInputs<VDim> &in, const itk::ImageRegion<VDim> &region,
+                               const itk::Size<VDim> &rSearch)
+{
+  typedef itk::Image<float, VDim> ImageType;
+  typedef itk::ImageRegionConstIterator<ImageType> IterType;
+
+  if(in.mask)
+    {
+    unsigned long n = 0;
+    for(IterType it(in.mask, region); !it.IsAtEnd(); ++it)
+      if(it.Get() != 0)
+        n++;
+    return n;
     }
 
-  // If the region has not been set up, set the region to be the target region
-  if(!isMaskInit)
+  if(in.label.size() == 0)
+    return region.GetNumberOfPixels();
+
+  // The labels are read in the region padded by the search radius
+  itk::ImageRegion<VDim> rSpread = region;
+  rSpread.PadByRadius(rSearch);
+  rSpread.Crop(in.label[0]->GetBufferedRegion());
+
+  // Negate the smallest label, so that both use the box maximum
+  size_t nPix = rSpread.GetNumberOfPixels();
+  std::vector<float> lo(nPix), hi(nPix);
+  for(size_t i = 0; i < in.label.size(); i++)
     {
-    isMaskInit = true;
-    rMask = target->GetBufferedRegion();
+    size_t k = 0;
+    for(IterType it(in.label[i], rSpread); !it.IsAtEnd(); ++it, ++k)
+      {
+      float v = it.Get();
+      lo[k] = (i == 0 || -v > lo[k]) ? -v : lo[k];
+      hi[k] = (i == 0 || v > hi[k]) ? v : hi[k];
+      }
     }
 
-  // Make sure the region is inside bounds
-  itk::ImageRegion<VDim> rOut = target->GetLargestPossibleRegion();
-  for(int d = 0; d < 3; d++)
+  std::vector<long> size(VDim), radius(VDim);
+  for(int d = 0; d < VDim; d++)
     {
-    rOut.SetIndex(d, p.r_patch[d] + p.r_search[d] + rOut.GetIndex(d));
-    rOut.SetSize(d, rOut.GetSize(d) - 2 * (p.r_search[d] + p.r_patch[d]));
+    size[d] = rSpread.GetSize(d);
+    radius[d] = rSearch[d];
     }
-  rMask.Crop(rOut);
+  ASHSBoxMaximum(lo, size, radius);
+  ASHSBoxMaximum(hi, size, radius);
+
+  // Count the voxels of the region where the labels differ
+  unsigned long n = 0;
+  itk::ImageRegionConstIteratorWithIndex<ImageType> it(in.label[0], rSpread);
+  for(size_t k = 0; !it.IsAtEnd(); ++it, ++k)
+    if(-lo[k] != hi[k] && region.IsInside(it.GetIndex()))
+      n++;
+  return n;
+}
 
-  voter->SetPatchRadius(p.r_patch);
-  voter->SetSearchRadius(p.r_search);
-  voter->SetAlpha(p.alpha);
-  voter->SetBeta(p.beta);
+/** The number of different labels in the segmentations, inside a region */
+template <unsigned int VDim>
+unsigned long CountLabels(const LFInputs<VDim> &in, const itk::ImageRegion<VDim> &region)
+{
+  typedef itk::Image<float, VDim> ImageType;
+  std::set<float> labels;
+  for(size_t i = 0; i < in.label.size(); i++)
+    {
+    float last = 0.0f;
+    bool first = true;
+    for(itk::ImageRegionConstIterator<ImageType> it(in.label[i], region); !it.IsAtEnd(); ++it)
+      {
+      if(first || it.Get() != last)
+        {
+        last = it.Get();
+        labels.insert(last);
+        first = false;
+        }
+      }
+    }
+  return labels.size();
+}
 
-  // The posterior maps
-  if(p.fnPosterior.size())
-    voter->SetRetainPosteriorMaps(true);
+/**
+ * Predict the peak memory and the run time of a job without running it. Only the
+ * headers of the target and the atlases are read, and the mask and segmentations,
+ * which give the region, the fused voxels and the labels. The estimate is printed
+ * as JSON on standard output.
+ */
+template <unsigned int VDim>
+int EstimateJob(const LFParam<VDim> &p, int threads)
+{
+  typedef itk::Image<float, VDim> ImageType;
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef itk::ImageRegion<VDim> RegionType;
 
-  if(p.fnWeight.size())
-    voter->SetGenerateWeightMaps(true);
+  // Read the segmentations as the job would, and the geometry of the target
+  LFInputs<VDim> in;
+  if(p.fnMask.length())
+    in.mask = LoadAndPadImage(p.fnMask, p);
+  for(size_t i = 0; i < p.fnLabel.size(); i++)
+    in.label.push_back(LoadAndPadImage(p.fnLabel[i], p));
 
-  std::cout << "Output Requested Region: " << rMask.GetIndex() << ", " << rMask.GetSize() << " ("
-    << rMask.GetNumberOfPixels() << " pixels)" << std::endl;
-  /*
-  rr.SetIndex(0,275); rr.SetSize(0,10);
-  rr.SetIndex(1,210); rr.SetSize(1,10);
-  rr.SetIndex(2,4); rr.SetSize(2,10);
-  */
+  ImagePointer target = ReadImageInformation<VDim>(p.fnTarget);
+  RegionType rFull = target->GetLargestPossibleRegion();
+  if(p.padding)
+    {
+    rFull.PadByRadius(p.paddingSize);
+    target->SetLargestPossibleRegion(rFull);
+    }
 
-  // Set the exclusions in the atlas
-  for(typename map<int,string>::iterator xit = p.fnExclusion.begin(); xit != p.fnExclusion.end(); ++xit)
+  // The regions that the job reads, fuses and estimates the weights in
+  itk::Size<VDim> rPatch, rSearch;
+  RegionType rFuse = GetFusionRegion(p, in, target.GetPointer(), rPatch, rSearch);
+  RegionType rCore = GetPartitionRegion(p, rFuse);
+  RegionType rOut = rCore;
+  if(p.partCount > 0)
+    {
+    rOut.PadByRadius(rPatch);
+    rOut.Crop(GetFusionBounds(target.GetPointer(), rPatch, rSearch));
+    }
+  RegionType rLoad = rFull;
+  if(!p.padding && (in.mask || in.label.size()))
+    rLoad = GetFusionInputRegion(p, in, target.GetPointer());
+
+  double nAtlas = p.fnAtlas.size(), nFull = rFull.GetNumberOfPixels();
+  double nLoad = rLoad.GetNumberOfPixels(), nOut = rOut.GetNumberOfPixels();
+  double nFused = CountFusedVoxels(in, rCore, rSearch);
+  double nLabels = in.label.size() ? CountLabels(in, rLoad) : 0;
+  double nPairs = std::max((size_t) 1, p.sweep.size());
+  double nPatch = CountNeighborhood<VDim>(rPatch, target->GetSpacing(), p.r_patch_mm);
+  double nSearch = CountNeighborhood<VDim>(rSearch, target->GetSpacing(), p.r_search_mm);
+
+  // The weights are only estimated on the lattice of the stride
+  double nEstimated = nFused;
+  for(int d = 0; d < VDim; d++)
+    nEstimated /= p.weightStride[d];
+
+  ASHSEstimate est("label_fusion");
+  est.SetInput("atlases", nAtlas);
+  est.SetInput("labels", nLabels);
+  est.SetInput("parameter_pairs", nPairs);
+  est.SetInput("image_voxels", nFull);
+  est.SetInput("load_voxels", nLoad);
+  est.SetInput("region_voxels", nOut);
+  est.SetInput("fused_voxels", nFused);
+  est.SetInput("estimated_voxels", nEstimated);
+  est.SetInput("patch_voxels", nPatch);
+  est.SetInput("search_voxels", nSearch);
+
+  // The images in memory during the fusion
+  double nImages = 1 + nAtlas * (in.label.size() ? 2 : 1) + (in.mask ? 1 : 0) + p.fnExclusion.size();
+  double bImages = 4.0 * nLoad * nImages;
+  double bSegRead = 4.0 * nFull * (in.label.size() + (in.mask ? 1 : 0));
+  double bVotes = 4.0 * nOut * 4 * ceil(std::max(nLabels, 1.0) / 4) * nPairs;
+  double bWork = 4.0 * nOut * 3;
+  double bWeights = p.fnWeight.size() ? 4.0 * nAtlas * (nOut + nFull) : 0.0;
+  double bSearch = 0.0;
+  if(p.pcaComponents > 0)
+    bSearch += 4.0 * nAtlas * nLoad * (p.pcaComponents + 1);
+  if(p.patchMatch)
+    bSearch += 4.0 * nAtlas * nOut;
+  double bPosterior = (p.fnPosterior.size() || p.partCount > 0) ? 4.0 * nLabels * (nOut + nFull) * nPairs : 0.0;
+  double bOutput = 4.0 * nFull * nPairs;
+
+  est.SetMemory("images", bImages);
+  est.SetMemory("segmentations_read", bSegRead);
+  est.SetMemory("votes", bVotes);
+  est.SetMemory("work", bWork);
+  est.SetMemory("weight_maps", bWeights);
+  est.SetMemory("search", bSearch);
+  est.SetMemory("posterior_maps", bPosterior);
+  est.SetMemory("outputs", bOutput);
+
+  // The segmentations are read whole before the other images. During the fusion 
+  // the votes are held, and then the posterior maps that replace them
+  double bFusion = bImages + bWork + bWeights + bSearch + std::max(bVotes, bPosterior);
+  est.SetPeakMemory(std::max(bSegRead + 4.0 * nLoad, bFusion + bOutput));
+
+  // The segmentations are read whole, and the other images in the load region
+  est.SetReadBytes(bSegRead + 4.0 * nLoad * (1 + nAtlas + p.fnExclusion.size()));
+
+  // The search for each atlas at each estimated voxel is the main cost
+  double opsSearch = nSearch * nPatch;
+  if(p.patchMatch)
     {
-    ImagePointer xmap = LoadAndPadImage(xit->second, p);
-    voter->AddExclusionMap(xit->first, xmap);
+    double nTests = 1 + 2 * VDim;
+    for(long w = 1; w <= (long) rSearch[0]; w *= 2)
+      nTests++;
+    opsSearch = nTests * nPatch + p.patchMatchCheck * nSearch * nPatch;
+    }
+  else if(p.pcaComponents > 0)
+    {
+    opsSearch = nSearch * p.pcaComponents + p.pcaCandidates * nPatch;
     }
 
-  voter->GetOutput()->SetRequestedRegion(rMask);
-  voter->Update();
+  // Then the matrix of the atlas errors, its solution for each pair, and the votes
+  double opsVoxel = nAtlas * opsSearch + nAtlas * nAtlas * nPatch 
+    + nPairs * (nAtlas * nAtlas * nAtlas / 3 + nAtlas * nPatch);
+  double opsMask = nOut * nAtlas * nSearch;
+  est.SetOperations(nEstimated * opsVoxel + opsMask, threads);
 
-  // Convert to an output image
-  target->FillBuffer(0.0);
-  for(itk::ImageRegionIteratorWithIndex<ImageType> it(voter->GetOutput(), rMask);
-    !it.IsAtEnd(); ++it)
+  est.WriteJSON(cout);
+  return 0;
+}
+
+/** Split a string at any of the delimiter characters */
+vector<string> SplitString(const string &s, const char *delim, bool keepEmpty)
+{
+  vector<string> tokens;
+  size_t pos = 0;
+  while(true)
     {
-    target->SetPixel(it.GetIndex(), it.Get());
+    size_t next = s.find_first_of(delim, pos);
+    string tok = s.substr(pos, next == string::npos ? string::npos : next - pos);
+    if(keepEmpty || tok.size())
+      tokens.push_back(tok);
+    if(next == string::npos)
+      break;
+    pos = next + 1;
     }
+  return tokens;
+}
 
-  // If the image was padded, crop it
-  typename ImageType::Pointer outSeg = target;
-  if(p.padding)
+/** The image files read by a job */
+template <unsigned int VDim>
+vector<string> GetJobImageFiles(const LFParam<VDim> &p)
+{
+  vector<string> files;
+  files.push_back(p.fnTarget);
+  if(p.fnMask.size())
+    files.push_back(p.fnMask);
+  files.insert(files.end(), p.fnAtlas.begin(), p.fnAtlas.end());
+  files.insert(files.end(), p.fnLabel.begin(), p.fnLabel.end());
+  for(typename map<int,string>::const_iterator xit = p.fnExclusion.begin(); xit != p.fnExclusion.end(); ++xit)
+    files.push_back(xit->second);
+  return files;
+}
+
+/**
+ * Read the batch file. Each line describes a job as tab-separated columns:
+ *   target  output  [atlases  [labels  [options]]]
+ * where atlases and labels are space-separated lists of files and options are
+ * label_fusion options that apply to this job only. Empty columns or '-' keep the
+ * values given on the command line. Blank lines and lines starting with '#' are
+ * skipped.
+ */
+template <unsigned int VDim>
+int ReadBatchFile(const LFParam<VDim> &global, vector<LFParam<VDim> > &jobs)
+{
+  ifstream fin(global.fnBatch.c_str());
+  if(!fin.good())
     {
-    typedef itk::CropImageFilter<ImageType, ImageType> CropFilter;
-    typename CropFilter::Pointer fltCrop = CropFilter::New();
-    fltCrop->SetInput(target);
-    fltCrop->SetUpperBoundaryCropSize(p.paddingSize);
-    fltCrop->SetLowerBoundaryCropSize(p.paddingSize);
-    fltCrop->Update();
-    outSeg = fltCrop->GetOutput();
+    cerr << "Can not read batch file " << global.fnBatch << endl;
+    return -1;
     }
 
+  string line;
+  for(int iLine = 1; getline(fin, line); iLine++)
+    {
+    // Strip DOS line endings
+    if(line.size() && line[line.size()-1] == '\r')
+      line.erase(line.size()-1);
 
-  // Create writer
-  typename WriterType::Pointer writer = WriterType::New();
-  writer->SetInput(outSeg);
-  writer->SetFileName(p.fnOutput.c_str());
-  writer->Update();
+    if(line.size() == 0 || line[0] == '#')
+      continue;
 
-  // Store the weight maps
-  if(p.fnWeight.size())
-    {
-    for(int i = 0; i < p.fnAtlas.size(); i++)
+    vector<string> col = SplitString(line, "\t", true);
+    if(col.size() < 2 || col[0].empty() || col[1].empty())
       {
-      // Create a full-size image
-      typename VoterType::WeightMapImagePtr wout = VoterType::WeightMapImage::New();
-      wout->SetRegions(target->GetBufferedRegion());
-      wout->CopyInformation(target);
-      wout->Allocate();
-      wout->FillBuffer(1.0f / p.fnAtlas.size());
+      cerr << global.fnBatch << ":" << iLine << ": expected target and output" << endl;
+      return -1;
+      }
 
-      // Replace the portion affected by the filter
-      for(itk::ImageRegionIteratorWithIndex<typename VoterType::WeightMapImage> qt(voter->GetWeightMap(i), rMask);
-        !qt.IsAtEnd(); ++qt)
-        {
-        wout->SetPixel(qt.GetIndex(), qt.Get());
-        }
+    LFParam<VDim> job = global;
+    job.fnBatch.clear();
+    job.fnTarget = col[0];
+    job.fnOutput = col[1];
 
-      // Deal with padding
-      typename VoterType::WeightMapImagePtr imgWeightOut = wout;
+    if(col.size() > 2 && col[2].size() && col[2] != "-")
+      job.fnAtlas = SplitString(col[2], " ", false);
 
-      if(p.padding)
+    if(col.size() > 3 && col[3].size() && col[3] != "-")
+      job.fnLabel = SplitString(col[3], " ", false);
+
+    if(col.size() > 4 && col[4].size() && col[4] != "-")
+      {
+      // Parse the options using the command line parser. It expects modifiable
+      // C strings, so make copies
+      vector<string> opts = SplitString(col[4], " ", false);
+      vector<vector<char> > buffers(opts.size());
+      vector<char *> args(opts.size());
+      for(size_t k = 0; k < opts.size(); k++)
         {
-        typedef itk::CropImageFilter<typename VoterType::WeightMapImage, typename VoterType::WeightMapImage> CropFilter;
-        typename CropFilter::Pointer fltCrop = CropFilter::New();
-        fltCrop->SetInput(wout);
-        fltCrop->SetUpperBoundaryCropSize(p.paddingSize);
-        fltCrop->SetLowerBoundaryCropSize(p.paddingSize);
-        fltCrop->Update();
-        imgWeightOut = fltCrop->GetOutput();
+        buffers[k].assign(opts[k].begin(), opts[k].end());
+        buffers[k].push_back(0);
+        args[k] = &buffers[k][0];
         }
 
-      // Get the filename
-      char buffer[4096];
-      sprintf(buffer, p.fnWeight.c_str(), i);
+      if(args.size() && ParseOptions(job, &args[0], 0, (int) args.size()) != 0)
+        {
+        cerr << global.fnBatch << ":" << iLine << ": bad options" << endl;
+        return -1;
+        }
 
-      // Create writer
-      typedef itk::ImageFileWriter<typename VoterType::WeightMapImage> WeightWriter;
-      typename WeightWriter::Pointer writer = WeightWriter::New();
-      writer->SetInput(imgWeightOut);
-      writer->SetFileName(buffer);
-      writer->Update();
+      if(job.fnBatch.size())
+        {
+        cerr << global.fnBatch << ":" << iLine << ": batch files can not be nested" << endl;
+        return -1;
+        }
       }
+
+    jobs.push_back(job);
     }
 
-  // Finally, store the posterior maps
-  if(p.fnPosterior.size())
-    {
-    // Get the posterior maps
-    const typename VoterType::PosteriorMap &pm = voter->GetPosteriorMaps();
+  return 0;
+}
 
-    // Create a full-size image
-    typename VoterType::PosteriorImagePtr pout = VoterType::PosteriorImage::New();
-    pout->SetRegions(target->GetBufferedRegion());
-    pout->CopyInformation(target);
-    pout->Allocate();
+/**
+ * Run all the jobs in a batch file one after another in this process. Images
+ * shared between jobs are only read once. A failed job does not stop the batch.
+ */
+template <unsigned int VDim>
+int RunBatch(const LFParam<VDim> &global)
+{
+  vector<LFParam<VDim> > jobs;
+  if(ReadBatchFile(global, jobs) != 0)
+    return -1;
 
-    // Iterate over the labels
-    typename VoterType::PosteriorMap::const_iterator it;
-    for(it = pm.begin(); it != pm.end(); it++)
-      {
-      // Get the filename
-      char buffer[4096];
-      sprintf(buffer, p.fnPosterior.c_str(), (int) it->first);
+  // Count how many jobs use each image
+  LFImageCache<VDim> cache;
+  for(size_t i = 0; i < jobs.size(); i++)
+    {
+    vector<string> files = GetJobImageFiles(jobs[i]);
+    for(size_t k = 0; k < files.size(); k++)
+      cache.AddReference(LFImageCache<VDim>::GetKey(files[k], jobs[i]));
+    }
 
-      // Initialize to zeros
-      pout->FillBuffer(0.0);
+  int nFailed = 0;
+  for(size_t i = 0; i < jobs.size(); i++)
+    {
+    const LFParam<VDim> &p = jobs[i];
+    cout << "BATCH JOB " << i+1 << " OF " << jobs.size() << endl;
+    p.Print(cout);
 
-      // Replace the portion affected by the filter
-      for(itk::ImageRegionIteratorWithIndex<typename VoterType::PosteriorImage> qt(it->second, rMask);
-        !qt.IsAtEnd(); ++qt)
+    int rc = CheckParameters(p);
+    if(rc == 0)
+      {
+      // A job may set its own number of threads with -threads
+      if(p.threads != global.threads)
         {
-        pout->SetPixel(qt.GetIndex(), qt.Get());
+        std::string threadSource;
+        int nThreads = ASHSSetNumberOfThreads(p.threads, &threadSource);
+        cout << "Executing job with " << nThreads << " threads (" << threadSource << ")" << endl;
         }
 
-      typename ImageType::Pointer imgPostOut = pout;
-
-      if(p.padding)
+      try
         {
-        typedef itk::CropImageFilter<ImageType, ImageType> CropFilter;
-        typename CropFilter::Pointer fltCrop = CropFilter::New();
-        fltCrop->SetInput(pout);
-        fltCrop->SetUpperBoundaryCropSize(p.paddingSize);
-        fltCrop->SetLowerBoundaryCropSize(p.paddingSize);
-        fltCrop->Update();
-        imgPostOut = fltCrop->GetOutput();
+        rc = RunJob(p, &cache);
+        }
+      catch(itk::ExceptionObject &exc)
+        {
+        cerr << "Exception in job " << i+1 << ": " << exc.GetDescription() << endl;
+        rc = -1;
+        }
+      catch(std::exception &exc)
+        {
+        cerr << "Exception in job " << i+1 << ": " << exc.what() << endl;
+        rc = -1;
         }
 
-      // Create writer
-      typename WriterType::Pointer writer = WriterType::New();
-      writer->SetInput(imgPostOut);
-      writer->SetFileName(buffer);
-      writer->Update();
+      if(p.threads != global.threads)
+        ASHSSetNumberOfThreads(global.threads);
       }
+
+    if(rc != 0)
+      {
+      cerr << "Job " << i+1 << " (" << p.fnTarget << ") failed" << endl;
+      nFailed++;
+      }
+
+    // Drop images that no later job needs
+    vector<string> files = GetJobImageFiles(p);
+    for(size_t k = 0; k < files.size(); k++)
+      cache.Release(LFImageCache<VDim>::GetKey(files[k], p));
     }
 
-  return 0;
+  cout << "Batch complete: " << jobs.size() - nFailed << " of " << jobs.size() << " jobs succeeded" << endl;
+  return nFailed ? -1 : 0;
+}
+
+template <unsigned int VDim>
+int lfapp(int argc, char *argv[])
+{
+  // Parameter vector
+  LFParam<VDim> p;
+
+  // In batch mode, the targets and outputs come from the batch file
+  bool batch = false;
+  for(int j = 2; j < argc; j++)
+    if(!strcmp(argv[j], "--batch"))
+      batch = true;
+
+  // Read the parameters from command line
+  int argend = argc;
+  if(!batch)
+    {
+    if(argc < 5) 
+      return usage();
+    p.fnOutput = argv[argc-1];
+    p.fnTarget = argv[argc-2];
+    argend = argc-2;
+    }
+
+  if(ParseOptions(p, argv, 2, argend) != 0)
+    return -1;
+
+  if(batch && p.fnProfile.size())
+    {
+    cerr << "In batch mode, --profile must be given per job in the batch file" << endl;
+    return -1;
+    }
+
+  if(batch && p.estimate)
+    {
+    cerr << "The --estimate option can not be used with --batch" << endl;
+    return -1;
+    }
+
+  // We have the parameters now. Check for validity
+  if(!batch)
+    {
+    if(CheckParameters(p) != 0)
+      return -1;
+
+    // Only the estimate is printed, so that it can be parsed
+    if(p.estimate)
+      return EstimateJob(p, p.threads > 0 ? p.threads : ASHSGetDefaultNumberOfThreads());
+
+    // Print parametes
+    cout << "LABEL FUSION PARAMETERS:" << endl;
+    p.Print(cout);
+    }
+
+  // Use the threads parameter, or the number of CPUs available to the process
+  std::string threadSource;
+  int nThreads = ASHSSetNumberOfThreads(p.threads, &threadSource);
+  std::cout << "Executing with " << nThreads << " threads (" << threadSource << ")" << std::endl;
+
+  if(batch)
+    return RunBatch(p);
+
+  return RunJob(p);
 }
 
 
+
 int main(int argc, char *argv[])
 {
   // Set the tolerance on the image matrices - to prevent silly errors
@@ -691,7 +1587,7 @@ int main(int argc, char *argv[])
   itk::ImageToImageFilterCommon::SetGlobalDefaultDirectionTolerance(1e-4);
 
   // Parse user input
-  if(argc < 5) return usage();
+  if(argc < 4) return usage();
 
   // Get the first option
   int dim = atoi(argv[1]);
@@ -0,0 +1,326 @@
+/*===================================================================
+
+  Program:   ASHS (Automatic Segmentation of Hippocampal Subfields)
+  Module:    $Id$
+  Language:  C++ program
+  Copyright (c) 2012 Paul A. Yushkevich, University of Pennsylvania
+
+  This file is part of ASHS
+
+  ASHS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =================================================================== */
+
+#include "LabelFusionAPI.h"
+#include "LabelFusionDriver.h"
+#include "ASHSRuntime.h"
+#include "itkImportImageFilter.h"
+#include <new>
+
+#include "WeightedVotingLabelFusionImageFilter.txx"
+
+typedef itk::Image<float, 3> ImageType;
+typedef ImageType::Pointer ImagePointer;
+
+/** Forwards the filter's progress events to the caller's callback */
+class LFProgressCommand : public itk::Command
+{
+public:
+  typedef LFProgressCommand Self;
+  typedef itk::SmartPointer<Self> Pointer;
+
+  itkNewMacro(Self);
+
+  void SetCallback(lf_progress_callback callback, void *client_data)
+    { m_Callback = callback; m_ClientData = client_data; }
+
+  void Execute(itk::Object *caller, const itk::EventObject &event)
+    { Execute((const itk::Object *) caller, event); }
+
+  void Execute(const itk::Object *caller, const itk::EventObject &event)
+    {
+    const itk::ProcessObject *po = dynamic_cast<const itk::ProcessObject *>(caller);
+    if(!po || !m_Callback || !itk::ProgressEvent().CheckEvent(&event))
+      return;
+
+    // A non-zero return value asks us to stop
+    if(m_Callback(po->GetProgress(), m_ClientData))
+      {
+      const_cast<itk::ProcessObject *>(po)->AbortGenerateDataOn();
+      m_Aborted = true;
+      }
+    }
+
+  /** Whether the callback asked to abort */
+  bool GetAborted() const { return m_Aborted; }
+
+protected:
+  LFProgressCommand() : m_Callback(NULL), m_ClientData(NULL), m_Aborted(false) {}
+
+private:
+  lf_progress_callback m_Callback;
+  void *m_ClientData;
+  bool m_Aborted;
+};
+
+/** Wrap a caller's buffer as an ITK image without copying it */
+static ImagePointer ImportBuffer(const lf_geometry *geom, const float *data)
+{
+  typedef itk::ImportImageFilter<float, 3> ImportFilter;
+  ImportFilter::Pointer import = ImportFilter::New();
+
+  itk::ImageRegion<3> region;
+  unsigned long nvox = 1;
+  for(int d = 0; d < 3; d++)
+    {
+    region.SetIndex(d, 0);
+    region.SetSize(d, geom->size[d]);
+    nvox *= geom->size[d];
+    }
+
+  itk::Matrix<double, 3, 3> dir;
+  for(int i = 0; i < 3; i++)
+    for(int j = 0; j < 3; j++)
+      dir(i, j) = geom->direction[3 * i + j];
+
+  import->SetRegion(region);
+  import->SetOrigin(geom->origin);
+  import->SetSpacing(geom->spacing);
+  import->SetDirection(dir);
+
+  // The filter only reads its inputs, so the buffer is not modified
+  import->SetImportPointer(const_cast<float *>(data), nvox, false);
+  import->Update();
+
+  return import->GetOutput();
+}
+
+/** Copy an image into a newly allocated buffer */
+static float *ExportImage(ImageType *image)
+{
+  size_t nvox = image->GetBufferedRegion().GetNumberOfPixels();
+  float *buffer = (float *) malloc(nvox * sizeof(float));
+  if(!buffer)
+    throw std::bad_alloc();
+  memcpy(buffer, image->GetBufferPointer(), nvox * sizeof(float));
+  return buffer;
+}
+
+static bool CheckArguments(const lf_geometry *geom, const lf_inputs *in, const lf_params *param)
+{
+  if(!geom || !in || !param)
+    return false;
+
+  for(int d = 0; d < 3; d++)
+    {
+    if(geom->size[d] <= 0 || geom->spacing[d] <= 0)
+      return false;
+    if(param->patch_radius[d] < 0 || param->search_radius[d] < 0 || param->weight_stride[d] < 1)
+      return false;
+    if(geom->size[d] <= 2 * (param->patch_radius[d] + param->search_radius[d]))
+      return false;
+    }
+
+  if(!in->target || in->n_atlases < 2 || !in->atlas_images || !in->atlas_segs)
+    return false;
+
+  for(int i = 0; i < in->n_atlases; i++)
+    if(!in->atlas_images[i] || !in->atlas_segs[i])
+      return false;
+
+  if(in->n_exclusions > 0 && (!in->exclusion_labels || !in->exclusion_maps))
+    return false;
+
+  return true;
+}
+
+extern "C" {
+
+int lf_api_version(void)
+{
+  return LF_API_VERSION;
+}
+
+void lf_init_geometry(lf_geometry *geom, int nx, int ny, int nz)
+{
+  geom->size[0] = nx; geom->size[1] = ny; geom->size[2] = nz;
+  for(int d = 0; d < 3; d++)
+    {
+    geom->origin[d] = 0.0;
+    geom->spacing[d] = 1.0;
+    }
+  for(int k = 0; k < 9; k++)
+    geom->direction[k] = (k % 4 == 0) ? 1.0 : 0.0;
+}
+
+void lf_init_params(lf_params *param)
+{
+  LFParam<3> p;
+  for(int d = 0; d < 3; d++)
+    {
+    param->patch_radius[d] = p.r_patch[d];
+    param->search_radius[d] = p.r_search[d];
+    param->weight_stride[d] = p.weightStride[d];
+    }
+  param->alpha = p.alpha;
+  param->beta = p.beta;
+  param->threads = p.threads;
+  param->compute_posteriors = 0;
+}
+
+int lf_fuse(const lf_geometry *geom, const lf_inputs *inputs, const lf_params *param,
+            lf_progress_callback progress, void *client_data, lf_result *result)
+{
+  if(!result)
+    return LF_ERR_ARGUMENTS;
+
+  result->segmentation = NULL;
+  result->n_labels = 0;
+  result->labels = NULL;
+  result->posteriors = NULL;
+
+  if(!CheckArguments(geom, inputs, param))
+    return LF_ERR_ARGUMENTS;
+
+  // Optional progress reporting. No exception may leave this function, since the
+  // caller is C code
+  LFProgressCommand::Pointer cmd;
+  try
+    {
+    if(progress)
+      {
+      cmd = LFProgressCommand::New();
+      cmd->SetCallback(progress, client_data);
+      }
+
+    // Translate the parameters. The pattern strings only serve as flags here
+    LFParam<3> p;
+    for(int d = 0; d < 3; d++)
+      {
+      p.r_patch[d] = param->patch_radius[d];
+      p.r_search[d] = param->search_radius[d];
+      p.weightStride[d] = param->weight_stride[d];
+      }
+    p.alpha = param->alpha;
+    p.beta = param->beta;
+    p.threads = param->threads > 0 ? param->threads : ASHSGetDefaultNumberOfThreads();
+    if(param->compute_posteriors)
+      p.fnPosterior = "%d";
+
+    // Wrap the inputs
+    LFInputs<3> in;
+    in.target = ImportBuffer(geom, inputs->target);
+    if(inputs->mask)
+      in.mask = ImportBuffer(geom, inputs->mask);
+    for(int i = 0; i < inputs->n_atlases; i++)
+      {
+      in.atlas.push_back(ImportBuffer(geom, inputs->atlas_images[i]));
+      in.label.push_back(ImportBuffer(geom, inputs->atlas_segs[i]));
+      }
+    for(int i = 0; i < inputs->n_exclusions; i++)
+      in.exclusion[inputs->exclusion_labels[i]] = ImportBuffer(geom, inputs->exclusion_maps[i]);
+
+    // Run label fusion
+    LFResult<3> out;
+    RunLabelFusion<3>(p, in, out, NULL, cmd.GetPointer());
+
+    // Copy the outputs
+    result->segmentation = ExportImage(out.segmentation);
+    if(out.posterior.size())
+      {
+      int nl = out.posterior.size();
+      result->labels = (int *) calloc(nl, sizeof(int));
+      result->posteriors = (float **) calloc(nl, sizeof(float *));
+      if(!result->labels || !result->posteriors)
+        throw std::bad_alloc();
+
+      result->n_labels = nl;
+      int k = 0;
+      for(std::map<int, ImagePointer>::const_iterator it = out.posterior.begin();
+        it != out.posterior.end(); ++it, ++k)
+        {
+        result->labels[k] = it->first;
+        result->posteriors[k] = ExportImage(it->second);
+        }
+      }
+    }
+  catch(itk::ProcessAborted &)
+    {
+    lf_free_result(result);
+    return LF_ERR_ABORTED;
+    }
+  catch(std::bad_alloc &)
+    {
+    lf_free_result(result);
+    return LF_ERR_MEMORY;
+    }
+  catch(itk::ExceptionObject &exc)
+    {
+    // The abort may reach us wrapped in a generic exception from the threader
+    lf_free_result(result);
+    if(cmd && cmd->GetAborted())
+      return LF_ERR_ABORTED;
+
+    std::cerr << "Label fusion failed: " << exc.GetDescription() << std::endl;
+    return LF_ERR_INTERNAL;
+    }
+  catch(std::exception &exc)
+    {
+    lf_free_result(result);
+    std::cerr << "Label fusion failed: " << exc.what() << std::endl;
+    return LF_ERR_INTERNAL;
+    }
+  catch(...)
+    {
+    lf_free_result(result);
+    std::cerr << "Label fusion failed with an unknown exception" << std::endl;
+    return LF_ERR_INTERNAL;
+    }
+
+  return LF_OK;
+}
+
+void lf_free_result(lf_result *result)
+{
+  if(!result)
+    return;
+
+  free(result->segmentation);
+  if(result->posteriors)
+    {
+    for(int k = 0; k < result->n_labels; k++)
+      free(result->posteriors[k]);
+    free(result->posteriors);
+    }
+  free(result->labels);
+
+  result->segmentation = NULL;
+  result->n_labels = 0;
+  result->labels = NULL;
+  result->posteriors = NULL;
+}
+
+const char *lf_error_string(int code)
+{
+  switch(code)
+    {
+    case LF_OK: return "success";
+    case LF_ERR_ARGUMENTS: return "invalid arguments";
+    case LF_ERR_ABORTED: return "aborted by the progress callback";
+    case LF_ERR_MEMORY: return "out of memory";
+    case LF_ERR_INTERNAL: return "internal error";
+    }
+  return "unknown error";
+}
+
+}
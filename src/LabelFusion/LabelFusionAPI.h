@@ -0,0 +1,126 @@
+/*===================================================================
+
+  Program:   ASHS (Automatic Segmentation of Hippocampal Subfields)
+  Module:    $Id$
+  Language:  C++ program
+  Copyright (c) 2012 Paul A. Yushkevich, University of Pennsylvania
+
+  This file is part of ASHS
+
+  ASHS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =================================================================== */
+
+#ifndef __LabelFusionAPI_h_
+#define __LabelFusionAPI_h_
+
+/*
+ * C interface to the labelfusion library. This runs joint label fusion on 3D
+ * images held in memory by the caller, so that label fusion can be called from
+ * another program without writing the inputs and outputs to disk.
+ *
+ * All images are float arrays of size[0] * size[1] * size[2] voxels in ITK/NIfTI
+ * order (x fastest) and share the same geometry. The library does not take
+ * ownership of the input buffers. The outputs are allocated by the library and
+ * must be released with lf_free_result().
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Version of the interface, changed whenever the structures below change */
+#define LF_API_VERSION 1
+
+/* Return codes */
+#define LF_OK              0
+#define LF_ERR_ARGUMENTS  -1
+#define LF_ERR_ABORTED    -2
+#define LF_ERR_MEMORY     -3
+#define LF_ERR_INTERNAL   -4
+
+/* Image geometry: voxel dimensions, origin, spacing and direction cosines
+ * (3x3 matrix stored row by row) */
+typedef struct
+{
+  int size[3];
+  double origin[3];
+  double spacing[3];
+  double direction[9];
+} lf_geometry;
+
+/* The input images. The mask and the exclusion maps are optional */
+typedef struct
+{
+  const float *target;
+  int n_atlases;
+  const float * const *atlas_images;
+  const float * const *atlas_segs;
+  const float *mask;
+  int n_exclusions;
+  const int *exclusion_labels;
+  const float * const *exclusion_maps;
+} lf_inputs;
+
+/* Parameters, same meaning as the label_fusion options. With threads 0 or less,
+ * the number of threads is the number of CPUs the process may use (its CPU
+ * affinity, cgroup CPU quota and SLURM_CPUS_PER_TASK), as in label_fusion,
+ * rather than all the cores of the machine */
+typedef struct
+{
+  int patch_radius[3];
+  int search_radius[3];
+  int weight_stride[3];
+  double alpha, beta;
+  int threads;
+  int compute_posteriors;
+} lf_params;
+
+/* Output of label fusion. The posteriors are only set if requested, with one
+ * image per label in the order of the labels array */
+typedef struct
+{
+  float *segmentation;
+  int n_labels;
+  int *labels;
+  float **posteriors;
+} lf_result;
+
+/* Progress callback, called with a value between 0 and 1. Returning a non-zero
+ * value aborts label fusion */
+typedef int (*lf_progress_callback)(double progress, void *client_data);
+
+/* Version of the library */
+int lf_api_version(void);
+
+/* Set the geometry to unit spacing, zero origin and identity direction */
+void lf_init_geometry(lf_geometry *geom, int nx, int ny, int nz);
+
+/* Set the parameters to the label_fusion defaults */
+void lf_init_params(lf_params *param);
+
+/* Run label fusion. Returns LF_OK on success, or one of the error codes */
+int lf_fuse(const lf_geometry *geom, const lf_inputs *inputs, const lf_params *param,
+            lf_progress_callback progress, void *client_data, lf_result *result);
+
+/* Release the memory held by a result */
+void lf_free_result(lf_result *result);
+
+/* Description of a return code */
+const char *lf_error_string(int code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,600 @@
+/*===================================================================
+
+  Program:   ASHS (Automatic Segmentation of Hippocampal Subfields)
+  Module:    $Id$
+  Language:  C++ program
+  Copyright (c) 2012 Paul A. Yushkevich, University of Pennsylvania
+
+  This file is part of ASHS
+
+  ASHS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  ===================================================================
+
+  This program benchmarks the label fusion code on synthetic data. It
+  times the per-voxel kernels in isolation and then runs the complete
+  filter with a range of thread counts. Results are written as JSON so
+  that they can be compared between builds.
+
+  =================================================================== */
+
+#include "LabelFusionDriver.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkMultiThreader.h"
+#include "LabelFusionProfile.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "WeightedVotingLabelFusionImageFilter.txx"
+
+using namespace std;
+
+typedef itk::Image<float, 3> ImageType;
+typedef ImageType::Pointer ImagePointer;
+typedef WeightedVotingLabelFusionImageFilter<ImageType, ImageType> VoterType;
+
+int usage()
+{
+  cout << "label_fusion_benchmark: " << endl;
+  cout << "usage: " << endl;
+  cout << "  label_fusion_benchmark [options] output.json" << endl;
+  cout << endl;
+  cout << "options: " << endl;
+  cout << "  -size NxNxN                     Size of the synthetic images. Default: 64x64x48" << endl;
+  cout << "  -atlases N                      Number of atlases. Default: 10" << endl;
+  cout << "  -labels N                       Number of labels. Default: 8" << endl;
+  cout << "  -rp radius                      Patch radius. Default: 2x2x2" << endl;
+  cout << "  -rs radius                      Search radius. Default: 3x3x3" << endl;
+  cout << "  -density d                      Fraction of voxels in the voting mask. Default: 0.25" << endl;
+  cout << "  -threads t1,t2,...              Thread counts for the scaling curve. Default: 1,2,4" << endl;
+  cout << "  -samples N                      Number of voxels sampled for the kernel" << endl;
+  cout << "                                  benchmarks. Default: 2000" << endl;
+  cout << "  -seed N                         Random seed. Default: 1" << endl;
+  cout << "  -a alpha -b beta                Joint label fusion parameters. Default: 0.1, 2" << endl;
+  return -1;
+}
+
+struct BenchParam
+{
+  itk::Size<3> size, r_patch, r_search;
+  int atlases, labels, samples;
+  double density, alpha, beta;
+  vector<int> threads;
+  unsigned int seed;
+  string fnOutput;
+
+  BenchParam()
+    {
+    size[0] = 64; size[1] = 64; size[2] = 48;
+    r_patch.Fill(2);
+    r_search.Fill(3);
+    atlases = 10;
+    labels = 8;
+    samples = 2000;
+    density = 0.25;
+    alpha = 0.1;
+    beta = 2;
+    seed = 1;
+    threads.push_back(1);
+    threads.push_back(2);
+    threads.push_back(4);
+    }
+};
+
+// Uniform random number in [0,1)
+double urand()
+{
+  return rand() / (RAND_MAX + 1.0);
+}
+
+// A smooth intensity field that gives patches some structure
+double SyntheticIntensity(double x, double y, double z)
+{
+  return 100.0
+    + 40.0 * sin(0.21 * x) * cos(0.17 * y)
+    + 30.0 * sin(0.13 * z + 0.07 * x)
+    + 20.0 * cos(0.29 * y + 0.11 * z);
+}
+
+// A smooth label field with curved boundaries between labels
+int SyntheticLabel(double x, double y, double z, int nLabels)
+{
+  double f = 0.5 + 0.5 * sin(0.09 * x + 0.05 * y) * cos(0.07 * z);
+  int l = (int) floor(f * nLabels);
+  return l < 0 ? 0 : (l >= nLabels ? nLabels - 1 : l);
+}
+
+ImagePointer MakeImage(const itk::Size<3> &size)
+{
+  ImagePointer img = ImageType::New();
+  img->SetRegions(size);
+  img->Allocate();
+  img->FillBuffer(0.0f);
+  return img;
+}
+
+// Generate a synthetic target and atlases. Each atlas is a shifted, rescaled and
+// noisy copy of the same underlying anatomy, which mimics imperfect registration
+void GenerateData(const BenchParam &p, ImagePointer &target,
+                  vector<ImagePointer> &atlases, vector<ImagePointer> &segs)
+{
+  target = MakeImage(p.size);
+  typedef itk::ImageRegionIteratorWithIndex<ImageType> IterType;
+  for(IterType it(target, target->GetBufferedRegion()); !it.IsAtEnd(); ++it)
+    {
+    ImageType::IndexType idx = it.GetIndex();
+    it.Set(SyntheticIntensity(idx[0], idx[1], idx[2]) + 10.0 * (urand() - 0.5));
+    }
+
+  for(int i = 0; i < p.atlases; i++)
+    {
+    double dx = 4.0 * (urand() - 0.5), dy = 4.0 * (urand() - 0.5), dz = 4.0 * (urand() - 0.5);
+    double gain = 0.9 + 0.2 * urand();
+    ImagePointer grey = MakeImage(p.size), seg = MakeImage(p.size);
+    IterType itSeg(seg, seg->GetBufferedRegion());
+    for(IterType it(grey, grey->GetBufferedRegion()); !it.IsAtEnd(); ++it, ++itSeg)
+      {
+      ImageType::IndexType idx = it.GetIndex();
+      double x = idx[0] + dx, y = idx[1] + dy, z = idx[2] + dz;
+      it.Set(gain * SyntheticIntensity(x, y, z) + 10.0 * (urand() - 0.5));
+      itSeg.Set(SyntheticLabel(x, y, z, p.labels));
+      }
+    atlases.push_back(grey);
+    segs.push_back(seg);
+    }
+}
+
+// The region where voting is possible, i.e., where the patch and search
+// neighborhoods fit inside the image
+itk::ImageRegion<3> ComputeVotingRegion(const BenchParam &p)
+{
+  itk::ImageRegion<3> r;
+  r.SetSize(p.size);
+  for(int d = 0; d < 3; d++)
+    {
+    long m = p.r_patch[d] + p.r_search[d];
+    r.SetIndex(d, m);
+    r.SetSize(d, p.size[d] > 2 * m ? p.size[d] - 2 * m : 0);
+    }
+  return r;
+}
+
+// Random mask with the requested density inside the voting region
+ImagePointer GenerateMask(const BenchParam &p, const itk::ImageRegion<3> &rVote, unsigned long &nMask)
+{
+  ImagePointer mask = MakeImage(p.size);
+  nMask = 0;
+  for(itk::ImageRegionIteratorWithIndex<ImageType> it(mask, rVote); !it.IsAtEnd(); ++it)
+    {
+    if(urand() < p.density)
+      {
+      it.Set(1.0f);
+      nMask++;
+      }
+    }
+  return mask;
+}
+
+// Pick random voxels in the voting region for the kernel benchmarks
+vector<long> SampleVoxels(const BenchParam &p, const ImageType *image, const itk::ImageRegion<3> &rVote)
+{
+  vector<long> offsets;
+  for(int i = 0; i < p.samples; i++)
+    {
+    ImageType::IndexType idx;
+    for(int d = 0; d < 3; d++)
+      idx[d] = rVote.GetIndex(d) + (long) (urand() * rVote.GetSize(d));
+    offsets.push_back(image->ComputeOffset(idx));
+    }
+  return offsets;
+}
+
+// Result of timing one kernel
+struct KernelResult
+{
+  string name;
+  double seconds;
+  double calls;
+  double voxels;
+};
+
+void WriteKernelJSON(ostream &os, const KernelResult &k, bool last)
+{
+  os << "    { \"name\": \"" << k.name << "\""
+     << ", \"seconds\": " << k.seconds
+     << ", \"calls\": " << k.calls
+     << ", \"ns_per_call\": " << (k.calls > 0 ? 1.0e9 * k.seconds / k.calls : 0.0)
+     << ", \"voxels_per_second\": " << (k.seconds > 0 ? k.voxels / k.seconds : 0.0)
+     << " }" << (last ? "" : ",") << endl;
+}
+
+// Search every atlas around every sample for the best matching patch, using the
+// similarity kernel for a patch size fixed at compile time (VN > 0) or not
+template <unsigned int VN>
+double SearchSamples(const vector<long> &samples, const vector<ImagePointer> &atlases,
+                     const vector<ImageType::PixelType> &normtrg, 
+                     const int *offPatch, size_t nPatch, const int *offSearch, size_t nSearch,
+                     vector<int> &bestOff, vector<ImageType::PixelType> &bestSum,
+                     vector<ImageType::PixelType> &bestSSQ)
+{
+  typedef ImageType::PixelType PixelType;
+  int n = atlases.size();
+  double sink = 0.0;
+  for(size_t s = 0; s < samples.size(); s++)
+    {
+    const PixelType *pnt = &normtrg[s * nPatch];
+    for(int i = 0; i < n; i++)
+      {
+      const PixelType *pAtlas = atlases[i]->GetBufferPointer() + samples[s];
+      double bestMatch = 1e100;
+      for(size_t k = 0; k < nSearch; k++)
+        {
+        PixelType sum = 0, ssq = 0;
+        double match = VoterType::PatchSimilarityN<VN>(
+          pAtlas + offSearch[k], pnt, nPatch, offPatch, sum, ssq);
+        if(match < bestMatch)
+          {
+          bestMatch = match;
+          bestOff[s * n + i] = offSearch[k];
+          bestSum[s * n + i] = sum;
+          bestSSQ[s * n + i] = ssq;
+          }
+        }
+      sink += bestMatch;
+      }
+    }
+  return sink;
+}
+
+// Time the per-voxel kernels in isolation on a single thread
+void BenchmarkKernels(const BenchParam &p, ImageType *target,
+                      const vector<ImagePointer> &atlases,
+                      const itk::ImageRegion<3> &rVote,
+                      vector<KernelResult> &results)
+{
+  typedef ImageType::PixelType PixelType;
+  int n = p.atlases;
+
+  // Offset tables, computed the same way as in the filter
+  int *offPatch, *offSearch;
+  size_t nPatch, nSearch;
+  VoterType::ComputeOffsetTable(target, p.r_patch, &offPatch, nPatch);
+  VoterType::ComputeOffsetTable(target, p.r_search, &offSearch, nSearch);
+
+  vector<long> samples = SampleVoxels(p, target, rVote);
+  double nSamples = samples.size();
+
+  // Normalize the target patches up front
+  vector<PixelType> normtrg(samples.size() * nPatch);
+  for(size_t s = 0; s < samples.size(); s++)
+    {
+    const PixelType *pTarget = target->GetBufferPointer() + samples[s];
+    PixelType mu, sd;
+    VoterType::PatchStats(pTarget, nPatch, offPatch, mu, sd);
+    for(size_t k = 0; k < nPatch; k++)
+      normtrg[s * nPatch + k] = (pTarget[offPatch[k]] - mu) / sd;
+    }
+
+  // Best matching offset and patch statistics for each sample and atlas
+  vector<int> bestOff(samples.size() * n);
+  vector<PixelType> bestSum(samples.size() * n), bestSSQ(samples.size() * n);
+
+  // Search: PatchSimilarity over the whole search neighborhood of every atlas
+  volatile double sink = 0.0;
+  double t0 = LFWallTime();
+  sink += SearchSamples<0>(samples, atlases, normtrg, offPatch, nPatch, offSearch, nSearch,
+                           bestOff, bestSum, bestSSQ);
+  KernelResult kSearch;
+  kSearch.name = "patch_similarity";
+  kSearch.seconds = LFWallTime() - t0;
+  kSearch.calls = nSamples * n * nSearch;
+  kSearch.voxels = nSamples;
+  results.push_back(kSearch);
+
+  // The same with the patch size fixed at compile time, as the filter does for 
+  // the common patch radii
+  double (*fixedSearch)(const vector<long> &, const vector<ImagePointer> &,
+                        const vector<PixelType> &, const int *, size_t, const int *, size_t,
+                        vector<int> &, vector<PixelType> &, vector<PixelType> &) = NULL;
+  switch(nPatch)
+    {
+    case 27: fixedSearch = SearchSamples<27>; break;
+    case 125: fixedSearch = SearchSamples<125>; break;
+    case 147: fixedSearch = SearchSamples<147>; break;
+    case 343: fixedSearch = SearchSamples<343>; break;
+    }
+
+  if(fixedSearch)
+    {
+    t0 = LFWallTime();
+    sink += fixedSearch(samples, atlases, normtrg, offPatch, nPatch, offSearch, nSearch,
+                        bestOff, bestSum, bestSSQ);
+    KernelResult kFixed = kSearch;
+    kFixed.name = "patch_similarity_fixed";
+    kFixed.seconds = LFWallTime() - t0;
+    results.push_back(kFixed);
+    }
+
+  // Assembly: patch differences for all atlases and the error matrix
+  float **apd = VoterType::AllocatePatchDifferences(n, nPatch);
+
+  vector<VoterType::MatrixType> allMx(samples.size(), VoterType::MatrixType(n, n));
+  t0 = LFWallTime();
+  for(size_t s = 0; s < samples.size(); s++)
+    {
+    const PixelType *pnt = &normtrg[s * nPatch];
+    for(int i = 0; i < n; i++)
+      {
+      const PixelType *pMatch = atlases[i]->GetBufferPointer() + samples[s] + bestOff[s * n + i];
+      VoterType::ComputePatchDifference(
+        pMatch, bestSum[s * n + i], bestSSQ[s * n + i], pnt, nPatch, offPatch, apd[i]);
+      }
+    VoterType::ComputeErrorMatrix(apd, n, nPatch, p.alpha, p.beta, allMx[s]);
+    }
+  KernelResult kMx;
+  kMx.name = "apd_mx_assembly";
+  kMx.seconds = LFWallTime() - t0;
+  kMx.calls = nSamples;
+  kMx.voxels = nSamples;
+  results.push_back(kMx);
+
+  // Solve: weights from the error matrix
+  VoterType::VectorType ones(n, 1.0), W(n, 0.0);
+  double nSVD = 0;
+  t0 = LFWallTime();
+  for(size_t s = 0; s < samples.size(); s++)
+    {
+    if(VoterType::SolveWeights(allMx[s], ones, W) == VoterType::SOLVE_SVD)
+      nSVD++;
+    sink += W[0];
+    }
+  KernelResult kSolve;
+  kSolve.name = "weight_solve";
+  kSolve.seconds = LFWallTime() - t0;
+  kSolve.calls = nSamples;
+  kSolve.voxels = nSamples;
+  results.push_back(kSolve);
+
+  if(nSVD > 0)
+    cout << "  " << nSVD << " of " << nSamples << " solves fell back to SVD" << endl;
+
+  VoterType::FreePatchDifferences(apd);
+  delete[] offPatch;
+  delete[] offSearch;
+}
+
+// Result of running the full filter with a given number of threads
+struct RunResult
+{
+  int threads;
+  double wall, cpu, voxels;
+  vector<LabelFusionProfile::Phase> phases;
+};
+
+// Run the complete filter with the given number of threads
+RunResult RunFilter(const BenchParam &p, int threads, ImageType *target, ImageType *mask,
+                    const vector<ImagePointer> &atlases, const vector<ImagePointer> &segs,
+                    const itk::ImageRegion<3> &rVote)
+{
+  LabelFusionProfile profile;
+
+  VoterType::Pointer voter = VoterType::New();
+  voter->SetNumberOfThreads(threads);
+  voter->SetProfile(&profile);
+  voter->SetTargetImage(target);
+  voter->SetMaskImage(mask);
+  for(size_t i = 0; i < atlases.size(); i++)
+    voter->AddAtlas(atlases[i], segs[i]);
+  voter->SetPatchRadius(p.r_patch);
+  voter->SetSearchRadius(p.r_search);
+  voter->SetAlpha(p.alpha);
+  voter->SetBeta(p.beta);
+  voter->GetOutput()->SetRequestedRegion(rVote);
+
+  double t0 = LFWallTime(), c0 = LFProcessCPUTime();
+  voter->Update();
+
+  RunResult res;
+  res.threads = threads;
+  res.wall = LFWallTime() - t0;
+  res.cpu = LFProcessCPUTime() - c0;
+  res.voxels = profile.GetCounter("voxels_processed");
+  res.phases = profile.GetPhases();
+  return res;
+}
+
+void WriteRunJSON(ostream &os, const RunResult &r, const RunResult &base, bool last)
+{
+  double speedup = r.wall > 0 ? base.wall / r.wall : 0.0;
+  os << "    { \"threads\": " << r.threads
+     << ", \"wall\": " << r.wall
+     << ", \"cpu\": " << r.cpu
+     << ", \"voxels\": " << r.voxels
+     << ", \"voxels_per_second\": " << (r.wall > 0 ? r.voxels / r.wall : 0.0)
+     << ", \"speedup\": " << speedup
+     << ", \"efficiency\": " << speedup * base.threads / r.threads
+     << "," << endl << "      \"phases\": {";
+  for(size_t i = 0; i < r.phases.size(); i++)
+    os << (i ? ", " : " ") << "\"" << r.phases[i].name << "\": " << r.phases[i].wall;
+  os << " } }" << (last ? "" : ",") << endl;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc < 2) return usage();
+
+  BenchParam p;
+  p.fnOutput = argv[argc-1];
+
+  for(int j = 1; j < argc-1; j++)
+    {
+    string arg = argv[j];
+    if(arg == "-size" && j < argc-2)
+      {
+      if(!parse_vector<3>(argv[++j], p.size))
+        {
+        cerr << "Bad vector spec " << argv[j] << endl;
+        return -1;
+        }
+      }
+    else if(arg == "-rp" && j < argc-2)
+      {
+      if(!parse_vector<3>(argv[++j], p.r_patch))
+        {
+        cerr << "Bad vector spec " << argv[j] << endl;
+        return -1;
+        }
+      }
+    else if(arg == "-rs" && j < argc-2)
+      {
+      if(!parse_vector<3>(argv[++j], p.r_search))
+        {
+        cerr << "Bad vector spec " << argv[j] << endl;
+        return -1;
+        }
+      }
+    else if(arg == "-atlases" && j < argc-2)
+      p.atlases = atoi(argv[++j]);
+    else if(arg == "-labels" && j < argc-2)
+      p.labels = atoi(argv[++j]);
+    else if(arg == "-samples" && j < argc-2)
+      p.samples = atoi(argv[++j]);
+    else if(arg == "-density" && j < argc-2)
+      p.density = atof(argv[++j]);
+    else if(arg == "-seed" && j < argc-2)
+      p.seed = atoi(argv[++j]);
+    else if(arg == "-a" && j < argc-2)
+      p.alpha = atof(argv[++j]);
+    else if(arg == "-b" && j < argc-2)
+      p.beta = atof(argv[++j]);
+    else if(arg == "-threads" && j < argc-2)
+      {
+      p.threads.clear();
+      for(char *t = strtok(argv[++j], ","); t; t = strtok(NULL, ","))
+        p.threads.push_back(atoi(t));
+      }
+    else
+      {
+      cerr << "Unknown option " << arg << endl;
+      return usage();
+      }
+    }
+
+  if(p.atlases < 2 || p.labels < 1 || p.samples < 1 || p.threads.size() == 0)
+    {
+    cerr << "Need at least two atlases, one label, one sample and one thread count" << endl;
+    return -1;
+    }
+  for(size_t i = 0; i < p.threads.size(); i++)
+    {
+    if(p.threads[i] < 1)
+      {
+      cerr << "Bad thread count " << p.threads[i] << endl;
+      return -1;
+      }
+    }
+
+  itk::ImageRegion<3> rVote = ComputeVotingRegion(p);
+  if(rVote.GetNumberOfPixels() == 0)
+    {
+    cerr << "Image size is too small for the patch and search radius" << endl;
+    return -1;
+    }
+
+  // Generate the data
+  cout << "Generating synthetic data: " << p.size << ", " << p.atlases << " atlases, "
+       << p.labels << " labels" << endl;
+  srand(p.seed);
+  ImagePointer target;
+  vector<ImagePointer> atlases, segs;
+  GenerateData(p, target, atlases, segs);
+
+  unsigned long nMask;
+  ImagePointer mask = GenerateMask(p, rVote, nMask);
+
+  // Kernel benchmarks
+  cout << "Timing kernels on " << p.samples << " sampled voxels" << endl;
+  vector<KernelResult> kernels;
+  BenchmarkKernels(p, target, atlases, rVote, kernels);
+  for(size_t i = 0; i < kernels.size(); i++)
+    cout << "  " << kernels[i].name << ": " << kernels[i].seconds << " sec" << endl;
+
+  // Make sure ITK allows as many threads as we want to test
+  int maxThreads = 1;
+  for(size_t i = 0; i < p.threads.size(); i++)
+    maxThreads = std::max(maxThreads, p.threads[i]);
+  if(itk::MultiThreader::GetGlobalMaximumNumberOfThreads() < maxThreads)
+    itk::MultiThreader::SetGlobalMaximumNumberOfThreads(maxThreads);
+
+  // Full filter with each thread count
+  vector<RunResult> runs;
+  for(size_t i = 0; i < p.threads.size(); i++)
+    {
+    cout << "Running label fusion with " << p.threads[i] << " threads" << endl;
+    runs.push_back(RunFilter(p, p.threads[i], target, mask, atlases, segs, rVote));
+    cout << "  " << runs.back().wall << " sec, "
+         << runs.back().voxels / runs.back().wall << " voxels/sec" << endl;
+    }
+
+  // The voting scatter is timed inside the filter; report it from the first run
+  // in the same form as the other kernels
+  for(size_t i = 0; i < runs[0].phases.size(); i++)
+    {
+    if(runs[0].phases[i].name == "vote")
+      {
+      KernelResult kVote;
+      kVote.name = "vote_scatter";
+      kVote.seconds = runs[0].phases[i].wall;
+      kVote.calls = runs[0].voxels;
+      kVote.voxels = runs[0].voxels;
+      kernels.push_back(kVote);
+      }
+    }
+
+  // Write the report
+  ofstream fout(p.fnOutput.c_str());
+  if(!fout.good())
+    {
+    cerr << "Can not write report to " << p.fnOutput << endl;
+    return -1;
+    }
+
+  fout << std::setprecision(8);
+  fout << "{" << endl;
+  fout << "  \"config\": { \"size\": [" << p.size[0] << ", " << p.size[1] << ", " << p.size[2] << "]"
+       << ", \"atlases\": " << p.atlases << ", \"labels\": " << p.labels
+       << ", \"patch_radius\": [" << p.r_patch[0] << ", " << p.r_patch[1] << ", " << p.r_patch[2] << "]"
+       << ", \"search_radius\": [" << p.r_search[0] << ", " << p.r_search[1] << ", " << p.r_search[2] << "]"
+       << ", \"density\": " << p.density << ", \"mask_voxels\": " << nMask
+       << ", \"samples\": " << p.samples << ", \"seed\": " << p.seed
+       << ", \"alpha\": " << p.alpha << ", \"beta\": " << p.beta << " }," << endl;
+
+  fout << "  \"kernels\": [" << endl;
+  for(size_t i = 0; i < kernels.size(); i++)
+    WriteKernelJSON(fout, kernels[i], i + 1 == kernels.size());
+  fout << "  ]," << endl;
+
+  fout << "  \"scaling\": [" << endl;
+  for(size_t i = 0; i < runs.size(); i++)
+    WriteRunJSON(fout, runs[i], runs[0], i + 1 == runs.size());
+  fout << "  ]," << endl;
+
+  fout << "  \"peak_rss_mb\": " << LFPeakRSSMegabytes() << endl;
+  fout << "}" << endl;
+
+  return 0;
+}
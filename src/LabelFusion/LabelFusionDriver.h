@@ -0,0 +1,687 @@
+/*===================================================================
+
+  Program:   ASHS (Automatic Segmentation of Hippocampal Subfields)
+  Module:    $Id$
+  Language:  C++ program
+  Copyright (c) 2012 Paul A. Yushkevich, University of Pennsylvania
+
+  This file is part of ASHS
+
+  ASHS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =================================================================== */
+
+#ifndef __LabelFusionDriver_h_
+#define __LabelFusionDriver_h_
+
+#include "WeightedVotingLabelFusionImageFilter.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkCommand.h"
+#include "LabelFusionProfile.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cstring>
+#include <cstdlib>
+
+/*
+ * The label fusion driver: parameters and the code that sets up and runs the
+ * voting filter on images in memory. This is used by the label_fusion program
+ * and by the labelfusion library. Image I/O and padding are left to the caller.
+ */
+
+enum LFMethod
+{
+  JOINT, GAUSSIAN, INVERSE 
+};
+
+template<unsigned int VDim> 
+struct LFParam
+{
+  std::vector<std::string> fnAtlas;
+  std::vector<std::string> fnLabel;
+  std::string fnTarget;
+  std::string fnOutput;
+  std::string fnPosterior;
+  std::string fnWeight;
+  LFMethod method;
+  std::string fnMask;
+  std::string fnProfile;
+  std::string fnBatch;
+  std::string fnCheckpoint;
+
+  // Progress heartbeat: status file, or "-" for standard error, and seconds between reports
+  std::string fnHeartbeat;
+  double heartbeatInterval;
+
+  std::map<int, std::string> fnExclusion;
+
+  double alpha, beta, sigma;
+  itk::Size<VDim> r_patch, r_search, weightStride;
+
+  // Optional ellipsoidal patch and search neighborhoods with semi-axes in mm
+  itk::Vector<double, VDim> r_patch_mm, r_search_mm;
+  
+  bool padding;
+  itk::Size<VDim> paddingSize;
+
+  int threads;
+
+  bool simdSolve;
+
+  // Approximate PatchMatch search instead of the exhaustive search, and the fraction
+  // of the voxels where it is checked against the exhaustive search
+  bool patchMatch;
+  double patchMatchCheck;
+
+  // Pin the threads to NUMA nodes and place the buffers near them
+  bool numa;
+
+  // Only print the predicted memory and run time of the job
+  bool estimate;
+
+  // Number of PCA components for the descriptor search (zero to disable), and the
+  // number of candidates re-scored exactly
+  int pcaComponents, pcaCandidates;
+
+  // Margin below which cascade voting runs joint fusion, zero to disable the cascade
+  double cascadeMargin;
+
+  // Fraction of best matches covered by the automatic search radius, zero to disable
+  double autoSearch;
+
+  // Tile size for tiled traversal, zero for voxel-by-voxel
+  itk::Size<VDim> tileSize;
+
+  // Number of regularized Cholesky retries before the SVD, zero for SVD only
+  int ridgeRetries;
+
+  // Slab of the region processed by this run (partIndex of partCount), zero count
+  // to process the whole region
+  int partIndex, partCount;
+
+  // Seconds between checkpoints, and whether to resume from the checkpoint file
+  double checkpointInterval;
+  bool resume;
+
+  // Parameter sweep: (alpha, beta) pairs that share one search, empty for a single
+  // run. The first pair takes the place of alpha and beta
+  std::vector<std::pair<double, double> > sweep;
+
+  LFParam()
+    {
+    alpha = 0.1;
+    beta = 2;
+    sigma = 0.5;
+    r_patch.Fill(3);
+    r_search.Fill(3);
+    weightStride.Fill(1);
+    r_patch_mm.Fill(0.0);
+    r_search_mm.Fill(0.0);
+    method = JOINT;
+    padding = false;
+    threads = 0;
+    simdSolve = false;
+    patchMatch = false;
+    patchMatchCheck = 0.0;
+    numa = false;
+    estimate = false;
+    pcaComponents = 0;
+    pcaCandidates = 4;
+    tileSize.Fill(0);
+    cascadeMargin = 0.0;
+    autoSearch = 0.0;
+    ridgeRetries = 0;
+    partIndex = 0;
+    partCount = 0;
+    checkpointInterval = 600.0;
+    resume = false;
+    heartbeatInterval = 60.0;
+    }
+
+  void Print(std::ostream &oss) const
+    {
+    oss << "Target image: " << fnTarget << std::endl;
+    oss << "Output image: " << fnOutput << std::endl;
+    oss << "Mask image  : " << fnMask << std::endl;
+    oss << "Atlas images: " << std::endl;
+    for(size_t i = 0; i < fnAtlas.size(); i++)
+      {
+      if(fnLabel.size())
+        oss << "    " << i << "\t" << fnAtlas[i] << " | " << fnLabel[i] << std::endl;
+      else
+        oss << "    " << i << "\t" << fnAtlas[i] << std::endl;
+      }
+    if(method == GAUSSIAN)
+      {
+      oss << "Method:     Gaussian" << std::endl;
+      oss << "    Sigma:  " << sigma << std::endl;
+      }
+    else if(method == JOINT)
+      {
+      oss << "Method:     Joint" << std::endl;
+      oss << "    Alpha:  " << alpha << std::endl;
+      oss << "    Beta:  " << beta << std::endl;
+      }
+    else if(method == INVERSE)
+      {
+      oss << "Method:     Inverse" << std::endl;
+      oss << "    Beta:  " << beta << std::endl;
+      }
+    if(r_search_mm.GetNorm() > 0)
+      oss << "Search Radius (mm, ellipsoid): " << r_search_mm << std::endl;
+    else
+      oss << "Search Radius: " << r_search << std::endl;
+    if(r_patch_mm.GetNorm() > 0)
+      oss << "Patch Radius (mm, ellipsoid): " << r_patch_mm << std::endl;
+    else
+      oss << "Patch Radius: " << r_patch << std::endl;
+    oss << "Weight Stride: " << weightStride << std::endl;
+    oss << "Batched Solver: " << simdSolve << std::endl;
+    oss << "Tile Size: " << tileSize << std::endl;
+    if(cascadeMargin > 0)
+      oss << "Cascade Margin: " << cascadeMargin << std::endl;
+    if(autoSearch > 0)
+      oss << "Automatic Search Radius: " << autoSearch << std::endl;
+    if(patchMatch)
+      {
+      oss << "Search: PatchMatch";
+      if(patchMatchCheck > 0)
+        oss << ", checking " << patchMatchCheck * 100 << "% of the voxels";
+      oss << std::endl;
+      }
+    if(pcaComponents > 0)
+      oss << "Search: PCA descriptors, " << pcaComponents << " components, " 
+        << pcaCandidates << " candidates" << std::endl;
+    if(numa)
+      oss << "NUMA Placement: on" << std::endl;
+    if(ridgeRetries > 0)
+      oss << "Solve Fallback: ridge, " << ridgeRetries << " retries" << std::endl;
+    else
+      oss << "Solve Fallback: svd" << std::endl;
+    if(partCount > 0)
+      oss << "Partition: " << partIndex << " of " << partCount << std::endl;
+    if(sweep.size())
+      {
+      oss << "Parameter Sweep: " << std::endl;
+      for(size_t s = 0; s < sweep.size(); s++)
+        oss << "    " << s << "\tAlpha: " << sweep[s].first << "\tBeta: " << sweep[s].second << std::endl;
+      }
+    if(fnPosterior.size())
+      oss << "Posterior Filename Pattern: " << fnPosterior << std::endl;
+    if(fnWeight.size())
+      oss << "Weight Map Filename Pattern: " << fnWeight << std::endl;
+
+    oss << "Padding Enabled: " << padding << std::endl;
+    if(padding)
+      oss << "Padding Radius: " << paddingSize << std::endl;
+    if(fnProfile.size())
+      oss << "Profile Report: " << fnProfile << std::endl;
+    if(fnHeartbeat.size())
+      oss << "Heartbeat: " << fnHeartbeat << " every " << heartbeatInterval << "s" << std::endl;
+    if(fnCheckpoint.size())
+      oss << "Checkpoint: " << fnCheckpoint << " every " << checkpointInterval << "s"
+        << (resume ? ", resuming" : "") << std::endl;
+    }
+};
+
+
+template <unsigned int VDim>
+void ExpandRegion(itk::ImageRegion<VDim> &r, bool &isinit, const itk::Index<VDim> &idx)
+{
+  if(!isinit)
+    {
+    for(size_t d = 0; d < VDim; d++)
+      {
+      r.SetIndex(d, idx[d]);
+      r.SetSize(d,1);
+      }
+    isinit = true;
+    }
+  else
+    {
+    for(size_t d = 0; d < VDim; d++)
+      {
+      int x = r.GetIndex(d), s = r.GetSize(d);
+      if(idx[d] < x)
+        {
+        r.SetSize(d, s + x - idx[d]);
+        r.SetIndex(d, idx[d]);
+        }
+      else if(idx[d] >= x + s)
+        {
+        r.SetSize(d, 1 + idx[d] - x);
+        } 
+      }
+    }
+}
+
+template <class TImage>
+void ExpandRegion(TImage *image, typename TImage::RegionType &r, bool &isinit)
+{
+  for(itk::ImageRegionIteratorWithIndex<TImage> it(image, image->GetBufferedRegion()); 
+    !it.IsAtEnd(); ++it)
+    {
+    if(it.Get())
+      {
+      ExpandRegion<TImage::ImageDimension>(r, isinit, it.GetIndex());
+      }
+    }
+}
+
+template<unsigned int VDim>
+bool
+parse_vector(char *text, itk::Size<VDim> &s)
+{
+  char *t = strtok(text,"x");
+  size_t i = 0;
+  while(t && i < VDim)
+    {
+    s[i++] = atoi(t);
+    t = strtok(NULL, "x");
+    }
+
+  if(i == VDim)
+    return true;
+  else if(i == 1)
+    {
+    s.Fill(s[0]);
+    return true;
+    }
+  return false;
+}
+template<unsigned int VDim>
+bool
+parse_vector(char *text, itk::Vector<double, VDim> &s)
+{
+  char *t = strtok(text,"x");
+  size_t i = 0;
+  while(t && i < VDim)
+    {
+    s[i++] = atof(t);
+    t = strtok(NULL, "x");
+    }
+
+  if(i == VDim)
+    return true;
+  else if(i == 1)
+    {
+    s.Fill(s[0]);
+    return true;
+    }
+  return false;
+}
+
+/** 
+ * The voxel radius of the box that holds an ellipsoid with semi-axes in mm. If the
+ * semi-axes are all zero, the radius is left as it is.
+ */
+template <unsigned int VDim>
+void EllipsoidBoundingRadius(const itk::Vector<double, VDim> &mm, 
+                             const itk::Vector<double, VDim> &spacing, itk::Size<VDim> &r)
+{
+  if(mm.GetNorm() == 0)
+    return;
+
+  for(unsigned int d = 0; d < VDim; d++)
+    r[d] = (long) floor(mm[d] / spacing[d] + 1.0e-6);
+}
+
+/** Input images for label fusion, already in memory */
+template <unsigned int VDim>
+struct LFInputs
+{
+  typedef itk::Image<float, VDim> ImageType;
+  typedef typename ImageType::Pointer ImagePointer;
+
+  ImagePointer target, mask;
+  std::vector<ImagePointer> atlas, label;
+  std::map<int, ImagePointer> exclusion;
+};
+
+/** 
+ * Outputs of label fusion. All images have the same extent as the target image.
+ * Posterior and weight maps are only filled in when requested. For a partition,
+ * the posterior maps hold the sums of the votes, and the counter and voting mask
+ * are filled in, so that the partitions can be merged. For a parameter sweep, the
+ * segmentation and posterior maps are those of the first pair, and the other pairs
+ * follow in sweepSegmentation and sweepPosterior.
+ */
+template <unsigned int VDim>
+struct LFResult
+{
+  typedef itk::Image<float, VDim> ImageType;
+  typedef typename ImageType::Pointer ImagePointer;
+
+  ImagePointer segmentation;
+  std::map<int, ImagePointer> posterior;
+  std::vector<ImagePointer> weight;
+  ImagePointer counter, votingMask;
+
+  std::vector<ImagePointer> sweepSegmentation;
+  std::vector<std::map<int, ImagePointer> > sweepPosterior;
+
+  // The region where label fusion was performed, and the region where the weights
+  // were estimated. These only differ for a partition, where the votes are also
+  // collected in a halo around the slab
+  itk::ImageRegion<VDim> region, core;
+};
+
+/** 
+ * Allocate an image with the same geometry as the reference and fill it. The image
+ * covers the whole reference, even if only a region of the reference is in memory
+ */
+template <class TImage>
+typename TImage::Pointer
+NewImageLike(const TImage *ref, typename TImage::PixelType value)
+{
+  typename TImage::Pointer img = TImage::New();
+  img->SetRegions(ref->GetLargestPossibleRegion());
+  img->CopyInformation(ref);
+  img->Allocate();
+  img->FillBuffer(value);
+  return img;
+}
+
+/** Copy the part of a filter output inside a region into a full-size image */
+template <class TImage, class TSource>
+typename TImage::Pointer
+ExpandToTarget(const TImage *target, TSource *source, const typename TImage::RegionType &region,
+               typename TImage::PixelType value)
+{
+  typename TImage::Pointer img = NewImageLike<TImage>(target, value);
+  for(itk::ImageRegionIteratorWithIndex<TSource> it(source, region); !it.IsAtEnd(); ++it)
+    img->SetPixel(it.GetIndex(), it.Get());
+  return img;
+}
+
+/** Expand the posterior maps of the filter to full size */
+template <class TImage, class TPosteriorMap>
+void ExpandPosteriorMaps(const TImage *target, const TPosteriorMap &pm, 
+                         const typename TImage::RegionType &region,
+                         std::map<int, typename TImage::Pointer> &out)
+{
+  out.clear();
+  for(typename TPosteriorMap::const_iterator it = pm.begin(); it != pm.end(); ++it)
+    out[(int) it->first] = ExpandToTarget<TImage>(target, it->second.GetPointer(), region, 0.0f);
+}
+
+/**
+ * The part of the target where the output can be computed: the voxels whose patch
+ * and search neighborhoods are inside the image
+ */
+template <unsigned int VDim>
+itk::ImageRegion<VDim> 
+GetFusionBounds(const itk::Image<float, VDim> *target, 
+                const itk::Size<VDim> &rPatch, const itk::Size<VDim> &rSearch)
+{
+  itk::ImageRegion<VDim> rOut = target->GetLargestPossibleRegion();
+  for(int d = 0; d < VDim; d++)
+    {
+    rOut.SetIndex(d, rPatch[d] + rSearch[d] + rOut.GetIndex(d));
+    rOut.SetSize(d, rOut.GetSize(d) - 2 * (rSearch[d] + rPatch[d]));
+    }
+  return rOut;
+}
+
+/**
+ * The region where label fusion computes the output: the bounding box of the mask
+ * and the atlas segmentations, or the whole target if there are none, kept far
+ * enough from the edges of the target for the patch and search neighborhoods.
+ * The patch and search radii in voxels are returned as well. For ellipsoids given
+ * in mm, these are the radii of the bounding boxes in the target image.
+ */
+template <unsigned int VDim>
+itk::ImageRegion<VDim> 
+GetFusionRegion(const LFParam<VDim> &p, const LFInputs<VDim> &in, 
+                const itk::Image<float, VDim> *target,
+                itk::Size<VDim> &rPatch, itk::Size<VDim> &rSearch)
+{
+  // Compute the output region by merging all segmentations
+  itk::ImageRegion<VDim> rMask;
+  bool isMaskInit = false;
+
+  // Initialize the mask region based on the mask
+  if(in.mask)
+    ExpandRegion(in.mask.GetPointer(), rMask, isMaskInit);
+
+  for(size_t i = 0; i < in.label.size(); i++)
+    ExpandRegion(in.label[i].GetPointer(), rMask, isMaskInit);
+
+  // If the region has not been set up, set the region to be the target region
+  if(!isMaskInit)
+    rMask = target->GetLargestPossibleRegion();
+
+  rPatch = p.r_patch;
+  rSearch = p.r_search;
+  EllipsoidBoundingRadius<VDim>(p.r_patch_mm, target->GetSpacing(), rPatch);
+  EllipsoidBoundingRadius<VDim>(p.r_search_mm, target->GetSpacing(), rSearch);
+
+  // Make sure the region is inside bounds
+  rMask.Crop(GetFusionBounds(target, rPatch, rSearch));
+
+  return rMask;
+}
+
+/**
+ * The slab of the fusion region where a partition estimates the weights, along
+ * the last dimension. Without partitions, this is the whole fusion region
+ */
+template <unsigned int VDim>
+itk::ImageRegion<VDim> 
+GetPartitionRegion(const LFParam<VDim> &p, const itk::ImageRegion<VDim> &rMask)
+{
+  itk::ImageRegion<VDim> rCore = rMask;
+  if(p.partCount > 0)
+    {
+    long z0 = rMask.GetIndex(VDim-1), nz = rMask.GetSize(VDim-1);
+    long zStart = z0 + (nz * p.partIndex) / p.partCount;
+    long zEnd = z0 + (nz * (p.partIndex + 1)) / p.partCount;
+    if(zEnd <= zStart)
+      itkGenericExceptionMacro(<< "Partition " << p.partIndex << " of " << p.partCount 
+        << " is empty, the region only has " << nz << " slices");
+
+    rCore.SetIndex(VDim-1, zStart);
+    rCore.SetSize(VDim-1, zEnd - zStart);
+    }
+  return rCore;
+}
+
+/**
+ * The region of the input images that label fusion reads: the fusion region padded
+ * by the patch and search radii. Only the target's geometry is used, so the target
+ * does not need to be in memory. Images can be cropped to this region beforehand.
+ */
+template <unsigned int VDim>
+itk::ImageRegion<VDim> 
+GetFusionInputRegion(const LFParam<VDim> &p, const LFInputs<VDim> &in, 
+                     const itk::Image<float, VDim> *target)
+{
+  itk::Size<VDim> rPatch, rSearch;
+  itk::ImageRegion<VDim> region = GetFusionRegion(p, in, target, rPatch, rSearch);
+  region.PadByRadius(rSearch);
+  region.PadByRadius(rPatch);
+  region.Crop(target->GetLargestPossibleRegion());
+  return region;
+}
+
+/**
+ * Run label fusion on images that are already in memory. This is the core of the
+ * label_fusion program, shared with the library interface. File names in the
+ * parameters are ignored, except that the presence of the posterior and weight
+ * patterns determines whether these maps are computed. If a progress command is
+ * given, it is attached to the filter's ProgressEvent, and a heartbeat, if given,
+ * reports the progress of the fusion. Throws ITK exceptions on failure.
+ */
+template <unsigned int VDim>
+void RunLabelFusion(const LFParam<VDim> &p, const LFInputs<VDim> &in, LFResult<VDim> &out,
+                    LabelFusionProfile *profile = NULL, itk::Command *progress = NULL,
+                    ASHSHeartbeat *heartbeat = NULL)
+{
+  typedef itk::Image<float, VDim> ImageType;
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef WeightedVotingLabelFusionImageFilter<ImageType, ImageType> VoterType;
+  typename VoterType::Pointer voter = VoterType::New();
+
+  if(profile)
+    voter->SetProfile(profile);
+  if(progress)
+    voter->AddObserver(itk::ProgressEvent(), progress);
+  if(heartbeat)
+    voter->SetHeartbeat(heartbeat);
+  if(p.threads > 0)
+    voter->SetNumberOfThreads(p.threads);
+
+  ImagePointer target = in.target;
+  voter->SetTargetImage(target);
+
+  // Use the mask image
+  if(in.mask)
+    voter->SetMaskImage(in.mask);
+
+  for(size_t i = 0; i < in.atlas.size(); i++)
+    {
+    if(in.label.size())
+      voter->AddAtlas(in.atlas[i], in.label[i]);
+    else
+      voter->AddAtlas(in.atlas[i]);
+    }
+
+  // The output region and the patch and search radii in voxels
+  itk::Size<VDim> rPatch, rSearch;
+  itk::ImageRegion<VDim> rMask = GetFusionRegion(p, in, target.GetPointer(), rPatch, rSearch);
+
+  // For a partition, the weights are estimated in one slab of the region along the
+  // last dimension, and the votes are collected in the slab padded by the patch radius
+  itk::ImageRegion<VDim> rCore = GetPartitionRegion(p, rMask);
+  if(p.partCount > 0)
+    {
+    voter->SetEstimationRegion(rCore);
+
+    rMask = rCore;
+    rMask.PadByRadius(rPatch);
+    rMask.Crop(GetFusionBounds(target.GetPointer(), rPatch, rSearch));
+    }
+
+  voter->SetPatchRadius(rPatch);
+  voter->SetSearchRadius(rSearch);
+  voter->SetPatchRadiusPhysical(p.r_patch_mm);
+  voter->SetSearchRadiusPhysical(p.r_search_mm);
+  voter->SetAlpha(p.alpha);
+  voter->SetBeta(p.beta);
+  if(p.sweep.size())
+    {
+    voter->SetAlpha(p.sweep[0].first);
+    voter->SetBeta(p.sweep[0].second);
+    for(size_t s = 1; s < p.sweep.size(); s++)
+      voter->AddSweepParameters(p.sweep[s].first, p.sweep[s].second);
+    }
+  voter->SetWeightStride(p.weightStride);
+  voter->SetBatchedSolve(p.simdSolve);
+  voter->SetTileSize(p.tileSize);
+  voter->SetCascadeMargin(p.cascadeMargin);
+  voter->SetAutoSearchFraction(p.autoSearch);
+  voter->SetPatchMatch(p.patchMatch);
+  voter->SetPatchMatchCheckFraction(p.patchMatchCheck);
+  voter->SetNUMAPlacement(p.numa);
+  voter->SetDescriptorComponents(p.pcaComponents);
+  voter->SetDescriptorCandidates(p.pcaCandidates);
+  voter->SetCheckpointFile(p.fnCheckpoint);
+  voter->SetCheckpointInterval(p.checkpointInterval);
+  voter->SetResume(p.resume);
+  if(p.ridgeRetries > 0)
+    {
+    voter->SetSolveFallback(VoterType::FALLBACK_RIDGE);
+    voter->SetRidgeRetries(p.ridgeRetries);
+    }
+
+  // The posterior maps. Partitions keep the sums of the votes
+  if(p.fnPosterior.size() || p.partCount > 0)
+    voter->SetRetainPosteriorMaps(true);
+  if(p.partCount > 0)
+    voter->SetNormalizePosteriorMaps(false);
+
+  if(p.fnWeight.size())
+    voter->SetGenerateWeightMaps(true);
+
+  std::cout << "Output Requested Region: " << rMask.GetIndex() << ", " << rMask.GetSize() << " ("
+    << rMask.GetNumberOfPixels() << " pixels)" << std::endl;
+
+  // Set the exclusions in the atlas
+  for(typename std::map<int, ImagePointer>::const_iterator xit = in.exclusion.begin(); 
+    xit != in.exclusion.end(); ++xit)
+    {
+    voter->AddExclusionMap(xit->first, xit->second);
+    }
+
+  if(profile)
+    profile->SetCounter("region_voxels", rCore.GetNumberOfPixels());
+
+  voter->GetOutput()->SetRequestedRegion(rMask);
+  voter->Update();
+
+  out.region = rMask;
+  out.core = rCore;
+
+  // Convert to an output image
+  out.segmentation = ExpandToTarget<ImageType>(target, voter->GetOutput(), rMask, 0.0f);
+
+  // Expand the weight maps to full size
+  out.weight.clear();
+  if(p.fnWeight.size())
+    {
+    for(size_t i = 0; i < in.atlas.size(); i++)
+      {
+      out.weight.push_back(
+        ExpandToTarget<ImageType>(target, voter->GetWeightMap(i), rMask, 1.0f / in.atlas.size()));
+      }
+    }
+
+  // Expand the posterior maps to full size
+  out.posterior.clear();
+  if(p.fnPosterior.size() || p.partCount > 0)
+    ExpandPosteriorMaps<ImageType>(target, voter->GetPosteriorMaps(), rMask, out.posterior);
+
+  // The results of the other pairs of the sweep
+  out.sweepSegmentation.clear();
+  out.sweepPosterior.clear();
+  for(size_t s = 0; s < voter->GetNumberOfSweepParameters(); s++)
+    {
+    ImagePointer seg;
+    if(voter->GetSweepOutput(s))
+      seg = ExpandToTarget<ImageType>(target, voter->GetSweepOutput(s), rMask, 0.0f);
+    out.sweepSegmentation.push_back(seg);
+
+    out.sweepPosterior.push_back(std::map<int, ImagePointer>());
+    if(p.fnPosterior.size())
+      ExpandPosteriorMaps<ImageType>(target, voter->GetSweepPosteriorMaps(s), rMask, out.sweepPosterior.back());
+    }
+
+  // Keep what is needed to merge the partitions
+  out.counter = NULL;
+  out.votingMask = NULL;
+  if(p.partCount > 0)
+    {
+    out.counter = NewImageLike<ImageType>(target, 0.0f);
+    out.votingMask = NewImageLike<ImageType>(target, 0.0f);
+    for(itk::ImageRegionIteratorWithIndex<ImageType> it(out.counter, rMask); !it.IsAtEnd(); ++it)
+      {
+      it.Set(voter->GetCounterMap()->GetPixel(it.GetIndex()));
+      if(rCore.IsInside(it.GetIndex()))
+        out.votingMask->SetPixel(it.GetIndex(), voter->IsInVotingMask(it.GetIndex()) ? 1.0f : 0.0f);
+      }
+    }
+}
+
+#endif
@@ -0,0 +1,325 @@
+/*===================================================================
+
+  Program:   ASHS (Automatic Segmentation of Hippocampal Subfields)
+  Module:    $Id$
+  Language:  C++ program
+  Copyright (c) 2012 Paul A. Yushkevich, University of Pennsylvania
+
+  This file is part of ASHS
+
+  ASHS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  ===================================================================
+
+  Combines the partitions written by label_fusion --partition i/N into the
+  final segmentation. The sums of the votes and the vote counters of the
+  partitions are added up, and the final vote with exclusions is done on the
+  sums, which gives the same result as running label_fusion on the whole
+  region, up to round-off in the sums.
+
+  =================================================================== */
+
+#include "LabelFusionDriver.h"
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+int usage()
+{
+  cout << "label_fusion_merge: " << endl;
+  cout << "usage: " << endl;
+  cout << "  label_fusion_merge [dim] [options] target_image output_image partition1 ... partitionN" << endl;
+  cout << endl;
+  cout << "Combines the partitions of a label_fusion run made with --partition i/N. Each" << endl;
+  cout << "partition is given by the prefix that was used as its output_image. The target" << endl;
+  cout << "image gives the geometry of the output." << endl;
+  cout << endl;
+  cout << "required options:" << endl;
+  cout << "  dim                             Image dimension (2 or 3)" << endl;
+  cout << "other options: " << endl;
+  cout << "  -x label image.nii              Specify an exclusion region for the given label. " << endl;
+  cout << "                                  If a voxel has non-zero value in an exclusion image," << endl;
+  cout << "                                  the corresponding label is not allowed at that voxel." << endl;
+  cout << "  -p filenamePattern              Save the posterior voting maps, as with label_fusion -p" << endl;
+
+  return -1;
+}
+
+template <class TImage>
+typename TImage::Pointer
+ReadImage(const string &filename)
+{
+  typedef itk::ImageFileReader<TImage> ReaderType;
+  typename ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName(filename.c_str());
+  reader->Update();
+  return reader->GetOutput();
+}
+
+/**
+ * Add a partial image to a full-size image, or copy it over if add is false. The
+ * voxels are matched up by the physical position of the first voxel of the partial
+ * image, which must have the same spacing as the full image. Voxels of the partial
+ * image outside of the full image (i.e., in the padding) are ignored.
+ */
+template <class TImage>
+bool AddPartial(TImage *full, TImage *part, bool add)
+{
+  for(unsigned int d = 0; d < TImage::ImageDimension; d++)
+    if(fabs(full->GetSpacing()[d] - part->GetSpacing()[d]) > 1.0e-4 * full->GetSpacing()[d])
+      return false;
+
+  typename TImage::RegionType rPart = part->GetBufferedRegion();
+  typename TImage::PointType origin;
+  typename TImage::IndexType idxFull;
+  part->TransformIndexToPhysicalPoint(rPart.GetIndex(), origin);
+  full->TransformPhysicalPointToIndex(origin, idxFull);
+
+  typename TImage::RegionType rFull = full->GetBufferedRegion();
+  for(itk::ImageRegionIteratorWithIndex<TImage> it(part, rPart); !it.IsAtEnd(); ++it)
+    {
+    typename TImage::IndexType idx = idxFull + (it.GetIndex() - rPart.GetIndex());
+    if(!rFull.IsInside(idx))
+      continue;
+
+    if(add)
+      full->SetPixel(idx, full->GetPixel(idx) + it.Get());
+    else
+      full->SetPixel(idx, it.Get());
+    }
+
+  return true;
+}
+
+template <unsigned int VDim>
+int lfmerge(int argc, char *argv[])
+{
+  typedef itk::Image<float, VDim> ImageType;
+  typedef typename ImageType::Pointer ImagePointer;
+  typedef itk::ImageFileWriter<ImageType> WriterType;
+
+  // Read the options
+  map<int, string> fnExclusion;
+  string fnPosterior;
+  int j = 2;
+  for(; j < argc && argv[j][0] == '-'; j++)
+    {
+    string arg = argv[j];
+    if(arg == "-x" && j < argc-2)
+      {
+      int label = atoi(argv[++j]);
+      fnExclusion[label] = argv[++j];
+      }
+    else if(arg == "-p" && j < argc-1)
+      {
+      fnPosterior = argv[++j];
+      }
+    else
+      {
+      cerr << "Unknown option " << arg << endl;
+      return -1;
+      }
+    }
+
+  if(argc - j < 3)
+    return usage();
+
+  string fnTarget = argv[j++];
+  string fnOutput = argv[j++];
+  vector<string> prefix(argv + j, argv + argc);
+
+  // Check the posterior filename pattern
+  if(fnPosterior.size())
+    {
+    char buffer[4096];
+    sprintf(buffer, fnPosterior.c_str(), 100);
+    if(strcmp(buffer, fnPosterior.c_str()) == 0)
+      {
+      cerr << "Invalid filename pattern " << fnPosterior << endl;
+      return -1;
+      }
+    }
+
+  // The target image gives the geometry
+  ImagePointer target = ReadImage<ImageType>(fnTarget);
+  ImagePointer seg = NewImageLike<ImageType>(target, 0.0f);
+  ImagePointer mask = NewImageLike<ImageType>(target, 0.0f);
+  ImagePointer counter = NewImageLike<ImageType>(target, 0.0f);
+  map<int, ImagePointer> posterior;
+
+  map<int, ImagePointer> exclusion;
+  for(map<int, string>::const_iterator xit = fnExclusion.begin(); xit != fnExclusion.end(); ++xit)
+    exclusion[xit->first] = ReadImage<ImageType>(xit->second);
+
+  // Add up the partitions
+  int nPart = 0;
+  vector<bool> seen;
+  for(size_t k = 0; k < prefix.size(); k++)
+    {
+    // Read the partition number and the labels
+    ifstream fin((prefix[k] + ".txt").c_str());
+    string line, key;
+    int iPart = -1, nPartK = 0;
+    vector<int> labels;
+    while(getline(fin, line))
+      {
+      istringstream iss(line);
+      iss >> key;
+      if(key == "partition")
+        iss >> iPart >> nPartK;
+      else if(key == "labels")
+        for(int label; iss >> label; )
+          labels.push_back(label);
+      }
+
+    if(nPartK < 1 || iPart < 0 || iPart >= nPartK)
+      {
+      cerr << "Can not read partition list " << prefix[k] << ".txt" << endl;
+      return -1;
+      }
+
+    if(nPart == 0)
+      {
+      nPart = nPartK;
+      seen.assign(nPart, false);
+      }
+    else if(nPartK != nPart)
+      {
+      cerr << "Partition " << prefix[k] << " is one of " << nPartK << ", expected one of " << nPart << endl;
+      return -1;
+      }
+
+    if(seen[iPart])
+      {
+      cerr << "Partition " << iPart << " is given more than once" << endl;
+      return -1;
+      }
+    seen[iPart] = true;
+
+    cout << "Adding partition " << iPart << " of " << nPart << " (" << labels.size() << " labels)" << endl;
+
+    bool ok = AddPartial<ImageType>(seg, ReadImage<ImageType>(prefix[k] + "_seg.nii.gz"), false);
+    ok = ok && AddPartial<ImageType>(mask, ReadImage<ImageType>(prefix[k] + "_mask.nii.gz"), false);
+    ok = ok && AddPartial<ImageType>(counter, ReadImage<ImageType>(prefix[k] + "_counter.nii.gz"), true);
+    for(size_t i = 0; ok && i < labels.size(); i++)
+      {
+      if(posterior.find(labels[i]) == posterior.end())
+        posterior[labels[i]] = NewImageLike<ImageType>(target, 0.0f);
+
+      char buffer[4096];
+      sprintf(buffer, "%s_post%04d.nii.gz", prefix[k].c_str(), labels[i]);
+      ok = AddPartial<ImageType>(posterior[labels[i]], ReadImage<ImageType>(buffer), true);
+      }
+
+    if(!ok)
+      {
+      cerr << "Partition " << prefix[k] << " does not match the spacing of the target image" << endl;
+      return -1;
+      }
+    }
+
+  for(int i = 0; i < nPart; i++)
+    {
+    if(!seen[i])
+      {
+      cerr << "Partition " << i << " of " << nPart << " is missing" << endl;
+      return -1;
+      }
+    }
+
+  // Vote at the voxels that were voted on by label fusion. The other voxels keep
+  // the label assigned by the partitions
+  cout << "VOTING " << endl;
+  for(itk::ImageRegionIteratorWithIndex<ImageType> it(seg, seg->GetBufferedRegion()); !it.IsAtEnd(); ++it)
+    {
+    if(mask->GetPixel(it.GetIndex()) == 0)
+      continue;
+
+    double wmax = 0;
+    float winner = 0;
+    for(typename map<int, ImagePointer>::const_iterator pit = posterior.begin(); pit != posterior.end(); ++pit)
+      {
+      double post = pit->second->GetPixel(it.GetIndex());
+
+      // check if the label is excluded
+      typename map<int, ImagePointer>::const_iterator xit = exclusion.find(pit->first);
+      bool excluded = (xit != exclusion.end() && xit->second->GetPixel(it.GetIndex()) != 0);
+
+      if(wmax < post && !excluded)
+        {
+        wmax = post;
+        winner = pit->first;
+        }
+      }
+
+    it.Set(winner);
+    }
+
+  typename WriterType::Pointer writer = WriterType::New();
+  writer->SetInput(seg);
+  writer->SetFileName(fnOutput.c_str());
+  writer->Update();
+
+  // Normalize the posterior maps by the counter, as label_fusion does
+  if(fnPosterior.size())
+    {
+    for(typename map<int, ImagePointer>::const_iterator pit = posterior.begin(); pit != posterior.end(); ++pit)
+      {
+      for(itk::ImageRegionIteratorWithIndex<ImageType> it(pit->second, pit->second->GetBufferedRegion());
+        !it.IsAtEnd(); ++it)
+        {
+        float scale = counter->GetPixel(it.GetIndex());
+        if(scale >= 0.1)
+          it.Set(it.Get() / scale);
+        }
+
+      char buffer[4096];
+      sprintf(buffer, fnPosterior.c_str(), pit->first);
+
+      typename WriterType::Pointer writer = WriterType::New();
+      writer->SetInput(pit->second);
+      writer->SetFileName(buffer);
+      writer->Update();
+      }
+    }
+
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc < 5) return usage();
+
+  int dim = atoi(argv[1]);
+
+  try
+    {
+    if(dim == 2)
+      return lfmerge<2>(argc, argv);
+    else if(dim == 3)
+      return lfmerge<3>(argc, argv);
+    }
+  catch(itk::ExceptionObject &exc)
+    {
+    cerr << "Exception: " << exc.GetDescription() << endl;
+    return -1;
+    }
+
+  cerr << "Dimension " << argv[1] << " is not supported" << endl;
+  return -1;
+}
@@ -0,0 +1,176 @@
+/*===================================================================
+
+  Program:   ASHS (Automatic Segmentation of Hippocampal Subfields)
+  Module:    $Id$
+  Language:  C++ program
+  Copyright (c) 2012 Paul A. Yushkevich, University of Pennsylvania
+
+  This file is part of ASHS
+
+  ASHS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =================================================================== */
+
+#ifndef __LabelFusionNUMA_h_
+#define __LabelFusionNUMA_h_
+
+/*
+ * NUMA placement without libnuma. The topology is read from sysfs, and the memory
+ * policy is set with the mbind system call. On other systems, or when sysfs lists
+ * no nodes, there is a single node and the placement does nothing.
+ */
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+// Memory policies and flags, as in <numaif.h>
+#define LF_MPOL_BIND        2
+#define LF_MPOL_INTERLEAVE  3
+#define LF_MPOL_MF_MOVE     (1 << 1)
+
+// Nodes are numbered below this, so that a node mask fits in an unsigned long
+#define LF_MAX_NUMA_NODES   64
+
+/** A NUMA node: its number and its CPUs */
+struct LFNUMANode
+{
+  int id;
+  std::vector<int> cpus;
+};
+
+/** Parse a sysfs CPU list, such as "0-7,16-23" */
+inline std::vector<int> LFParseCPUList(const std::string &text)
+{
+  std::vector<int> cpus;
+  std::istringstream iss(text);
+  std::string range;
+  while(std::getline(iss, range, ','))
+    {
+    int first, last;
+    int nRead = sscanf(range.c_str(), "%d-%d", &first, &last);
+    if(nRead == 1)
+      last = first;
+    else if(nRead != 2)
+      continue;
+    for(int c = first; c <= last; c++)
+      cpus.push_back(c);
+    }
+  return cpus;
+}
+
+/**
+ * The NUMA nodes that have CPUs in the affinity mask of the process, with only
+ * those CPUs, so that pinning never leaves the CPUs given to the job. Empty if
+ * the topology can not be read
+ */
+inline std::vector<LFNUMANode> LFGetNUMANodes()
+{
+  std::vector<LFNUMANode> nodes;
+#ifdef __linux__
+  cpu_set_t allowed;
+  if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    return nodes;
+
+  for(int id = 0; id < LF_MAX_NUMA_NODES; id++)
+    {
+    char fn[256];
+    sprintf(fn, "/sys/devices/system/node/node%d/cpulist", id);
+    std::ifstream fin(fn);
+    std::string text;
+    if(!fin.good() || !std::getline(fin, text))
+      continue;
+
+    LFNUMANode node;
+    node.id = id;
+    std::vector<int> cpus = LFParseCPUList(text);
+    for(size_t k = 0; k < cpus.size(); k++)
+      if(cpus[k] < CPU_SETSIZE && CPU_ISSET(cpus[k], &allowed))
+        node.cpus.push_back(cpus[k]);
+    if(node.cpus.size())
+      nodes.push_back(node);
+    }
+#endif
+  return nodes;
+}
+
+/**
+ * Set the memory policy of the pages holding a buffer, moving the pages that are
+ * already in memory. The start is rounded down to a page, so neighboring buffers
+ * may share a page. Returns false if the policy could not be set.
+ */
+inline bool LFSetMemoryPolicy(const void *buffer, size_t bytes, int mode, unsigned long nodemask)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+  if(bytes == 0)
+    return true;
+
+  unsigned long page = sysconf(_SC_PAGESIZE);
+  unsigned long start = ((unsigned long) buffer) & ~(page - 1);
+  unsigned long end = ((unsigned long) buffer) + bytes;
+  return syscall(SYS_mbind, start, end - start, mode, &nodemask,
+                 8 * sizeof(unsigned long) + 1, LF_MPOL_MF_MOVE) == 0;
+#else
+  return false;
+#endif
+}
+
+/**
+ * Pins the calling thread to a set of CPUs while the object exists, and restores
+ * the previous affinity when it is destroyed. Does nothing for an empty CPU list.
+ */
+class LFThreadPin
+{
+public:
+  LFThreadPin(const std::vector<int> &cpus) : m_Pinned(false)
+    {
+#ifdef __linux__
+    if(cpus.empty() || sched_getaffinity(0, sizeof(m_Saved), &m_Saved) != 0)
+      return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(size_t k = 0; k < cpus.size(); k++)
+      if(cpus[k] < CPU_SETSIZE)
+        CPU_SET(cpus[k], &set);
+    m_Pinned = (sched_setaffinity(0, sizeof(set), &set) == 0);
+#endif
+    }
+
+  ~LFThreadPin()
+    {
+#ifdef __linux__
+    if(m_Pinned)
+      sched_setaffinity(0, sizeof(m_Saved), &m_Saved);
+#endif
+    }
+
+  bool IsPinned() const
+    { return m_Pinned; }
+
+private:
+#ifdef __linux__
+  cpu_set_t m_Saved;
+#endif
+  bool m_Pinned;
+};
+
+#endif
@@ -0,0 +1,314 @@
+/*===================================================================
+
+  Program:   ASHS (Automatic Segmentation of Hippocampal Subfields)
+  Module:    $Id$
+  Language:  C++ program
+  Copyright (c) 2012 Paul A. Yushkevich, University of Pennsylvania
+
+  This file is part of ASHS
+
+  ASHS is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+  =================================================================== */
+
+#ifndef __LabelFusionProfile_h_
+#define __LabelFusionProfile_h_
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <iomanip>
+
+/** Wall clock time in seconds */
+inline double LFWallTime()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6 * tv.tv_usec;
+}
+
+/** CPU time in seconds used by the calling thread */
+inline double LFThreadCPUTime()
+{
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+#else
+  return clock() * 1.0 / CLOCKS_PER_SEC;
+#endif
+}
+
+/** CPU time in seconds used by the whole process (user + system) */
+inline double LFProcessCPUTime()
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + 1.0e-6 * ru.ru_utime.tv_usec
+    + ru.ru_stime.tv_sec + 1.0e-6 * ru.ru_stime.tv_usec;
+}
+
+/** Peak resident set size of the process in megabytes */
+inline double LFPeakRSSMegabytes()
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  return ru.ru_maxrss / (1024.0 * 1024.0);
+#else
+  return ru.ru_maxrss / 1024.0;
+#endif
+}
+
+/**
+ * A lap timer for the per-voxel phases in the threaded code. Each call to Lap()
+ * adds the wall and thread CPU time elapsed since the previous lap to the given
+ * accumulators. When disabled, it does nothing, so it can stay in the inner loop.
+ */
+class LFPhaseClock
+{
+public:
+  LFPhaseClock(bool enabled) : m_Enabled(enabled)
+    {
+    if(m_Enabled)
+      {
+      m_Wall = LFWallTime();
+      m_CPU = LFThreadCPUTime();
+      }
+    }
+
+  void Lap(double &wall, double &cpu)
+    {
+    if(m_Enabled)
+      {
+      double w = LFWallTime(), c = LFThreadCPUTime();
+      wall += w - m_Wall; cpu += c - m_CPU;
+      m_Wall = w; m_CPU = c;
+      }
+    }
+
+  void Skip()
+    {
+    if(m_Enabled)
+      {
+      m_Wall = LFWallTime();
+      m_CPU = LFThreadCPUTime();
+      }
+    }
+
+private:
+  bool m_Enabled;
+  double m_Wall, m_CPU;
+};
+
+/**
+ * Profiling report for label fusion. The driver and the filter record the time
+ * spent in each phase along with a few counters, and the whole thing is written
+ * out as JSON. For phases that run inside the worker threads, the times are summed
+ * over the threads (i.e., they are thread-seconds, not elapsed seconds).
+ */
+class LabelFusionProfile
+{
+public:
+
+  struct Phase
+    {
+    std::string name;
+    double wall, cpu;
+    bool threaded;
+    };
+
+  typedef std::pair<std::string, double> Counter;
+  typedef std::pair<std::string, std::string> Info;
+
+  LabelFusionProfile()
+    {
+    m_StartWall = LFWallTime();
+    m_StartCPU = LFProcessCPUTime();
+    m_PhaseWall = m_PhaseCPU = 0.0;
+    }
+
+  /** Begin timing a process-level phase (not threaded) */
+  void StartPhase(const char *name)
+    {
+    m_PhaseName = name;
+    m_PhaseWall = LFWallTime();
+    m_PhaseCPU = LFProcessCPUTime();
+    }
+
+  /** End timing the current process-level phase */
+  void EndPhase()
+    {
+    AddPhase(m_PhaseName.c_str(),
+             LFWallTime() - m_PhaseWall, LFProcessCPUTime() - m_PhaseCPU, false);
+    }
+
+  /** Add time to a phase; repeated calls with the same name accumulate */
+  void AddPhase(const char *name, double wall, double cpu, bool threaded)
+    {
+    for(size_t i = 0; i < m_Phases.size(); i++)
+      {
+      if(m_Phases[i].name == name)
+        {
+        m_Phases[i].wall += wall;
+        m_Phases[i].cpu += cpu;
+        return;
+        }
+      }
+    Phase ph;
+    ph.name = name; ph.wall = wall; ph.cpu = cpu; ph.threaded = threaded;
+    m_Phases.push_back(ph);
+    }
+
+  /** Set a named counter, replacing a previous value */
+  void SetCounter(const char *name, double value)
+    {
+    for(size_t i = 0; i < m_Counters.size(); i++)
+      {
+      if(m_Counters[i].first == name)
+        {
+        m_Counters[i].second = value;
+        return;
+        }
+      }
+    m_Counters.push_back(Counter(name, value));
+    }
+
+  /** Add to a named counter */
+  void AddCounter(const char *name, double value)
+    {
+    for(size_t i = 0; i < m_Counters.size(); i++)
+      {
+      if(m_Counters[i].first == name)
+        {
+        m_Counters[i].second += value;
+        return;
+        }
+      }
+    m_Counters.push_back(Counter(name, value));
+    }
+
+  /** Set a named descriptive string */
+  void SetInfo(const char *name, const std::string &value)
+    {
+    for(size_t i = 0; i < m_Info.size(); i++)
+      {
+      if(m_Info[i].first == name)
+        {
+        m_Info[i].second = value;
+        return;
+        }
+      }
+    m_Info.push_back(Info(name, value));
+    }
+
+  /** Get the phases recorded so far */
+  const std::vector<Phase> &GetPhases() const { return m_Phases; }
+
+  /** Get the value of a counter, or zero if it has not been set */
+  double GetCounter(const char *name) const
+    {
+    for(size_t i = 0; i < m_Counters.size(); i++)
+      if(m_Counters[i].first == name)
+        return m_Counters[i].second;
+    return 0.0;
+    }
+
+  /** Per-thread statistics, indexed by thread id */
+  std::vector<double> &GetThreadVoxels() { return m_ThreadVoxels; }
+  std::vector<double> &GetThreadWallTime() { return m_ThreadWall; }
+
+  /** Histogram of the Manhattan distance of best matches, merged over threads */
+  std::vector<double> &GetSearchHistogram() { return m_SearchHisto; }
+
+  /** Write the report as JSON */
+  void WriteJSON(std::ostream &os) const
+    {
+    os << std::setprecision(8);
+    os << "{" << std::endl;
+
+    os << "  \"info\": {";
+    for(size_t i = 0; i < m_Info.size(); i++)
+      os << (i ? ", " : "") << std::endl << "    \"" << m_Info[i].first << "\": \""
+         << Escape(m_Info[i].second) << "\"";
+    os << std::endl << "  }," << std::endl;
+
+    os << "  \"phases\": [";
+    for(size_t i = 0; i < m_Phases.size(); i++)
+      {
+      os << (i ? ", " : "") << std::endl << "    { \"name\": \"" << m_Phases[i].name << "\""
+         << ", \"wall\": " << m_Phases[i].wall << ", \"cpu\": " << m_Phases[i].cpu
+         << ", \"thread_summed\": " << (m_Phases[i].threaded ? "true" : "false") << " }";
+      }
+    os << std::endl << "  ]," << std::endl;
+
+    os << "  \"counters\": {";
+    for(size_t i = 0; i < m_Counters.size(); i++)
+      os << (i ? ", " : "") << std::endl << "    \"" << m_Counters[i].first << "\": "
+         << m_Counters[i].second;
+    os << std::endl << "  }," << std::endl;
+
+    os << "  \"thread_voxels\": ";
+    WriteArray(os, m_ThreadVoxels);
+    os << "," << std::endl;
+
+    os << "  \"thread_wall\": ";
+    WriteArray(os, m_ThreadWall);
+    os << "," << std::endl;
+
+    os << "  \"search_histogram\": ";
+    WriteArray(os, m_SearchHisto);
+    os << "," << std::endl;
+
+    os << "  \"total_wall\": " << LFWallTime() - m_StartWall << "," << std::endl;
+    os << "  \"total_cpu\": " << LFProcessCPUTime() - m_StartCPU << "," << std::endl;
+    os << "  \"peak_rss_mb\": " << LFPeakRSSMegabytes() << std::endl;
+    os << "}" << std::endl;
+    }
+
+private:
+
+  static void WriteArray(std::ostream &os, const std::vector<double> &a)
+    {
+    os << "[";
+    for(size_t i = 0; i < a.size(); i++)
+      os << (i ? ", " : "") << a[i];
+    os << "]";
+    }
+
+  static std::string Escape(const std::string &s)
+    {
+    std::string r;
+    for(size_t i = 0; i < s.size(); i++)
+      {
+      if(s[i] == '"' || s[i] == '\\')
+        r += '\\';
+      r += s[i];
+      }
+    return r;
+    }
+
+  std::vector<Phase> m_Phases;
+  std::vector<Counter> m_Counters;
+  std::vector<Info> m_Info;
+  std::vector<double> m_ThreadVoxels, m_ThreadWall, m_SearchHisto;
+
+  std::string m_PhaseName;
+  double m_PhaseWall, m_PhaseCPU;
+  double m_StartWall, m_StartCPU;
+};
+
+#endif
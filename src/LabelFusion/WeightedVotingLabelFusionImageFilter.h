@@ -38,6 +38,12 @@
 
 #include "itkImageToImageFilter.h"
 #include "itkConstNeighborhoodIterator.h"
+#include "itkProgressReporter.h"
+#include <vnl/vnl_matrix.h>
+#include <vnl/vnl_vector.h>
+#include "LabelFusionProfile.h"
+#include "LabelFusionNUMA.h"
+#include "ASHSHeartbeat.h"
 
 template <class TInputImage, class TOutputImage>
 class WeightedVotingLabelFusionImageFilter : public itk::ImageToImageFilter <TInputImage, TOutputImage>
@@ -67,6 +73,7 @@ public:
   typedef typename InputImageType::RegionType     RegionType;
   typedef typename InputImageType::SizeType       SizeType;
   typedef typename InputImageType::IndexType      IndexType;
+  typedef typename InputImageType::OffsetValueType OffsetValueType;
 
   /** ImageDimension constants */
   itkStaticConstMacro(InputImageDimension, unsigned int,
@@ -113,6 +120,20 @@ public:
   itkSetMacro(PatchRadius, SizeType);
   itkGetMacro(PatchRadius, SizeType);
 
+  /**
+   * Optional ellipsoidal patch and search neighborhoods. The semi-axes are given
+   * in physical units and converted to voxels with the target image spacing. Only
+   * the offsets within both the ellipsoid and the box given by PatchRadius or 
+   * SearchRadius are used. Zero semi-axes (the default) give the full box.
+   */
+  typedef itk::Vector<double, InputImageDimension> PhysicalRadiusType;
+
+  itkSetMacro(PatchRadiusPhysical, PhysicalRadiusType);
+  itkGetMacro(PatchRadiusPhysical, PhysicalRadiusType);
+
+  itkSetMacro(SearchRadiusPhysical, PhysicalRadiusType);
+  itkGetMacro(SearchRadiusPhysical, PhysicalRadiusType);
+
   itkSetMacro(Alpha, double);
   itkGetMacro(Alpha, double);
 
@@ -131,6 +152,15 @@ public:
   itkSetMacro(RetainPosteriorMaps, bool)
   itkGetMacro(RetainPosteriorMaps, bool)
 
+  /**
+   * Whether the retained posterior maps are normalized by the total weight of the
+   * votes at each voxel (the default). When off, the posterior maps hold the sums of
+   * the votes, which, together with the counter map, can be added up over the 
+   * partial results of several runs.
+   */
+  itkSetMacro(NormalizePosteriorMaps, bool)
+  itkGetMacro(NormalizePosteriorMaps, bool)
+
   /**
    * Whether per-atlas weight maps should be generated. This really only makes sense
    * when the search radius is zero, because the weight corresponds to the atlas 
@@ -140,6 +170,162 @@ public:
   itkSetMacro(GenerateWeightMaps, bool)
   itkGetMacro(GenerateWeightMaps, bool)
 
+  /**
+   * Stride for weight estimation. When greater than one (in any dimension), the
+   * search and weight solve are only performed on a lattice of voxels with this
+   * spacing, and the voting over each voxel's patch fills in the voxels in between.
+   * Masked voxels that receive no votes this way fall back to full estimation.
+   */
+  itkSetMacro(WeightStride, SizeType);
+  itkGetMacro(WeightStride, SizeType);
+
+  /**
+   * Whether to solve for the weights of several voxels at once. The error matrices
+   * of SolveBatchSize voxels are gathered and factored together, one voxel per SIMD
+   * lane. Voxels whose matrices can not be shown to be well conditioned are passed
+   * on to the regular solver, so each voxel is solved by the same method as without
+   * batching. The batched Cholesky runs in a different order from LINPACK's dpofa,
+   * so the weights are the same up to round-off, and ties in the vote may flip.
+   */
+  itkSetMacro(BatchedSolve, bool);
+  itkGetMacro(BatchedSolve, bool);
+
+  /**
+   * What to do when Mx is too badly conditioned for Cholesky. FALLBACK_SVD solves
+   * with the SVD. FALLBACK_RIDGE first retries Cholesky up to RidgeRetries times,
+   * increasing alpha tenfold each time, and only uses the SVD if that fails.
+   */
+  enum SolveFallback { FALLBACK_SVD = 0, FALLBACK_RIDGE };
+
+  itkSetEnumMacro(SolveFallback, SolveFallback);
+  itkGetEnumMacro(SolveFallback, SolveFallback);
+
+  itkSetMacro(RidgeRetries, int);
+  itkGetMacro(RidgeRetries, int);
+
+  /**
+   * Cascade voting. When positive, majority voting is done first at each voxel in
+   * the mask, and joint fusion only runs where the margin between the top two labels
+   * (as a fraction of the number of atlases) is below this value. Zero (the default)
+   * runs joint fusion everywhere in the mask.
+   */
+  itkSetMacro(CascadeMargin, double);
+  itkGetMacro(CascadeMargin, double);
+
+  /**
+   * Automatic search radius. When positive, a pilot search on a sample of the voxels
+   * in the mask finds, for each atlas, the smallest search radius (in Manhattan 
+   * distance, within SearchRadius) that contains this fraction of the best matches,
+   * e.g. 0.99. Each atlas is then only searched within its own radius.
+   */
+  itkSetMacro(AutoSearchFraction, double);
+  itkGetMacro(AutoSearchFraction, double);
+
+  /** Number of voxels sampled by the pilot search for the automatic search radius */
+  itkSetMacro(AutoSearchSamples, int);
+  itkGetMacro(AutoSearchSamples, int);
+
+  /**
+   * Approximate search modelled on PatchMatch. Instead of testing every offset in
+   * the search neighborhood, the search in each atlas starts from the best offsets
+   * of the neighboring voxels already searched (propagation) and then tests random
+   * offsets in windows of halving size around the best one so far. This makes large
+   * search radii affordable, at the cost of one int per atlas per voxel of the region.
+   */
+  itkSetMacro(PatchMatch, bool);
+  itkGetMacro(PatchMatch, bool);
+
+  /** 
+   * Fraction of the voxels where the PatchMatch search is checked against the
+   * exhaustive search. The fraction of best matches that differ is reported. Each
+   * check costs a full exhaustive search, so this is off (zero) by default.
+   */
+  itkSetMacro(PatchMatchCheckFraction, double);
+  itkGetMacro(PatchMatchCheckFraction, double);
+
+  /**
+   * Reduced patch descriptors for the search. When positive, a PCA basis with this
+   * many components is learned from the normalized target patches in the mask, and
+   * the patches of the atlases are projected onto it before the search. The search
+   * then ranks all candidates by their similarity in the reduced space, at a cost of
+   * a handful of multiply-adds per candidate, and only re-scores the best 
+   * DescriptorCandidates of them exactly. This needs DescriptorComponents + 1 floats
+   * per atlas voxel.
+   */
+  itkSetMacro(DescriptorComponents, int);
+  itkGetMacro(DescriptorComponents, int);
+
+  itkSetMacro(DescriptorCandidates, int);
+  itkGetMacro(DescriptorCandidates, int);
+
+  /** Largest number of candidates re-scored exactly in the descriptor search */
+  enum { MaxDescriptorCandidates = 32 };
+
+  /**
+   * Size of the tiles for tiled traversal. When set (all components positive), each
+   * thread visits its region one tile at a time and searches the atlases one at a
+   * time over the whole tile, which keeps the atlas data around the tile in cache.
+   * The results are the same as with the default voxel-by-voxel traversal up to
+   * round-off in the vote sums, which are accumulated in a different order.
+   */
+  itkSetMacro(TileSize, SizeType);
+  itkGetMacro(TileSize, SizeType);
+
+  /**
+   * Region where the weights are estimated. When set, only the voxels of the mask 
+   * inside this region are estimated, but their votes are still collected over the
+   * whole output requested region. This allows label fusion to be split into slabs
+   * whose vote sums are added up afterwards. By default (empty region), the weights
+   * are estimated over the whole requested region.
+   */
+  itkSetMacro(EstimationRegion, RegionType);
+  itkGetMacro(EstimationRegion, RegionType);
+
+  /**
+   * Checkpointing. When a checkpoint file is set, the region is processed one slab
+   * at a time (a layer of tiles along the last dimension, or a slice without tiles),
+   * and the vote sums and the list of finished slabs are saved to the file whenever
+   * CheckpointInterval seconds have passed since the last save. With Resume on, a
+   * checkpoint file left by an earlier run with the same inputs, region and parameters
+   * is loaded and the finished slabs are skipped. The file is removed once all slabs are done.
+   */
+  itkSetMacro(CheckpointFile, std::string);
+  itkGetMacro(CheckpointFile, std::string);
+
+  itkSetMacro(CheckpointInterval, double);
+  itkGetMacro(CheckpointInterval, double);
+
+  itkSetMacro(Resume, bool);
+  itkGetMacro(Resume, bool);
+
+  /**
+   * NUMA placement. On a machine with several NUMA nodes, the threads are assigned
+   * to the nodes in order of their slabs of the output region and pinned to the
+   * CPUs of their node. The target, atlas, vote and counter buffers are interleaved
+   * over the nodes, and the part of each that a thread reads and writes for its
+   * slab is moved to the thread's node. Does nothing on a single node. With a
+   * checkpoint file, the threads work on pieces of one slab of the region at a time,
+   * which do not match the slabs of the nodes, so the buffers are only interleaved
+   * and the threads are not pinned.
+   */
+  itkSetMacro(NUMAPlacement, bool);
+  itkGetMacro(NUMAPlacement, bool);
+
+  /**
+   * Set an optional profiling report. When set, the filter times each phase of
+   * the computation (mask, offset tables, search, Mx, solve, vote) and records
+   * per-thread voxel counts, SVD fallbacks and the search distance histogram.
+   */
+  void SetProfile(LabelFusionProfile *profile)
+    { m_Profile = profile; }
+
+  /**
+   * Set an optional progress heartbeat. The filter reports its setup, the voxels
+   * fused out of those where the weights are estimated, and the final voting.
+   */
+  void SetHeartbeat(ASHSHeartbeat *heartbeat)
+    { m_Heartbeat = heartbeat; }
+
   typedef itk::Image<float, InputImageDimension> PosteriorImage;
   typedef typename PosteriorImage::Pointer PosteriorImagePtr;
   typedef typename std::map<InputImagePixelType, PosteriorImagePtr> PosteriorMap;
@@ -149,7 +335,9 @@ public:
   typedef typename std::vector<WeightMapImagePtr> WeightMapArray;
                                                                     
   /**
-   * Get the posterior maps (if they have been retained)
+   * Get the posterior maps (if they have been retained). During the run, the votes
+   * are kept in one buffer with the labels of each voxel next to each other, which
+   * is split into these maps at the end.
    */
   const PosteriorMap &GetPosteriorMaps()
     { return m_PosteriorMap; }
@@ -160,12 +348,147 @@ public:
   WeightMapImage* GetWeightMap(int iAtlas) const
     { return m_WeightMapArray[iAtlas]; }
 
+  /**
+   * Get the total weight of the votes received by each voxel
+   */
+  PosteriorImage* GetCounterMap() const
+    { return m_CounterMap; }
 
+  /**
+   * Whether the label of a voxel was decided by the final vote. The other voxels
+   * keep the label assigned before voting (e.g., by the automatic mask or the 
+   * cascade). All voxels are voted on if there was no mask.
+   */
+  bool IsInVotingMask(const IndexType &idx)
+    { return InMask(this->GetOutput()->ComputeOffset(idx)); }
 
+  /**
+   * Parameter sweep. Each added (alpha, beta) pair gets its own segmentation,
+   * posterior maps and counter, next to those for Alpha and Beta. The search and
+   * the patch differences are shared by all the pairs, and only Mx, the weights and
+   * the votes are computed for each pair, so that a sweep costs little more than a
+   * single run. Weight maps are only computed for Alpha and Beta.
+   */
+  void AddSweepParameters(double alpha, double beta)
+    {
+    SweepSet set;
+    set.alpha = alpha;
+    set.beta = beta;
+    m_Sweep.push_back(set);
+    this->Modified();
+    }
+
+  void ClearSweepParameters()
+    { 
+    m_Sweep.clear(); 
+    this->Modified(); 
+    }
+
+  size_t GetNumberOfSweepParameters() const
+    { return m_Sweep.size(); }
+
+  /** The segmentation, posterior maps and counter of the s-th added pair */
+  TOutputImage* GetSweepOutput(size_t s) const
+    { return m_Sweep[s].output; }
+
+  const PosteriorMap &GetSweepPosteriorMaps(size_t s) const
+    { return m_Sweep[s].posterior; }
+
+  PosteriorImage* GetSweepCounterMap(size_t s) const
+    { return m_Sweep[s].counter; }
+
+
+
+  void GenerateData();
   void BeforeThreadedGenerateData();
   void ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread, itk::ThreadIdType threadId);
   void AfterThreadedGenerateData();
 
+  /** 
+   * The per-voxel computational kernels. These do not depend on the state of the
+   * filter and are exposed so that they can be benchmarked in isolation.
+   */
+  typedef vnl_matrix<double> MatrixType;
+  typedef vnl_vector<double> VectorType;
+
+  static double PatchSimilarity(
+    const InputImagePixelType *psearch, const InputImagePixelType *pnormtrg, 
+    size_t n, const int *offsets, InputImagePixelType &psearchSum, InputImagePixelType &psearchSSQ);
+
+  static void PatchStats(const InputImagePixelType *p, size_t n, const int *offsets, 
+                         InputImagePixelType &mean, InputImagePixelType &sd);
+
+  static void ComputePatchDifference(
+    const InputImagePixelType *pmatch, InputImagePixelType pmatchSum, InputImagePixelType pmatchSSQ,
+    const InputImagePixelType *pnormtrg, size_t n, const int *offsets, float *apd);
+
+  /**
+   * Versions of the above with the patch size n fixed at compile time to VN, so that
+   * the loops can be fully unrolled. VN = 0 uses the run-time value of n.
+   */
+  template <unsigned int VN>
+  static double PatchSimilarityN(
+    const InputImagePixelType *psearch, const InputImagePixelType *pnormtrg, 
+    size_t n, const int *offsets, InputImagePixelType &psearchSum, InputImagePixelType &psearchSSQ);
+
+  template <unsigned int VN>
+  static void ComputePatchDifferenceN(
+    const InputImagePixelType *pmatch, InputImagePixelType pmatchSum, InputImagePixelType pmatchSSQ,
+    const InputImagePixelType *pnormtrg, size_t n, const int *offsets, float *apd);
+
+  /** 
+   * Allocate the absolute patch difference arrays for n atlases in the layout 
+   * expected by ComputeErrorMatrix. Release them with FreePatchDifferences.
+   */
+  static float **AllocatePatchDifferences(int n, size_t nPatch);
+  static void FreePatchDifferences(float **apd);
+
+  static void ComputeErrorMatrix(
+    float * const *apd, int n, size_t nPatch, double alpha, double beta, MatrixType &Mx);
+
+  /** How the weights at a voxel were solved for */
+  enum SolveMethod { SOLVE_CHOLESKY = 0, SOLVE_RIDGE, SOLVE_SVD };
+
+  static SolveMethod SolveWeights(
+    const MatrixType &Mx, const VectorType &ones, VectorType &W,
+    SolveFallback fallback = FALLBACK_SVD, double alpha = 0.0, int retries = 0);
+
+  /**
+   * Solve for the weights of up to SolveBatchSize voxels at once. The matrices must
+   * be computed by ComputeErrorMatrix with the given alpha and beta. On return,
+   * solved[l] tells whether W[l] was computed; the remaining voxels need SolveWeights.
+   * Returns the number of voxels that were solved.
+   */
+  enum { SolveBatchSize = 8 };
+
+  static int SolveWeightsBatched(
+    const MatrixType *Mx, int count, double alpha, double beta, VectorType *W, bool *solved);
+
+  /**
+   * List the offsets of a neighborhood in neighborhood iterator order. This is the
+   * box of the given radius, or its intersection with an ellipsoid if the physical
+   * radius is nonzero.
+   */
+  typedef itk::Offset<InputImageDimension> OffsetType;
+  typedef std::vector<OffsetType> OffsetList;
+
+  static void ComputeNeighborhood(
+    const SizeType &radius, const typename InputImageType::SpacingType &spacing,
+    const PhysicalRadiusType &radiusPhysical, OffsetList &offsets);
+
+  /**
+   * Compute the table of buffer offsets for a neighborhood in an image, given as a
+   * list of offsets or as the radius of a box. Optionally, also compute the 
+   * Manhattan distance of each offset from the center.
+   */
+  static void ComputeOffsetTable(
+    const InputImageType *image, const OffsetList &hood,
+    int **offset, size_t &nPatch, int **manhattan = NULL);
+
+  static void ComputeOffsetTable(
+    const InputImageType *image, const SizeType &radius, 
+    int **offset, size_t &nPatch, int **manhattan = NULL);
+
  
 protected:
 
@@ -174,7 +497,38 @@ protected:
     m_Alpha=0.01; 
     m_Beta=2; 
     m_RetainPosteriorMaps = false;
+    m_NormalizePosteriorMaps = true;
     m_GenerateWeightMaps = false;
+    m_Profile = NULL;
+    m_Heartbeat = NULL;
+    m_WeightStride.Fill(1);
+    m_PatchRadiusPhysical.Fill(0.0);
+    m_SearchRadiusPhysical.Fill(0.0);
+    m_UseWeightStride = false;
+    m_BatchedSolve = false;
+    m_TileSize.Fill(0);
+    m_CascadeMargin = 0.0;
+    m_AutoSearchFraction = 0.0;
+    m_AutoSearchSamples = 1000;
+    m_PatchMatch = false;
+    m_PatchMatchCheckFraction = 0.0;
+    m_PatchMatchStride = 0;
+    m_DescriptorComponents = 0;
+    m_DescriptorCandidates = 4;
+    m_TargetPatchLength = 0;
+    m_UseMaskBits = false;
+    m_LabelStride = 0;
+    m_ExclusionWords = 0;
+    m_UseTiles = false;
+    m_SolveFallback = FALLBACK_SVD;
+    m_RidgeRetries = 4;
+    m_CheckpointInterval = 600.0;
+    m_Resume = false;
+    m_NUMAPlacement = false;
+    m_NUMASlabs = 0;
+    m_NUMAInterleaveOnly = false;
+    m_ChunkProgressStart = 0.0f;
+    m_ChunkProgressWeight = 1.0f;
     }
   ~WeightedVotingLabelFusionImageFilter() {}
 
@@ -183,22 +537,15 @@ private:
   typedef itk::Neighborhood<InputImagePixelType, InputImageDimension> HoodType;
   typedef itk::ConstNeighborhoodIterator<InputImageType> NIter;
 
-  double PatchSimilarity(
-    const InputImagePixelType *psearch, const InputImagePixelType *pnormtrg, 
-    size_t n, const int *offsets, InputImagePixelType &psearchSum, InputImagePixelType &psearchSSQ);
-
-  void ComputeOffsetTable(
-    const InputImageType *image, const SizeType &radius, 
-    int **offset, size_t &nPatch, int **manhattan = NULL);
-
   void UpdateInputs();
 
-  void PatchStats(const InputImagePixelType *p, size_t n, const int *offsets, 
-                  InputImagePixelType &mean, InputImagePixelType &sd);
-
   double JointErrorEstimate(const InputImagePixelType *t, const InputImagePixelType *a1, const InputImagePixelType *a2, size_t n, int *offsets);
 
   SizeType m_SearchRadius, m_PatchRadius;
+  PhysicalRadiusType m_SearchRadiusPhysical, m_PatchRadiusPhysical;
+
+  // The patch and search neighborhoods
+  OffsetList m_PatchOffsets, m_SearchOffsets;
 
   double m_Alpha, m_Beta;
 
@@ -208,8 +555,14 @@ private:
   // Posterior maps
   PosteriorMap m_PosteriorMap;
 
-  // Whether they are retained
-  bool m_RetainPosteriorMaps;
+  // Votes for each label, indexed by voxel offset * m_LabelStride + label index.
+  // The stride pads the labels to a multiple of 4 for the SIMD argmax
+  typedef std::vector<float> VoteTensor;
+  VoteTensor m_Votes;
+  size_t m_LabelStride;
+
+  // Whether they are retained, and whether they are normalized
+  bool m_RetainPosteriorMaps, m_NormalizePosteriorMaps;
 
   // Whether weight maps are computed
   bool m_GenerateWeightMaps;
@@ -232,23 +585,353 @@ private:
   // Mask - may be maskimage or may be internal
   InputImagePointer m_Mask;
 
+  // Make the mask internal, so that it can be modified
+  void MakeMaskInternal();
+
+  // Once it is final, the mask is packed into one bit per voxel of the output region,
+  // indexed by the offset of the voxel in the output, and the mask image is released.
+  // The exclusions are packed into a bitset over the label index (the position of the
+  // label in m_LabelList) for each voxel, so voting needs no exclusion image lookups
+  std::vector<InputImagePixelType> m_LabelList;
+  std::vector<unsigned int> m_MaskBits, m_ExclusionBits;
+  bool m_UseMaskBits;
+  unsigned int m_ExclusionWords;
+
+  void CompileMask();
+  void CompileExclusions();
+  int GetLabelIndex(InputImagePixelType label) const;
+
+  // Number the labels, with a lookup table for the index of small integer labels
+  std::vector<int> m_LabelLUT;
+  void IndexLabels();
+
+  int LookupLabelIndex(InputImagePixelType label) const
+    { return m_LabelLUT.size() ? m_LabelLUT[(int) label] : GetLabelIndex(label); }
+
+  bool InMask(OffsetValueType off) const
+    { return !m_UseMaskBits || ((m_MaskBits[off >> 5] >> (off & 31)) & 1); }
+
+  bool IsExcluded(OffsetValueType off, int k) const
+    { return m_ExclusionWords && ((m_ExclusionBits[off * m_ExclusionWords + (k >> 5)] >> (k & 31)) & 1); }
+
+  // Optional region where the weights are estimated
+  RegionType m_EstimationRegion;
+
   // Neighborhood sizes
   size_t m_NPatch, m_NSearch;
 
+  // Size of the search for each atlas, which may be less than m_NSearch
+  std::vector<size_t> m_NSearchAtlas;
+
   // Set of labels
   std::set<InputImagePixelType> m_LabelSet;
 
   // Counter map
   PosteriorImagePtr m_CounterMap;
 
+  // Optional profiling report
+  LabelFusionProfile *m_Profile;
+
+  // Optional progress heartbeat
+  ASHSHeartbeat *m_Heartbeat;
+
+  // Phases of the per-voxel computation timed in each thread
+  enum ThreadPhase { PHASE_SEARCH = 0, PHASE_MX, PHASE_SOLVE, PHASE_VOTE, NUM_THREAD_PHASES };
+
   // Thread-specific data
   struct ThreadData
     {
     std::vector<int> m_SearchHisto;
+
+    // Number of voxels processed and number of solves that took the fallback paths
+    unsigned long m_VoxelCount, m_SVDCount, m_RidgeCount;
+
+    // Number of voxels solved by the batched solver and passed on from it
+    unsigned long m_BatchSolveCount, m_BatchFallbackCount;
+
+    // Number of patches tested by the PatchMatch search, and the number of its best
+    // matches checked against the exhaustive search and found to differ
+    unsigned long m_PatchMatchTests, m_PatchMatchChecked, m_PatchMatchDiffer;
+
+    // Time spent in each phase and overall
+    double m_PhaseWall[NUM_THREAD_PHASES], m_PhaseCPU[NUM_THREAD_PHASES];
+    double m_TotalWall;
+
+    // NUMA node the thread was pinned to, or -1
+    int m_NUMANode;
+
+    // Region processed by the thread. The PatchMatch search only propagates from
+    // neighbors in this region, which no other thread writes
+    RegionType m_Region;
+
+    ThreadData() : m_VoxelCount(0), m_SVDCount(0), m_RidgeCount(0), 
+      m_BatchSolveCount(0), m_BatchFallbackCount(0), 
+      m_PatchMatchTests(0), m_PatchMatchChecked(0), m_PatchMatchDiffer(0), m_TotalWall(0.0),
+      m_NUMANode(-1)
+      {
+      for(int i = 0; i < NUM_THREAD_PHASES; i++)
+        m_PhaseWall[i] = m_PhaseCPU[i] = 0.0;
+      }
     };
 
   std::vector<ThreadData> m_ThreadData;
 
+  // Scratch space for estimating the weights at a voxel, allocated once per thread.
+  // It is released in the destructor, so that it is not leaked if the filter aborts
+  struct VoxelWorkspace
+    {
+    MatrixType Mx;
+    VectorType ones, W;
+    InputImagePixelType **apd;
+    const InputImagePixelType **patchSeg;
+    InputImagePixelType *xNormTargetPatch;
+
+    VoxelWorkspace() : apd(NULL), patchSeg(NULL), xNormTargetPatch(NULL) {}
+    ~VoxelWorkspace()
+      {
+      FreePatchDifferences(apd);
+      delete[] patchSeg;
+      delete[] xNormTargetPatch;
+      }
+    };
+
+  void AllocateWorkspace(VoxelWorkspace &ws);
+
+  // Search, solve for the weights at a voxel and vote over its patch
+  void EstimateAndVote(const IndexType &idx, 
+                       VoxelWorkspace &ws, ThreadData &td, LFPhaseClock &clkPhase);
+
+  // Search for the best matching patches and compute ws.Mx and ws.patchSeg
+  void EstimateErrorMatrix(const IndexType &idx, 
+                           VoxelWorkspace &ws, ThreadData &td, LFPhaseClock &clkPhase);
+
+  // Whether the weights are estimated at a voxel (inside the mask and the lattice)
+  bool IsEstimated(const IndexType &idx);
+
+  // Number of voxels in a region where the weights are estimated
+  unsigned long CountEstimated(const RegionType &region);
+
+  // Normalize the target patch at a voxel to zero mean and unit variance
+  void NormalizeTargetPatch(const IndexType &idx, InputImagePixelType *xNormTargetPatch);
+
+  // Find the best match to the normalized target patch in atlas i, computing its apd
+  // row and a pointer to the corresponding segmentation patch
+  void SearchAtlas(int i, const IndexType &idx, const InputImagePixelType *xNormTargetPatch,
+                   float *apd, const InputImagePixelType *&patchSeg, ThreadData &td);
+
+  // The search for a patch size fixed at compile time (or not, for VN = 0)
+  template <unsigned int VN>
+  void SearchAtlasN(int i, const IndexType &idx, const InputImagePixelType *xNormTargetPatch,
+                    float *apd, const InputImagePixelType *&patchSeg, ThreadData &td);
+
+  // The best match found so far in a search, with the sum and sum of squares of the
+  // intensities in the matching patch
+  struct BestMatch
+    {
+    double match;
+    int k;
+    InputImagePixelType sum, ssq;
+    BestMatch() : match(1e100), k(-1), sum(0), ssq(0) {}
+    };
+
+  // Test the k-th search offset in atlas i, keeping it if it is the best match so far
+  template <unsigned int VN>
+  void TryMatch(int i, int k, const InputImagePixelType *pAtlasCurrent, 
+                const InputImagePixelType *xNormTargetPatch, BestMatch &best);
+
+  // Test all the search offsets
+  template <unsigned int VN>
+  void ExhaustiveSearchN(int i, const InputImagePixelType *pAtlasCurrent,
+                         const InputImagePixelType *xNormTargetPatch, BestMatch &best);
+
+  // Test the offsets proposed by PatchMatch
+  template <unsigned int VN>
+  void PatchMatchSearchN(int i, const IndexType &idx, const InputImagePixelType *pAtlasCurrent,
+                         const InputImagePixelType *xNormTargetPatch, BestMatch &best, ThreadData &td);
+
+  // Rank the offsets by the PCA descriptors and test the best ones
+  template <unsigned int VN>
+  void DescriptorSearchN(int i, const InputImagePixelType *pAtlasCurrent,
+                         const InputImagePixelType *xNormTargetPatch, BestMatch &best);
+
+  // Parameter sweep: the votes of each additional (alpha, beta) pair
+  struct SweepSet
+    {
+    double alpha, beta;
+    VoteTensor votes;
+    PosteriorMap posterior;
+    PosteriorImagePtr counter;
+    typename TOutputImage::Pointer output;
+    };
+
+  std::vector<SweepSet> m_Sweep;
+
+  // Vote over the patch of a voxel with the given weights, into the maps of the
+  // sweep pair if one is given
+  void Vote(const IndexType &idx, const VectorType &W, 
+            const InputImagePixelType * const *patchSeg, ThreadData &td, LFPhaseClock &clkPhase,
+            SweepSet *sweep = NULL);
+
+  // Compute Mx, solve and vote for each pair of the sweep, reusing the patch differences
+  void SweepVote(const IndexType &idx, InputImagePixelType * const *apd, 
+                 const InputImagePixelType * const *patchSeg, 
+                 VoxelWorkspace &ws, ThreadData &td, LFPhaseClock &clkPhase);
+
+  // Assign the label with the largest posterior to the voxels in the mask
+  void VoteLabels(const VoteTensor &votes, TOutputImage *output);
+
+  // Split the votes into posterior maps, normalized by the counter unless told
+  // otherwise, and release them
+  void ExportPosteriorMaps(VoteTensor &votes, PosteriorImage *counter, PosteriorMap &posteriorMap);
+
+  // Allocate an image over the requested region, filled with zeros
+  PosteriorImagePtr NewPosteriorImage();
+
+  // Voxels waiting for the batched solver
+  struct SolveBatch
+    {
+    int size;
+    IndexType idx[SolveBatchSize];
+    MatrixType Mx[SolveBatchSize];
+    VectorType W[SolveBatchSize];
+    std::vector<const InputImagePixelType *> patchSeg[SolveBatchSize];
+
+    SolveBatch() : size(0) {}
+    };
+
+  // Solve for the weights of the voxels in the batch and vote over their patches
+  void FlushSolveBatch(SolveBatch &batch, 
+                       VoxelWorkspace &ws, ThreadData &td, LFPhaseClock &clkPhase);
+
+  // Solve for the weights given ws.Mx and vote, or queue the voxel for the batched solver
+  void SolveAndVote(const IndexType &idx, VoxelWorkspace &ws, SolveBatch &batch,
+                    ThreadData &td, LFPhaseClock &clkPhase);
+
+  // Batched solve
+  bool m_BatchedSolve;
+
+  // Cascade voting
+  double m_CascadeMargin;
+  void CascadeVoting();
+
+  // Automatic search radius
+  double m_AutoSearchFraction;
+  int m_AutoSearchSamples;
+  void ComputeAutoSearchRadius();
+
+  // Approximate PatchMatch search
+  bool m_PatchMatch;
+  double m_PatchMatchCheckFraction;
+
+  // Best search offset of each atlas at each voxel of the region searched so far (-1
+  // if not searched), with the atlases m_PatchMatchStride apart. The lookup gives the
+  // search offset at each position in the search box (-1 outside the neighborhood)
+  std::vector<int> m_PatchMatchBest, m_SearchLookup;
+  size_t m_PatchMatchStride;
+
+  void InitializePatchMatch();
+  int SearchLookup(const OffsetType &off) const;
+
+  // PCA descriptor search
+  int m_DescriptorComponents, m_DescriptorCandidates;
+
+  // Length of the normalized target patch buffers, which hold the descriptor of the
+  // target patch after the patch itself
+  size_t m_TargetPatchLength;
+
+  // The PCA basis, one component per row. For each atlas, the descriptors of its 
+  // patches in the layout of the atlas buffer, each followed by the inverse of the
+  // unnormalized variance of the patch
+  std::vector<float> m_DescriptorBasis;
+  std::vector<std::vector<float> > m_Descriptors;
+
+  // The region of patch centers where the atlas descriptors are computed
+  RegionType m_DescriptorRegion;
+
+  void LearnDescriptorBasis();
+  void ComputeAtlasDescriptors();
+  void ComputeAtlasDescriptors(const RegionType &region);
+  static ITK_THREAD_RETURN_TYPE DescriptorThreaderCallback(void *arg);
+
+  // Tiled traversal
+  SizeType m_TileSize;
+  bool m_UseTiles;
+
+  // Scratch space for a tile, with the apd rows of voxel v and atlas i in row v * n + i
+  struct TileWorkspace
+    {
+    std::vector<IndexType> idx;
+    float **apd;
+    std::vector<const InputImagePixelType *> patchSeg;
+    InputImagePixelType *xNormTargetPatch;
+
+    TileWorkspace() : apd(NULL), xNormTargetPatch(NULL) {}
+    ~TileWorkspace()
+      {
+      FreePatchDifferences(apd);
+      delete[] xNormTargetPatch;
+      }
+    };
+
+  void AllocateTileWorkspace(TileWorkspace &tw);
+
+  // Estimate and vote for the voxels of a tile; returns the number of voxels estimated
+  int ProcessTile(const RegionType &tile, TileWorkspace &tw, VoxelWorkspace &ws, SolveBatch &batch,
+                  ThreadData &td, LFPhaseClock &clkPhase, itk::ProgressReporter &progress);
+
+  // Fallback for badly conditioned voxels
+  SolveFallback m_SolveFallback;
+  int m_RidgeRetries;
+
+  // Solve at one voxel with the filter's fallback, counting the path taken
+  void SolveVoxelWeights(const MatrixType &Mx, const VectorType &ones, VectorType &W, ThreadData &td);
+
+  // Strided estimation
+  SizeType m_WeightStride;
+  bool m_UseWeightStride;
+
+  bool IsOnStrideLattice(const IndexType &idx);
+  void FillStrideGaps();
+
+  // Checkpointing
+  std::string m_CheckpointFile;
+  double m_CheckpointInterval;
+  bool m_Resume;
+
+  // The slab processed by the threads when checkpointing, and its share of the progress
+  RegionType m_CurrentChunk;
+  float m_ChunkProgressStart, m_ChunkProgressWeight;
+
+  void GenerateDataInChunks();
+  static ITK_THREAD_RETURN_TYPE ChunkThreaderCallback(void *arg);
+  static unsigned int SplitRegion(const RegionType &region, unsigned int i, unsigned int num, RegionType &split);
+
+  // Save and load the vote sums and the list of finished slabs
+  void WriteCheckpoint(const std::vector<char> &done);
+  bool ReadCheckpoint(std::vector<char> &done);
+
+  // NUMA placement: the nodes, and the number of slabs the threads are given. With
+  // interleave only, the slabs are not bound to nodes and the threads are not pinned
+  bool m_NUMAPlacement, m_NUMAInterleaveOnly;
+  std::vector<LFNUMANode> m_NUMANodes;
+  unsigned int m_NUMASlabs;
+
+  void PlaceBuffersOnNodes();
+  double PlaceBuffer(const void *buffer, const RegionType &bufferRegion, size_t bytesPerVoxel);
+
+  // The node of the thread that processes the given slab
+  int GetNodeOfSlab(unsigned int slab) const
+    { return (slab * m_NUMANodes.size()) / std::max(1u, m_NUMASlabs); }
+
+  // The header that identifies the run, and the buffers that hold its votes
+  std::string CheckpointHeader(size_t nSlabs);
+
+  // Checksum of the input images, mask and exclusions, computed once per run
+  std::string m_CheckpointInputs;
+  std::string HashCheckpointInputs();
+  typedef std::vector<std::pair<float *, size_t> > BufferList;
+  void GetVoteBuffers(BufferList &buffers);
+
 };
 
 
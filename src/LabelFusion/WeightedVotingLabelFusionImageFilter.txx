@@ -34,14 +34,27 @@
   
 #include <itkNeighborhoodIterator.h>
 #include <itkImageRegionIteratorWithIndex.h>
+#include <itkImageRegionIterator.h>
 #include <itkBinaryFunctorImageFilter.h>
+#include <itkProgressReporter.h>
+#include <itkMultiThreader.h>
 #include <vnl/vnl_matrix.h>
 #include <vnl/algo/vnl_svd.h>
 #include <vnl/algo/vnl_cholesky.h>
+#include <vnl/algo/vnl_symmetric_eigensystem.h>
 
 #include <set>
 #include <map>
 #include <vector>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+
+#ifndef _NO_SSE_
+#include <emmintrin.h>
+#endif
 
 template <class TInput1, class TInput2, class TOutput>
 class NormalizeFunctor
@@ -58,6 +71,79 @@ public:
     }
 };
 
+/**
+ * Index of the first largest entry of a row of votes, or -1 if no entry is positive.
+ * The length must be a multiple of 4. Each SIMD lane keeps the largest entry it has
+ * seen and its index, and the lanes are compared at the end.
+ */
+inline int argmax_positive(const float *row, size_t len)
+{
+#ifdef _NO_SSE_
+
+  int best = -1;
+  float wmax = 0.0f;
+  for(size_t k = 0; k < len; k++)
+    {
+    if(wmax < row[k])
+      {
+      wmax = row[k];
+      best = k;
+      }
+    }
+  return best;
+
+#else
+
+  __m128 vmax = _mm_setzero_ps();
+  __m128i vidx = _mm_set1_epi32(-1);
+  __m128i cur = _mm_setr_epi32(0, 1, 2, 3), four = _mm_set1_epi32(4);
+  for(size_t k = 0; k < len; k += 4)
+    {
+    __m128 x = _mm_loadu_ps(row + k);
+    __m128i gt = _mm_castps_si128(_mm_cmpgt_ps(x, vmax));
+    vmax = _mm_max_ps(x, vmax);
+    vidx = _mm_or_si128(_mm_and_si128(gt, cur), _mm_andnot_si128(gt, vidx));
+    cur = _mm_add_epi32(cur, four);
+    }
+
+  float lmax[4];
+  int lidx[4];
+  _mm_storeu_ps(lmax, vmax);
+  _mm_storeu_si128((__m128i *) lidx, vidx);
+
+  // On ties between the lanes, the smaller index wins, as in the scalar loop
+  int best = -1;
+  float wmax = 0.0f;
+  for(int l = 0; l < 4; l++)
+    {
+    if(lidx[l] >= 0 && (best < 0 || lmax[l] > wmax || (lmax[l] == wmax && lidx[l] < best)))
+      {
+      wmax = lmax[l];
+      best = lidx[l];
+      }
+    }
+  return best;
+
+#endif
+}
+
+/** Orders offsets by their Manhattan distance from the center */
+template <unsigned int VDim>
+class ManhattanLess
+{
+public:
+  static long Distance(const itk::Offset<VDim> &off)
+    {
+    long d = 0;
+    for(unsigned int i = 0; i < VDim; i++)
+      d += std::abs((long) off[i]);
+    return d;
+    }
+
+  bool operator()(const itk::Offset<VDim> &a, const itk::Offset<VDim> &b) const
+    { return Distance(a) < Distance(b); }
+};
+
 template <class TInputImage, class TOutputImage>
 void
 WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
@@ -121,49 +207,129 @@ WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
     }
 }
 
-template<class TInputImage, class TOutputImage>
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::ComputeNeighborhood(
+  const SizeType &radius, 
+  const typename InputImageType::SpacingType &spacing,
+  const PhysicalRadiusType &radiusPhysical, 
+  OffsetList &offsets)
+{
+  // Is this an ellipsoid?
+  bool ellipsoid = false;
+  for(unsigned int d = 0; d < InputImageDimension; d++)
+    if(radiusPhysical[d] > 0)
+      ellipsoid = true;
+
+  // Go over the box in the same order as the neighborhood iterator, first
+  // dimension fastest
+  offsets.clear();
+  OffsetType off;
+  for(unsigned int d = 0; d < InputImageDimension; d++)
+    off[d] = -(long) radius[d];
+
+  while(true)
+    {
+    // Check if the offset is inside the ellipsoid. A zero semi-axis only allows 
+    // zero offsets in that dimension
+    bool inside = true;
+    if(ellipsoid)
+      {
+      double r2 = 0.0;
+      for(unsigned int d = 0; d < InputImageDimension; d++)
+        {
+        if(radiusPhysical[d] > 0)
+          {
+          double x = off[d] * spacing[d] / radiusPhysical[d];
+          r2 += x * x;
+          }
+        else if(off[d] != 0)
+          inside = false;
+        }
+
+      // Allow for round-off, so that radii that are a multiple of the spacing 
+      // include the voxels on the axes
+      if(r2 > 1.0 + 1.0e-6)
+        inside = false;
+      }
+
+    if(inside)
+      offsets.push_back(off);
+
+    // Next offset
+    unsigned int d = 0;
+    while(d < InputImageDimension && off[d] == (long) radius[d])
+      {
+      off[d] = -(long) radius[d];
+      d++;
+      }
+    if(d == InputImageDimension)
+      break;
+    off[d]++;
+    }
+}
+
+template <class TInputImage, class TOutputImage>
 void
 WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
 ::ComputeOffsetTable(
   const InputImageType *image, 
-  const SizeType &radius, 
+  const OffsetList &hood,
   int **offset, 
   size_t &nPatch,
   int **manhattan)
 {
-  // Use iterators to construct offset tables
+  // Use the middle of the buffer as the reference point
   RegionType r = image->GetBufferedRegion();
-  NIter itTempPatch(radius, image, r);
-
-  // Position the iterator in the middle to avoid problems with boundary conditions
   IndexType iCenter;
   for(size_t i = 0; i < InputImageDimension; i++)
     iCenter[i] = r.GetIndex(i) + r.GetSize(i)/2;
-  itTempPatch.SetLocation(iCenter);
+  long centerOffset = image->ComputeOffset(iCenter);
 
   // Compute the offsets 
-  nPatch = itTempPatch.Size();
+  nPatch = hood.size();
   (*offset) = new int[nPatch];
   if(manhattan)
     (*manhattan) = new int[nPatch];
   for(size_t i = 0; i < nPatch; i++)
   {
-    (*offset)[i] = itTempPatch[i] - itTempPatch.GetCenterPointer();
+    (*offset)[i] = image->ComputeOffset(iCenter + hood[i]) - centerOffset;
     if(manhattan)
       {
-      typename NIter::OffsetType off = itTempPatch.GetOffset(i);
       (*manhattan)[i] = 0;
       for(int d = 0; d < InputImageDimension; d++)
-        (*manhattan)[i] += abs((int) off[d]);
+        (*manhattan)[i] += abs((int) hood[i][d]);
       }
   }
 }
 
+template<class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::ComputeOffsetTable(
+  const InputImageType *image, 
+  const SizeType &radius, 
+  int **offset, 
+  size_t &nPatch,
+  int **manhattan)
+{
+  // The full box of the given radius
+  OffsetList hood;
+  PhysicalRadiusType noEllipsoid;
+  noEllipsoid.Fill(0.0);
+  ComputeNeighborhood(radius, image->GetSpacing(), noEllipsoid, hood);
+  ComputeOffsetTable(image, hood, offset, nPatch, manhattan);
+}
+
 template <class TInputImage, class TOutputImage>
 void
 WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
 ::BeforeThreadedGenerateData()
 {
+  if(m_Heartbeat)
+    m_Heartbeat->StartPhase("setup", 0, "");
+
   // Allocate the output
   this->GetOutput()->SetBufferedRegion( this->GetOutput()->GetRequestedRegion() );
   this->GetOutput()->Allocate();
@@ -171,9 +337,6 @@ WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
   // Get the target image
   InputImageType *target = m_Target;
 
-  // Create a neighborhood iterator for the target image
-  NIter itTarget(m_PatchRadius, target, this->GetOutput()->GetRequestedRegion());
-
   // Get the number of atlases
   int n = m_Atlases.size();
 
@@ -187,8 +350,29 @@ WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
   m_OffSearchAtlas = new int *[n];
   m_OffSearchSeg = new int *[n];
 
+  // Time spent computing offset tables and scanning for labels
+  double tOffsetWall = 0.0, tOffsetCPU = 0.0, tLabelWall = 0.0, tLabelCPU = 0.0;
+  LFPhaseClock clkSetup(m_Profile != NULL);
+
+  // The patch and search neighborhoods, in voxels of the target image
+  ComputeNeighborhood(m_PatchRadius, target->GetSpacing(), m_PatchRadiusPhysical, m_PatchOffsets);
+  ComputeNeighborhood(m_SearchRadius, target->GetSpacing(), m_SearchRadiusPhysical, m_SearchOffsets);
+
+  // For the automatic search radius, order the search offsets by distance from the
+  // center, so that the search over a smaller radius uses the start of the table
+  if(m_AutoSearchFraction > 0)
+    std::stable_sort(m_SearchOffsets.begin(), m_SearchOffsets.end(), ManhattanLess<InputImageDimension>());
+
+  std::cout << "  Patch size: " << m_PatchOffsets.size() << " voxels, search size: " 
+    << m_SearchOffsets.size() << " voxels" << std::endl;
+
   // Compute the offset table for the target image
-  ComputeOffsetTable(target, m_PatchRadius, &m_OffPatchTarget, m_NPatch);
+  ComputeOffsetTable(target, m_PatchOffsets, &m_OffPatchTarget, m_NPatch);
+
+  // The descriptor search keeps the descriptor of the target patch after the patch
+  m_DescriptorComponents = std::min(m_DescriptorComponents, (int) m_NPatch);
+  m_DescriptorCandidates = std::max(1, std::min((int) m_DescriptorCandidates, (int) MaxDescriptorCandidates));
+  m_TargetPatchLength = m_NPatch + std::max(0, m_DescriptorComponents);
 
   // Find all unique labels in the requested region
   m_LabelSet.clear();
@@ -196,8 +380,9 @@ WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
   for(int i = 0; i < n; i++)
     {
     // Compute the offset table for that atlas
-    ComputeOffsetTable(m_Atlases[i], m_PatchRadius, m_OffPatchAtlas+i, m_NPatch);
-    ComputeOffsetTable(m_Atlases[i], m_SearchRadius, m_OffSearchAtlas+i, m_NSearch, &m_Manhattan);
+    ComputeOffsetTable(m_Atlases[i], m_PatchOffsets, m_OffPatchAtlas+i, m_NPatch);
+    ComputeOffsetTable(m_Atlases[i], m_SearchOffsets, m_OffSearchAtlas+i, m_NSearch, &m_Manhattan);
+    clkSetup.Lap(tOffsetWall, tOffsetCPU);
 
     // If there are segmentation inputs, process them
     if(have_segs)
@@ -217,30 +402,33 @@ WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
           have_last_label = true;
           }
         }
+      clkSetup.Lap(tLabelWall, tLabelCPU);
 
-      ComputeOffsetTable(m_AtlasSegs[i], m_PatchRadius, m_OffPatchSeg+i, m_NPatch);
-      ComputeOffsetTable(m_AtlasSegs[i], m_SearchRadius, m_OffSearchSeg+i, m_NSearch, &m_Manhattan);
+      ComputeOffsetTable(m_AtlasSegs[i], m_PatchOffsets, m_OffPatchSeg+i, m_NPatch);
+      ComputeOffsetTable(m_AtlasSegs[i], m_SearchOffsets, m_OffSearchSeg+i, m_NSearch, &m_Manhattan);
+      clkSetup.Lap(tOffsetWall, tOffsetCPU);
       }
     }
 
-  // Initialize the posterior maps
-  m_PosteriorMap.clear();
+  // Until the automatic search radius says otherwise, every atlas is searched fully
+  m_NSearchAtlas.assign(n, m_NSearch);
 
-  // Allocate posterior images for the different labels
-  if(have_segs)
+  if(m_Profile)
     {
-    for(typename std::set<InputImagePixelType>::iterator sit = m_LabelSet.begin();
-      sit != m_LabelSet.end(); ++sit)
-      {
-      m_PosteriorMap[*sit] = PosteriorImage::New();
-      m_PosteriorMap[*sit]->SetLargestPossibleRegion(target->GetLargestPossibleRegion());
-      m_PosteriorMap[*sit]->SetRequestedRegion(this->GetOutput()->GetRequestedRegion());
-      m_PosteriorMap[*sit]->SetBufferedRegion(this->GetOutput()->GetRequestedRegion());
-      m_PosteriorMap[*sit]->Allocate();
-      m_PosteriorMap[*sit]->FillBuffer(0.0f);
-      }
+    m_Profile->AddPhase("offset_tables", tOffsetWall, tOffsetCPU, false);
+    m_Profile->AddPhase("labels", tLabelWall, tLabelCPU, false);
     }
 
+  // Initialize the posterior maps, which are filled in at the end
+  m_PosteriorMap.clear();
+
+  // Allocate the votes for the different labels
+  IndexLabels();
+  size_t nPix = this->GetOutput()->GetRequestedRegion().GetNumberOfPixels();
+  m_Votes.clear();
+  if(have_segs)
+    m_Votes.assign(nPix * m_LabelStride, 0.0f);
+
   // Generate the optional weight maps
   if(m_GenerateWeightMaps)
     {
@@ -259,18 +447,30 @@ WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
     }
 
   // Create a counter map -- needed if we have weights or posteriors - so always
-  m_CounterMap = PosteriorImage::New();
-  m_CounterMap->SetLargestPossibleRegion(target->GetLargestPossibleRegion());
-  m_CounterMap->SetRequestedRegion(this->GetOutput()->GetRequestedRegion());
-  m_CounterMap->SetBufferedRegion(this->GetOutput()->GetRequestedRegion());
-  m_CounterMap->Allocate();
-  m_CounterMap->FillBuffer(0.0f);
+  m_CounterMap = NewPosteriorImage();
+
+  // Each pair of the parameter sweep votes into its own posterior maps and counter
+  for(size_t s = 0; s < m_Sweep.size(); s++)
+    {
+    m_Sweep[s].posterior.clear();
+    m_Sweep[s].votes.clear();
+    if(have_segs)
+      m_Sweep[s].votes.assign(nPix * m_LabelStride, 0.0f);
+    m_Sweep[s].counter = NewPosteriorImage();
+    m_Sweep[s].output = NULL;
+    }
+
+  // Pack the exclusions into per-voxel label bitsets
+  CompileExclusions();
 
   // In earlier code, we iterated over all the voxels in the target image. But this is often
   // not necessary because much of the image is just background. Now we allow the user to 
   // provide a flag to automatically mask the iterated region by the dilated union of all
   // the segmentations. This should have no effect on the output segmentation, but will affect
   // the posterior maps
+  double tMaskWall = 0.0, tMaskCPU = 0.0;
+  clkSetup.Skip();
+
   m_Mask = NULL;
   if(m_MaskImage.IsNull() && have_segs)
     {
@@ -348,362 +548,2067 @@ WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
     std::cout << "  No mask supplied, using whole image" << std::endl;
     }
 
-  // Initialize thread data
-  m_ThreadData.resize(this->GetNumberOfThreads());
-}
+  if(m_Profile)
+    {
+    clkSetup.Lap(tMaskWall, tMaskCPU);
+    m_Profile->AddPhase("mask", tMaskWall, tMaskCPU, false);
+    }
 
-template <class T>
-T* allocate_aligned(int elements)
-{
-  void* pointer;
-  posix_memalign(&pointer, 16, elements * sizeof(T));
-  return static_cast<T *>(pointer)  ;
-}
+  // Only estimate the weights in the estimation region. The other voxels still
+  // receive votes from the estimated ones
+  if(m_EstimationRegion.GetNumberOfPixels() > 0)
+    {
+    MakeMaskInternal();
+    unsigned long nOutside = 0;
+    typedef itk::ImageRegionIteratorWithIndex<InputImageType> MaskIter;
+    for(MaskIter it(m_Mask, m_Mask->GetBufferedRegion()); !it.IsAtEnd(); ++it)
+      {
+      if(it.Get() != 0 && !m_EstimationRegion.IsInside(it.GetIndex()))
+        {
+        it.Set(0);
+        nOutside++;
+        }
+      }
 
-template <class TInputImage, class TOutputImage>
-void
-WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
-::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread, itk::ThreadIdType threadId)
-{
-  // Get the target image
-  InputImageType *target = m_Target;
+    std::cout << "  Estimating weights in region " << m_EstimationRegion.GetIndex() << ", " 
+      << m_EstimationRegion.GetSize() << ", skipping " << nOutside << " voxels outside of it" << std::endl;
+    }
 
-  // Create a neighborhood iterator for the target image
-  NIter itTarget(m_PatchRadius, target, outputRegionForThread);
+  // First stage of the cascade
+  if(m_CascadeMargin > 0 && have_segs)
+    {
+    double tCascadeWall = 0.0, tCascadeCPU = 0.0;
+    CascadeVoting();
+    if(m_Profile)
+      {
+      clkSetup.Lap(tCascadeWall, tCascadeCPU);
+      m_Profile->AddPhase("cascade", tCascadeWall, tCascadeCPU, false);
+      }
+    }
 
-  // Get the number of atlases
-  int n = m_Atlases.size();
-  bool have_segs = m_AtlasSegs.size() == n;
+  // The mask is final now, pack it into bits
+  CompileMask();
+
+  // Pick the search radius for each atlas
+  if(m_AutoSearchFraction > 0)
+    {
+    double tAutoWall = 0.0, tAutoCPU = 0.0;
+    ComputeAutoSearchRadius();
+    if(m_Profile)
+      {
+      clkSetup.Lap(tAutoWall, tAutoCPU);
+      m_Profile->AddPhase("auto_search", tAutoWall, tAutoCPU, false);
+      }
+    }
+
+  // Set up the PatchMatch search, after the pilot search, which is exhaustive
+  m_PatchMatchBest.clear();
+  if(m_PatchMatch)
+    InitializePatchMatch();
 
-  // Allocate Mx
-  typedef vnl_matrix<double> MatrixType;
-  MatrixType Mx(n, n);
+  // Learn the descriptor basis and project the atlas patches onto it
+  m_DescriptorBasis.clear();
+  m_Descriptors.clear();
+  if(m_DescriptorComponents > 0)
+    {
+    double tDescWall = 0.0, tDescCPU = 0.0;
+    LearnDescriptorBasis();
+    ComputeAtlasDescriptors();
+    if(m_Profile)
+      {
+      clkSetup.Lap(tDescWall, tDescCPU);
+      m_Profile->AddPhase("descriptors", tDescWall, tDescCPU, false);
+      m_Profile->SetCounter("descriptor_components", m_DescriptorComponents);
+      }
+    }
 
-  // Define a vector of all ones
-  vnl_vector<double> ones(n, 1.0);
+  // Check if strided estimation is requested
+  m_UseWeightStride = false;
+  for(unsigned int d = 0; d < InputImageDimension; d++)
+    if(m_WeightStride[d] > 1)
+      m_UseWeightStride = true;
 
-  // Solve for the weights
-  vnl_vector<double> W(n, 0.0);
+  if(m_UseWeightStride)
+    std::cout << "  Estimating weights on a lattice with stride " << m_WeightStride << std::endl;
 
-  // Collect search statistics
-  m_ThreadData[threadId].m_SearchHisto.resize(100, 0);
+  // Check if tiled traversal is requested
+  m_UseTiles = true;
+  for(unsigned int d = 0; d < InputImageDimension; d++)
+    if(m_TileSize[d] == 0)
+      m_UseTiles = false;
 
-  // Keep track of iterations
-  int iter = 0;
+  if(m_UseTiles)
+    std::cout << "  Searching the atlases one at a time over tiles of size " << m_TileSize << std::endl;
 
-  // For faster code, we will 16-byte align the arrays and also allocate them as factor of 4
-  int n_PatchRnd = (m_NPatch % 4 == 0) ? m_NPatch : ((m_NPatch >> 2) + 1) << 2;
+  // Place the buffers on the NUMA nodes of the threads that use them
+  m_NUMANodes.clear();
+  if(m_NUMAPlacement)
+    PlaceBuffersOnNodes();
 
-  // We need an array of absolute patch differences between target image and atlases
-  // (apd - atlas patch difference)
-  InputImagePixelType **apd = new InputImagePixelType*[n];
-  for(int i = 0; i < n; i++)
-    {
-    apd[i] = allocate_aligned<float>(n_PatchRnd);
-    for(int j = 0; j < n_PatchRnd; j++)
-      apd[i][j] = 0.0f;
-    }
+  // Initialize thread data
+  m_ThreadData.assign(this->GetNumberOfThreads(), ThreadData());
 
-  // Also an array of pointers to the segmentations of different atlases
-  const InputImagePixelType **patchSeg = new const InputImagePixelType*[n]; 
+  if(m_Heartbeat)
+    m_Heartbeat->StartPhase("fusion", CountEstimated(this->GetOutput()->GetRequestedRegion()), "voxels");
+}
 
-  // Create an array for storing the normalized target patch to save more time
-  InputImagePixelType *xNormTargetPatch = new InputImagePixelType[m_NPatch];
+/**
+ * Automatic search radius. A pilot search over a sparse sample of the voxels in the
+ * mask records, for each atlas, the Manhattan distance of the best matches. The
+ * search radius of the atlas is then the smallest distance that covers the given
+ * fraction of the best matches. Since the search offsets are ordered by distance,
+ * this just shortens the atlas's search table.
+ */
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::ComputeAutoSearchRadius()
+{
+  int n = m_Atlases.size();
+  const RegionType &region = this->GetOutput()->GetRequestedRegion();
 
-  // Iterate over voxels in the output region
+  // Count the voxels that will be estimated, to space the samples evenly
   typedef itk::ImageRegionIteratorWithIndex<TOutputImage> OutIter;
-  for(OutIter it(this->GetOutput(), outputRegionForThread); !it.IsAtEnd(); ++it)
-    {
-    // If this point is outside of the mask, skip it for posterior computation
-    if(m_Mask && m_Mask->GetPixel(it.GetIndex()) == 0)
-      continue;
+  unsigned long nMasked = 0;
+  for(OutIter it(this->GetOutput(), region); !it.IsAtEnd(); ++it)
+    if(IsEstimated(it.GetIndex()))
+      nMasked++;
 
-    // Point the target iterator to the output location
-    itTarget.SetLocation(it.GetIndex());
-    InputImagePixelType *pTargetCurrent = target->GetBufferPointer() + target->ComputeOffset(it.GetIndex());
+  unsigned long step = std::max(1ul, nMasked / std::max(1, m_AutoSearchSamples));
 
-    // Compute stats for the target patch
-    InputImagePixelType mu, sigma;
-    PatchStats(pTargetCurrent, m_NPatch, m_OffPatchTarget, mu, sigma);
-    for(unsigned int i = 0; i < m_NPatch; i++)
-      xNormTargetPatch[i] = (*(pTargetCurrent + m_OffPatchTarget[i]) - mu) / sigma;
+  // Pilot search, with a separate histogram for each atlas
+  int maxDist = 0;
+  for(size_t k = 0; k < m_NSearch; k++)
+    maxDist = std::max(maxDist, m_Manhattan[k]);
 
-    // In each atlas, search for a patch that matches our patch
-    for(int i = 0; i < n; i++)
-      {
-      const InputImageType *atlas = m_Atlases[i];
-      int *offPatch = m_OffPatchAtlas[i], *offSearch = m_OffSearchAtlas[i];
+  std::vector<ThreadData> pilot(n);
+  for(int i = 0; i < n; i++)
+    pilot[i].m_SearchHisto.resize(maxDist + 1, 0);
 
-      // Search over neighborhood
-      const InputImagePixelType *pAtlasCurrent = atlas->GetBufferPointer() + atlas->ComputeOffset(it.GetIndex());
-      double bestMatch = 1e100;
-      const InputImagePixelType *bestMatchPtr = NULL;
-      InputImagePixelType bestMatchSum = 0, bestMatchSSQ = 0;
-      int bestK = 0;
-      for(unsigned int k = 0; k < m_NSearch; k++)
-        {
-        // Pointer to the voxel at the center of the search
-        const InputImagePixelType *pSearchCenter = pAtlasCurrent + offSearch[k];
-        InputImagePixelType matchSum = 0, matchSSQ = 0;
-        double match = this->PatchSimilarity(pSearchCenter, xNormTargetPatch, m_NPatch, offPatch,
-                                             matchSum, matchSSQ);
-        if(k == 0 || match < bestMatch)
-          {
-          bestMatch = match;
-          bestMatchPtr = pSearchCenter;
-          bestMatchSum = matchSum;
-          bestMatchSSQ = matchSSQ;
-          bestK = k;
-          }
-        }
+  VoxelWorkspace ws;
+  AllocateWorkspace(ws);
+
+  unsigned long iMasked = 0, nSamples = 0;
+  for(OutIter it(this->GetOutput(), region); !it.IsAtEnd(); ++it)
+    {
+    if(!IsEstimated(it.GetIndex()))
+      continue;
+    if(iMasked++ % step)
+      continue;
 
-      // Update the manhattan distance histogram
-      m_ThreadData[threadId].m_SearchHisto[m_Manhattan[bestK]]++;
+    NormalizeTargetPatch(it.GetIndex(), ws.xNormTargetPatch);
+    for(int i = 0; i < n; i++)
+      SearchAtlas(i, it.GetIndex(), ws.xNormTargetPatch, ws.apd[i], ws.patchSeg[i], pilot[i]);
+    nSamples++;
+    }
 
-      // Once the patch has been found, compute the absolute difference with target image
-      InputImagePixelType bestMatchMean = bestMatchSum / m_NPatch;
-      InputImagePixelType bestMatchVar = 
-        (bestMatchSSQ - m_NPatch * bestMatchMean * bestMatchMean) / (m_NPatch - 1);
-      if(bestMatchVar < 1.0e-12)
-        bestMatchVar = 1.0e-12;
-      InputImagePixelType bestMatchSD = sqrt(bestMatchVar);
+  if(nSamples == 0)
+    return;
 
-      for(unsigned int m = 0; m < m_NPatch; m++)
-        {
-        InputImagePixelType x = *(bestMatchPtr + offPatch[m]);
-        apd[i][m] = fabs(xNormTargetPatch[m] - (x - bestMatchMean) / bestMatchSD);
-        }
+  // Shorten the search table of each atlas
+  std::cout << "  Search radius (Manhattan) for " << m_AutoSearchFraction * 100 
+    << "% of best matches over " << nSamples << " samples:";
 
-      // Store the best found neighborhood
-      if(have_segs)
-        {
-        const InputImageType *seg = m_AtlasSegs[i];
-        patchSeg[i] = (bestMatchPtr - atlas->GetBufferPointer()) + seg->GetBufferPointer();
-        }
-      }
+  double nSearchTotal = 0;
+  for(int i = 0; i < n; i++)
+    {
+    const std::vector<int> &histo = pilot[i].m_SearchHisto;
+    int radius = 0;
+    for(unsigned long cum = histo[0]; cum < m_AutoSearchFraction * nSamples; cum += histo[radius])
+      radius++;
+
+    size_t nSearch = 0;
+    while(nSearch < m_NSearch && m_Manhattan[nSearch] <= radius)
+      nSearch++;
+    m_NSearchAtlas[i] = nSearch;
+    nSearchTotal += nSearch;
+
+    std::cout << " " << radius;
+    }
+  std::cout << std::endl;
 
-    // Now we can compute Mx
-    for(int i = 0; i < n; i++) 
-      {
-      float *apdi = apd[i];
-      for(int k = 0; k <= i; k++) 
-        {
-        float *apdk = apd[k];
+  if(m_Profile)
+    {
+    m_Profile->SetCounter("auto_search_samples", nSamples);
+    m_Profile->SetCounter("auto_search_mean_size", nSearchTotal / n);
+    }
+}
 
-        // Multiply through the apd arrays - this is slow C code
- #ifdef _NO_SSE_
+/**
+ * Replace the mask image passed in by the user, or the absence of a mask, by a copy
+ * owned by the filter, which can then be modified.
+ */
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::MakeMaskInternal()
+{
+  if(m_Mask.IsNotNull() && m_Mask != m_MaskImage)
+    return;
 
-        InputImagePixelType mxval = 0.0;
-        for(unsigned int m = 0; m < n_PatchRnd; m+=4)
-          {
-          mxval += apdi[m] * apdk[m];
-          mxval += apdi[m+1] * apdk[m+1];
-          mxval += apdi[m+2] * apdk[m+2];
-          mxval += apdi[m+3] * apdk[m+3];
-          }
+  InputImagePointer mask = InputImageType::New();
+  mask->CopyInformation(this->GetOutput());
+  mask->SetRegions(this->GetOutput()->GetBufferedRegion());
+  mask->Allocate();
 
-#else
-        // Fast multiplication
-        __m128 acc, x, y; 
+  typedef itk::ImageRegionIteratorWithIndex<InputImageType> MaskIter;
+  for(MaskIter it(mask, mask->GetBufferedRegion()); !it.IsAtEnd(); ++it)
+    it.Set(m_Mask.IsNull() ? 1 : m_Mask->GetPixel(it.GetIndex()));
 
-        // Zero out the accumulator
-        acc = _mm_set_ps(0.0f, 0.0f, 0.0f, 0.0f);
+  m_Mask = mask;
+}
 
-        for(unsigned int m = 0; m < n_PatchRnd; m+=4)
-          {
-          x = _mm_load_ps(apdi + m);
-          y = _mm_load_ps(apdk + m);
-          acc = _mm_add_ps(acc, _mm_mul_ps(x, y));
-          }
+/**
+ * First stage of the cascade: majority voting over the atlases at each voxel in the
+ * mask. Where the margin between the two most frequent labels, as a fraction of the
+ * number of atlases, is at least m_CascadeMargin, the majority label is taken as the
+ * result and the voxel is removed from the mask, so joint fusion only runs where the
+ * cheap vote is uncertain. The majority vote is added to the posterior maps like a
+ * patch vote with equal weights.
+ */
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::CascadeVoting()
+{
+  int n = m_Atlases.size();
+  typedef itk::ImageRegionIteratorWithIndex<InputImageType> MaskIter;
 
-        InputImagePixelType mxval;
-        __m128 shuf   = _mm_shuffle_ps(acc, acc, _MM_SHUFFLE(2, 3, 0, 1));  // [ C D | B A ]
-        __m128 sums   = _mm_add_ps(acc, shuf);      // sums = [ D+C C+D | B+A A+B ]
-        shuf          = _mm_movehl_ps(shuf, sums);      //  [   C   D | D+C C+D ]  // let the compiler avoid a mov by reusing shuf
-        sums          = _mm_add_ss(sums, shuf);
-        mxval         = _mm_cvtss_f32(sums);
+  // Don't modify the mask image passed in by the user
+  MakeMaskInternal();
 
-#endif
+  typename PosteriorImage::PixelType *countermap_buffer = m_CounterMap->GetBufferPointer();
+  std::vector<std::pair<InputImagePixelType, int> > counts;
+  unsigned long nResolved = 0, nTotal = 0;
 
-        mxval /= (m_NPatch - 1);
-        
-        if(m_Beta == 2)
-          mxval *= mxval;
-        else
-          mxval = pow(mxval, m_Beta);
+  // Only resolve the voxels of the estimation region. With a partition of the region,
+  // the voxels of the halo belong to another partition, which resolves them, and the
+  // merged votes must count them once
+  bool haveEstimationRegion = m_EstimationRegion.GetNumberOfPixels() > 0;
 
-        Mx(i,k) = Mx(k,i) = mxval;
-        }
+  for(MaskIter it(m_Mask, m_Mask->GetBufferedRegion()); !it.IsAtEnd(); ++it)
+    {
+    if(it.Get() == 0)
+      continue;
 
-      // Add alpha
-      Mx(i,i) += m_Alpha;
-      }
+    IndexType idx = it.GetIndex();
+    if(haveEstimationRegion && !m_EstimationRegion.IsInside(idx))
+      continue;
+    nTotal++;
 
-    // Now we can compute the weights by solving for the inverse of Mx
-    vnl_cholesky cholesky(Mx, vnl_cholesky::estimate_condition);
-    if(cholesky.rcond() > vnl_math::sqrteps)
+    // Count the votes for each label
+    counts.clear();
+    for(int i = 0; i < n; i++)
       {
-      // Well-conditioned matrix
-      cholesky.solve(ones, &W);
+      InputImagePixelType label = m_AtlasSegs[i]->GetPixel(idx);
+      size_t k = 0;
+      while(k < counts.size() && counts[k].first != label)
+        k++;
+      if(k == counts.size())
+        counts.push_back(std::make_pair(label, 0));
+      counts[k].second++;
       }
-    else
+
+    // Find the two most frequent labels
+    int c1 = 0, c2 = 0;
+    InputImagePixelType winner = 0;
+    for(size_t k = 0; k < counts.size(); k++)
       {
-      // Matrix badly conditioned
-      W = vnl_svd<double>(Mx).solve(ones);
+      if(counts[k].second > c1)
+        {
+        c2 = c1;
+        c1 = counts[k].second;
+        winner = counts[k].first;
+        }
+      else if(counts[k].second > c2)
+        c2 = counts[k].second;
       }
 
-    // Normalize the weights
-    W *= 1.0 / dot_product(W, ones);
+    // Leave the uncertain voxels, and those where the winner is excluded, to joint fusion
+    if(c1 - c2 < m_CascadeMargin * n)
+      continue;
 
-    // Compute the sum of the weights (shouldn't this always be one?)
-    float Wsum = 0.0;
-    for(int i = 0; i < n; i++)
-      Wsum += W[i];
+    OffsetValueType idx_offset = this->GetOutput()->ComputeOffset(idx);
+    if(IsExcluded(idx_offset, GetLabelIndex(winner)))
+      continue;
 
-    /*
-    # Debugging placeholder - for verifying weights
-    if(it.GetIndex()[0] == 193 && it.GetIndex()[1] == 78 && it.GetIndex()[2] == 17)
-      {
-      std::cout << "Mx:" << std::endl;
-      std::cout << Mx << std::endl;
-      std::cout << "W:" << std::endl;
-      std::cout << W << std::endl;
-      }
-    */
-    
-    // Reduce the number of std::map lookups for speed
-    bool have_last = false;
-    InputImagePixelType last_label;
-    typename PosteriorImage::PixelType *last_posterior_buffer = NULL;
+    this->GetOutput()->SetPixel(idx, winner);
+    it.Set(0);
+    nResolved++;
 
-    // Counter map buffer - direct access
-    typename PosteriorImage::PixelType *countermap_buffer = m_CounterMap->GetBufferPointer();
+    // Record the vote
+    for(size_t k = 0; k < counts.size(); k++)
+      m_Votes[idx_offset * m_LabelStride + LookupLabelIndex(counts[k].first)] += counts[k].second * 1.0 / n;
+    if(m_GenerateWeightMaps)
+      for(int i = 0; i < n; i++)
+        m_WeightMapArrayBuffer[i][idx_offset] += 1.0 / n;
+    countermap_buffer[idx_offset] += 1.0;
 
-    // Perform voting using Hongzhi's averaging scheme. Iterate over all segmentation patches
-    for(unsigned int ni = 0; ni < m_NPatch; ni++)
+    // The majority vote does not depend on alpha and beta
+    for(size_t s = 0; s < m_Sweep.size(); s++)
       {
-      // The index of the patch voxel. This index may fall outside of the thread's output
-      // region. In this case, we must use a mutex to ensure that two threads are not writing
-      // to the same location at the same time. Hopefully this will not create a bottleneck!
-      IndexType idx = itTarget.GetIndex(ni);
+      for(size_t k = 0; k < counts.size(); k++)
+        m_Sweep[s].votes[idx_offset * m_LabelStride + LookupLabelIndex(counts[k].first)] += counts[k].second * 1.0 / n;
+      m_Sweep[s].counter->GetBufferPointer()[idx_offset] += 1.0;
+      }
+    }
 
-      // Outside of the overall region - ignore
-      if(!this->GetOutput()->GetRequestedRegion().IsInside(idx))
-        continue;
+  std::cout << "  Majority vote resolved " << nResolved << " out of " << nTotal 
+    << " voxels, running joint fusion on the rest" << std::endl;
 
-      // Outside of the threaded region - need to have exclusivity. However, the chances 
-      // of two threads trying to write to the same location at once are next to nil, so
-      // for now we will just sweep it under the rug!
-        
-      // To save some time, we can convert this index into an offset since all the images
-      // below use the same regions
-      typename InputImageType::OffsetValueType idx_offset = this->GetOutput()->ComputeOffset(idx);
+  if(m_Profile)
+    m_Profile->SetCounter("cascade_resolved", nResolved);
+}
 
-      for(int i = 0; i < n; i++)
-        {
-        // Update the posteriors - if they exist!
-        if(have_segs)
-          {
-          // The segmentation at the corresponding patch location in atlas i
-          InputImagePixelType label = *(patchSeg[i] + m_OffPatchSeg[i][ni]);
+template <class T>
+T* allocate_aligned(int elements)
+{
+  void* pointer;
+  posix_memalign(&pointer, 16, elements * sizeof(T));
+  return static_cast<T *>(pointer)  ;
+}
 
-          // Update the posterior - reduce number of map lookups
-          if(!have_last || label != last_label)
-            {
-            last_label = label;
-            last_posterior_buffer = m_PosteriorMap[label]->GetBufferPointer();
-            have_last = true;
-            }
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::AllocateWorkspace(VoxelWorkspace &ws)
+{
+  // Get the number of atlases
+  int n = m_Atlases.size();
 
-          // Add that weight the posterior map for voxel at idx
-          last_posterior_buffer[idx_offset] += W[i];
-          }
+  // Allocate Mx, a vector of all ones and the weights
+  ws.Mx.set_size(n, n);
+  ws.ones.set_size(n); ws.ones.fill(1.0);
+  ws.W.set_size(n); ws.W.fill(0.0);
 
-        // Add the weight to the weight map too
-        if(m_GenerateWeightMaps)
-          {
-          m_WeightMapArrayBuffer[i][idx_offset] += W[i];
-          }
-        }
+  // We need an array of absolute patch differences between target image and atlases
+  // (apd - atlas patch difference). For faster code, these are 16-byte aligned rows
+  // of one matrix, padded to a multiple of 4
+  ws.apd = AllocatePatchDifferences(n, m_NPatch);
 
-      // Add the weight to the counter
-      countermap_buffer[idx_offset] += Wsum;
-      }
+  // Also an array of pointers to the segmentations of different atlases
+  ws.patchSeg = new const InputImagePixelType*[n]; 
 
-      if(++iter % 1000 == 0)
-        {
-        static double t = clock();
-        std::cout << "." << std::flush;
-        }
-    }
+  // Create an array for storing the normalized target patch to save more time
+  ws.xNormTargetPatch = new InputImagePixelType[m_TargetPatchLength];
 }
 
 template <class TInputImage, class TOutputImage>
 void
 WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
-::AfterThreadedGenerateData()
+::EstimateAndVote(const IndexType &idx, 
+                  VoxelWorkspace &ws, ThreadData &td, LFPhaseClock &clkPhase)
 {
-  /* Who cares?
-  std::cout << std::endl << "Search Manhattan Distance Histogram " << std::endl;
-  for(size_t i = 0; i < searchHisto.size() && searchHisto[i] > 0; i++)
-    std::cout << "    " << i << "\t" << searchHisto[i] << std::endl;
-  */
+  // Search for the matching patches and compute Mx
+  EstimateErrorMatrix(idx, ws, td, clkPhase);
 
-  std::cout << std::endl << "VOTING " << std::endl;
+  // Now we can compute the weights by solving for the inverse of Mx
+  SolveVoxelWeights(ws.Mx, ws.ones, ws.W, td);
 
-  // Filter type for normalizing by the counter
-  typedef NormalizeFunctor<float, float, float> FloatNormalizeFunctor;
-  typedef itk::BinaryFunctorImageFilter<PosteriorImage, PosteriorImage, PosteriorImage, FloatNormalizeFunctor> NormFilter;
+  /*
+  # Debugging placeholder - for verifying weights
+  if(idx[0] == 193 && idx[1] == 78 && idx[2] == 17)
+    {
+    std::cout << "Mx:" << std::endl;
+    std::cout << ws.Mx << std::endl;
+    std::cout << "W:" << std::endl;
+    std::cout << ws.W << std::endl;
+    }
+  */
+  
+  clkPhase.Lap(td.m_PhaseWall[PHASE_SOLVE], td.m_PhaseCPU[PHASE_SOLVE]);
+
+  // Vote over the patch
+  Vote(idx, ws.W, ws.patchSeg, td, clkPhase);
+
+  // The other parameters of the sweep reuse the patch differences
+  SweepVote(idx, ws.apd, ws.patchSeg, ws, td, clkPhase);
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::EstimateErrorMatrix(const IndexType &idx, 
+                      VoxelWorkspace &ws, ThreadData &td, LFPhaseClock &clkPhase)
+{
+  // Get the number of atlases
+  int n = m_Atlases.size();
+
+  // Normalize the target patch
+  NormalizeTargetPatch(idx, ws.xNormTargetPatch);
+
+  // In each atlas, search for a patch that matches our patch
+  for(int i = 0; i < n; i++)
+    SearchAtlas(i, idx, ws.xNormTargetPatch, ws.apd[i], ws.patchSeg[i], td);
+
+  clkPhase.Lap(td.m_PhaseWall[PHASE_SEARCH], td.m_PhaseCPU[PHASE_SEARCH]);
+
+  // Now we can compute Mx
+  ComputeErrorMatrix(ws.apd, n, m_NPatch, m_Alpha, m_Beta, ws.Mx);
+
+  clkPhase.Lap(td.m_PhaseWall[PHASE_MX], td.m_PhaseCPU[PHASE_MX]);
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::NormalizeTargetPatch(const IndexType &idx, InputImagePixelType *xNormTargetPatch)
+{
+  // Point to the target voxel
+  InputImageType *target = m_Target;
+  InputImagePixelType *pTargetCurrent = target->GetBufferPointer() + target->ComputeOffset(idx);
+
+  // Compute stats for the target patch
+  InputImagePixelType mu, sigma;
+  PatchStats(pTargetCurrent, m_NPatch, m_OffPatchTarget, mu, sigma);
+  for(unsigned int i = 0; i < m_NPatch; i++)
+    xNormTargetPatch[i] = (*(pTargetCurrent + m_OffPatchTarget[i]) - mu) / sigma;
+
+  // Append the descriptor of the patch
+  if(m_DescriptorBasis.size())
+    {
+    const float *basis = &m_DescriptorBasis[0];
+    for(int j = 0; j < m_DescriptorComponents; j++, basis += m_NPatch)
+      {
+      InputImagePixelType c = 0;
+      for(unsigned int t = 0; t < m_NPatch; t++)
+        c += basis[t] * xNormTargetPatch[t];
+      xNormTargetPatch[m_NPatch + j] = c;
+      }
+    }
+}
+
+/**
+ * The patch sizes for which the search has a specialized version. These are the
+ * boxes of radius 1x1x1, 2x2x2, 3x3x3, 2x2x1, 3x3x1 (the ASHS default) and 3x3x2,
+ * and the squares of radius 1x1 to 3x3 for 2D images.
+ */
+#define LF_FIXED_PATCH_SIZES(X) X(9) X(25) X(27) X(49) X(75) X(125) X(147) X(245) X(343)
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::SearchAtlas(int i, const IndexType &idx, const InputImagePixelType *xNormTargetPatch,
+              float *apd, const InputImagePixelType *&patchSeg, ThreadData &td)
+{
+  // Pick the version of the search for the patch size, so that the loops over the
+  // patch have a fixed trip count and can be fully unrolled and vectorized
+  switch(m_NPatch)
+    {
+#define LF_SEARCH_CASE(N) \
+    case N: SearchAtlasN<N>(i, idx, xNormTargetPatch, apd, patchSeg, td); break;
+    LF_FIXED_PATCH_SIZES(LF_SEARCH_CASE)
+#undef LF_SEARCH_CASE
+    default:
+      SearchAtlasN<0>(i, idx, xNormTargetPatch, apd, patchSeg, td);
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+template <unsigned int VN>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::SearchAtlasN(int i, const IndexType &idx, const InputImagePixelType *xNormTargetPatch,
+               float *apd, const InputImagePixelType *&patchSeg, ThreadData &td)
+{
+  const InputImageType *atlas = m_Atlases[i];
+  int *offPatch = m_OffPatchAtlas[i], *offSearch = m_OffSearchAtlas[i];
+
+  // Search over neighborhood
+  const InputImagePixelType *pAtlasCurrent = atlas->GetBufferPointer() + atlas->ComputeOffset(idx);
+  BestMatch best;
+  if(m_PatchMatchBest.size())
+    PatchMatchSearchN<VN>(i, idx, pAtlasCurrent, xNormTargetPatch, best, td);
+  else if(m_Descriptors.size())
+    DescriptorSearchN<VN>(i, pAtlasCurrent, xNormTargetPatch, best);
+  else
+    ExhaustiveSearchN<VN>(i, pAtlasCurrent, xNormTargetPatch, best);
+
+  const InputImagePixelType *bestMatchPtr = pAtlasCurrent + offSearch[best.k];
+
+  // Update the manhattan distance histogram
+  td.m_SearchHisto[m_Manhattan[best.k]]++;
+
+  // Once the patch has been found, compute the absolute difference with target image
+  ComputePatchDifferenceN<VN>(bestMatchPtr, best.sum, best.ssq, xNormTargetPatch,
+                              m_NPatch, offPatch, apd);
+
+  // Store the best found neighborhood
+  if(m_AtlasSegs.size() == m_Atlases.size())
+    {
+    const InputImageType *seg = m_AtlasSegs[i];
+    patchSeg = (bestMatchPtr - atlas->GetBufferPointer()) + seg->GetBufferPointer();
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+template <unsigned int VN>
+inline void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::TryMatch(int i, int k, const InputImagePixelType *pAtlasCurrent, 
+           const InputImagePixelType *xNormTargetPatch, BestMatch &best)
+{
+  InputImagePixelType matchSum = 0, matchSSQ = 0;
+  double match = PatchSimilarityN<VN>(pAtlasCurrent + m_OffSearchAtlas[i][k], xNormTargetPatch, 
+                                      m_NPatch, m_OffPatchAtlas[i], matchSum, matchSSQ);
+
+  // Ties go to the earlier offset, as in the exhaustive search
+  if(best.k < 0 || match < best.match || (match == best.match && k < best.k))
+    {
+    best.match = match;
+    best.k = k;
+    best.sum = matchSum;
+    best.ssq = matchSSQ;
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+template <unsigned int VN>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::ExhaustiveSearchN(int i, const InputImagePixelType *pAtlasCurrent,
+                    const InputImagePixelType *xNormTargetPatch, BestMatch &best)
+{
+  for(unsigned int k = 0; k < m_NSearchAtlas[i]; k++)
+    TryMatch<VN>(i, k, pAtlasCurrent, xNormTargetPatch, best);
+}
+
+/**
+ * PatchMatch search in atlas i. The candidates are the center of the search, the
+ * best offsets of the neighbors of the voxel that have been searched already (the
+ * neighbors on the lattice with strided estimation), and then one random offset in
+ * each of a sequence of windows of halving size around the best offset so far. The
+ * random numbers are seeded by the voxel and atlas, so the candidates do not depend
+ * on the order in which the voxels are visited, only on which neighbors have been
+ * searched. Only the neighbors in the region of the calling thread are used, since
+ * the other threads are writing their best offsets at the same time. So the result
+ * is the same from run to run for a given number of threads, but depends on how the
+ * region is split among the threads.
+ */
+template <class TInputImage, class TOutputImage>
+template <unsigned int VN>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::PatchMatchSearchN(int i, const IndexType &idx, const InputImagePixelType *pAtlasCurrent,
+                    const InputImagePixelType *xNormTargetPatch, BestMatch &best, ThreadData &td)
+{
+  const RegionType &region = td.m_Region;
+  int nSearch = (int) m_NSearchAtlas[i];
+  int *bestMap = &m_PatchMatchBest[i * m_PatchMatchStride];
+  long pos = this->GetOutput()->ComputeOffset(idx);
+  unsigned long nTests = 0;
+
+  // Start at the center of the search
+  OffsetType zero;
+  zero.Fill(0);
+  TryMatch<VN>(i, SearchLookup(zero), pAtlasCurrent, xNormTargetPatch, best);
+  nTests++;
+
+  // Propagation: the best offsets of the neighbors. With strided estimation, these
+  // are the neighbors on the lattice, since the voxels in between are not searched
+  for(unsigned int d = 0; d < InputImageDimension; d++)
+    {
+    long step = m_UseWeightStride ? (long) m_WeightStride[d] : 1;
+    for(int dir = -1; dir <= 1; dir += 2)
+      {
+      IndexType idxNbr = idx;
+      idxNbr[d] += dir * step;
+      if(!region.IsInside(idxNbr))
+        continue;
+
+      int k = bestMap[this->GetOutput()->ComputeOffset(idxNbr)];
+      if(k >= 0 && k < nSearch && k != best.k)
+        {
+        TryMatch<VN>(i, k, pAtlasCurrent, xNormTargetPatch, best);
+        nTests++;
+        }
+      }
+    }
+
+  // Random search in windows of halving size around the best offset
+  unsigned int rng = (unsigned int) (pos * 2654435761u) ^ (unsigned int) (i * 40503u + 1);
+  long w = 0;
+  for(unsigned int d = 0; d < InputImageDimension; d++)
+    w = std::max(w, (long) m_SearchRadius[d]);
+
+  for(; w >= 1; w /= 2)
+    {
+    OffsetType off = m_SearchOffsets[best.k];
+    for(unsigned int d = 0; d < InputImageDimension; d++)
+      {
+      // xorshift
+      rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+      long r = (long) m_SearchRadius[d];
+      off[d] = std::min(r, std::max(-r, (long) off[d] + (long) (rng % (2 * w + 1)) - w));
+      }
+
+    int k = SearchLookup(off);
+    if(k >= 0 && k < nSearch && k != best.k)
+      {
+      TryMatch<VN>(i, k, pAtlasCurrent, xNormTargetPatch, best);
+      nTests++;
+      }
+    }
+
+  bestMap[pos] = best.k;
+  td.m_PatchMatchTests += nTests;
+
+  // Check a sample of the voxels against the exhaustive search
+  if(m_PatchMatchCheckFraction > 0 
+    && ((pos * 2246822519u + i) % 1000003) < m_PatchMatchCheckFraction * 1000003)
+    {
+    BestMatch exact;
+    ExhaustiveSearchN<VN>(i, pAtlasCurrent, xNormTargetPatch, exact);
+    td.m_PatchMatchChecked++;
+    if(exact.k != best.k)
+      td.m_PatchMatchDiffer++;
+    }
+}
+
+/**
+ * Search with the PCA descriptors. The dot product of the target and candidate 
+ * descriptors approximates the dot product of the normalized target patch with the
+ * candidate patch, which gives the same similarity as PatchSimilarity up to the
+ * part of the target patch outside of the span of the basis. The candidates with the
+ * best approximate similarity are then tested exactly.
+ */
+template <class TInputImage, class TOutputImage>
+template <unsigned int VN>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::DescriptorSearchN(int i, const InputImagePixelType *pAtlasCurrent,
+                    const InputImagePixelType *xNormTargetPatch, BestMatch &best)
+{
+  const int K = m_DescriptorComponents;
+  const InputImagePixelType *cu = xNormTargetPatch + m_NPatch;
+  const int *offSearch = m_OffSearchAtlas[i];
+  const float *desc = &m_Descriptors[i][0] + (pAtlasCurrent - m_Atlases[i]->GetBufferPointer()) * (K + 1);
+
+  // Keep the best candidates in order of the approximate similarity
+  int nSearch = (int) m_NSearchAtlas[i];
+  int nTop = std::min(nSearch, m_DescriptorCandidates), nFound = 0;
+  double topScore[MaxDescriptorCandidates];
+  int topK[MaxDescriptorCandidates];
+
+  for(int k = 0; k < nSearch; k++)
+    {
+    const float *d = desc + offSearch[k] * (K + 1);
+    float dot = 0.0f;
+    for(int j = 0; j < K; j++)
+      dot += cu[j] * d[j];
+    double score = (dot > 0 ? -1.0 : 1.0) * dot * dot * d[K];
+
+    if(nFound == nTop && score >= topScore[nTop - 1])
+      continue;
+
+    int m = (nFound < nTop) ? nFound++ : nTop - 1;
+    for(; m > 0 && topScore[m - 1] > score; m--)
+      {
+      topScore[m] = topScore[m - 1];
+      topK[m] = topK[m - 1];
+      }
+    topScore[m] = score;
+    topK[m] = k;
+    }
+
+  for(int m = 0; m < nFound; m++)
+    TryMatch<VN>(i, topK[m], pAtlasCurrent, xNormTargetPatch, best);
+}
+
+/**
+ * Learn the PCA basis for the descriptor search from the normalized target patches
+ * at a sample of the voxels in the mask. The patches have zero mean, so the basis is
+ * made of the leading eigenvectors of their second moment matrix.
+ */
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::LearnDescriptorBasis()
+{
+  const RegionType &region = this->GetOutput()->GetRequestedRegion();
+  typedef itk::ImageRegionIteratorWithIndex<TOutputImage> OutIter;
+
+  // Sample about 10000 voxels
+  unsigned long nMasked = CountEstimated(region);
+  unsigned long step = std::max(1ul, nMasked / 10000), iter = 0, nSamples = 0;
+
+  vnl_matrix<double> C(m_NPatch, m_NPatch, 0.0);
+  std::vector<InputImagePixelType> u(m_TargetPatchLength);
+  for(OutIter it(this->GetOutput(), region); !it.IsAtEnd(); ++it)
+    {
+    if(!IsEstimated(it.GetIndex()) || (iter++ % step) != 0)
+      continue;
+
+    NormalizeTargetPatch(it.GetIndex(), &u[0]);
+    for(unsigned int a = 0; a < m_NPatch; a++)
+      for(unsigned int b = a; b < m_NPatch; b++)
+        C(a, b) += u[a] * u[b];
+    nSamples++;
+    }
+
+  double trace = 0.0;
+  for(unsigned int a = 0; a < m_NPatch; a++)
+    {
+    trace += C(a, a);
+    for(unsigned int b = 0; b < a; b++)
+      C(a, b) = C(b, a);
+    }
+
+  // The eigenvalues are in increasing order
+  vnl_symmetric_eigensystem<double> eig(C);
+  m_DescriptorBasis.resize(m_DescriptorComponents * m_NPatch);
+  double explained = 0.0;
+  for(int j = 0; j < m_DescriptorComponents; j++)
+    {
+    int col = m_NPatch - 1 - j;
+    vnl_vector<double> v = eig.get_eigenvector(col);
+    for(unsigned int t = 0; t < m_NPatch; t++)
+      m_DescriptorBasis[j * m_NPatch + t] = (float) v[t];
+    explained += eig.get_eigenvalue(col);
+    }
+
+  std::cout << "  PCA descriptors: " << m_DescriptorComponents << " components from " << nSamples
+    << " target patches explain " << 100.0 * explained / std::max(trace, 1.0e-12) 
+    << "% of the variance" << std::endl;
+}
+
+template <class TInputImage, class TOutputImage>
+ITK_THREAD_RETURN_TYPE
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::DescriptorThreaderCallback(void *arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfo;
+  ThreadInfo *info = static_cast<ThreadInfo *>(arg);
+  Self *self = static_cast<Self *>(info->UserData);
+
+  RegionType split;
+  unsigned int nUsed = SplitRegion(self->m_DescriptorRegion, info->ThreadID, info->NumberOfThreads, split);
+  if(info->ThreadID < nUsed)
+    self->ComputeAtlasDescriptors(split);
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::ComputeAtlasDescriptors()
+{
+  // The candidate patches are centered within the search radius of the region
+  m_DescriptorRegion = this->GetOutput()->GetRequestedRegion();
+  m_DescriptorRegion.PadByRadius(m_SearchRadius);
+
+  m_Descriptors.resize(m_Atlases.size());
+  for(size_t i = 0; i < m_Atlases.size(); i++)
+    m_Descriptors[i].assign(m_Atlases[i]->GetBufferedRegion().GetNumberOfPixels() * (m_DescriptorComponents + 1), 0.0f);
+
+  this->GetMultiThreader()->SetNumberOfThreads(this->GetNumberOfThreads());
+  this->GetMultiThreader()->SetSingleMethod(&Self::DescriptorThreaderCallback, this);
+  this->GetMultiThreader()->SingleMethodExecute();
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::ComputeAtlasDescriptors(const RegionType &region)
+{
+  const int K = m_DescriptorComponents;
+  for(size_t i = 0; i < m_Atlases.size(); i++)
+    {
+    const InputImageType *atlas = m_Atlases[i];
+    const int *offPatch = m_OffPatchAtlas[i];
+
+    // Only the patches that are inside of the atlas buffer
+    RegionType rAtlas = atlas->GetBufferedRegion();
+    rAtlas.ShrinkByRadius(m_PatchRadius);
+    RegionType r = region;
+    if(!r.Crop(rAtlas))
+      continue;
+
+    typedef itk::ImageRegionConstIteratorWithIndex<InputImageType> AtlasIter;
+    for(AtlasIter it(atlas, r); !it.IsAtEnd(); ++it)
+      {
+      long offset = atlas->ComputeOffset(it.GetIndex());
+      const InputImagePixelType *p = atlas->GetBufferPointer() + offset;
+      float *d = &m_Descriptors[i][0] + offset * (K + 1);
+
+      // Project the patch onto the basis
+      const float *basis = &m_DescriptorBasis[0];
+      for(int j = 0; j < K; j++, basis += m_NPatch)
+        {
+        InputImagePixelType c = 0;
+        for(unsigned int t = 0; t < m_NPatch; t++)
+          c += basis[t] * p[offPatch[t]];
+        d[j] = c;
+        }
+
+      // The inverse of the unnormalized variance, as in PatchSimilarity
+      InputImagePixelType sum = 0, ssq = 0;
+      for(unsigned int t = 0; t < m_NPatch; t++)
+        {
+        sum += p[offPatch[t]];
+        ssq += p[offPatch[t]] * p[offPatch[t]];
+        }
+      InputImagePixelType var = ssq - sum * sum / m_NPatch;
+      d[K] = 1.0f / std::max(var, (InputImagePixelType) 1.0e-6);
+      }
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+int
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::SearchLookup(const OffsetType &off) const
+{
+  size_t pos = 0, stride = 1;
+  for(unsigned int d = 0; d < InputImageDimension; d++)
+    {
+    pos += (off[d] + m_SearchRadius[d]) * stride;
+    stride *= 2 * m_SearchRadius[d] + 1;
+    }
+  return m_SearchLookup[pos];
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::InitializePatchMatch()
+{
+  // Lookup from positions in the search box to the search offsets
+  size_t nBox = 1;
+  for(unsigned int d = 0; d < InputImageDimension; d++)
+    nBox *= 2 * m_SearchRadius[d] + 1;
+  m_SearchLookup.assign(nBox, -1);
+
+  for(size_t k = 0; k < m_SearchOffsets.size(); k++)
+    {
+    size_t pos = 0, stride = 1;
+    for(unsigned int d = 0; d < InputImageDimension; d++)
+      {
+      pos += (m_SearchOffsets[k][d] + m_SearchRadius[d]) * stride;
+      stride *= 2 * m_SearchRadius[d] + 1;
+      }
+    m_SearchLookup[pos] = (int) k;
+    }
+
+  // Nothing has been searched yet
+  m_PatchMatchStride = this->GetOutput()->GetBufferedRegion().GetNumberOfPixels();
+  m_PatchMatchBest.assign(m_PatchMatchStride * m_Atlases.size(), -1);
+
+  std::cout << "  Using the PatchMatch search";
+  if(m_PatchMatchCheckFraction > 0)
+    std::cout << ", checking " << m_PatchMatchCheckFraction * 100 
+      << "% of the voxels against the exhaustive search";
+  std::cout << std::endl;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::Vote(const IndexType &idx, const VectorType &W, 
+       const InputImagePixelType * const *patchSeg, ThreadData &td, LFPhaseClock &clkPhase,
+       SweepSet *sweep)
+{
+  // Get the number of atlases
+  int n = m_Atlases.size();
+  bool have_segs = m_AtlasSegs.size() == n;
+
+  // Compute the sum of the weights (shouldn't this always be one?)
+  float Wsum = 0.0;
+  for(int i = 0; i < n; i++)
+    Wsum += W[i];
+
+  // Reduce the number of label index lookups for speed
+  bool have_last = false;
+  InputImagePixelType last_label;
+  int last_index = 0;
+
+  // The votes to add to, and whether the weight maps are updated
+  float *votes = (have_segs && m_LabelStride) ? &(sweep ? sweep->votes : m_Votes)[0] : NULL;
+  bool update_weights = m_GenerateWeightMaps && !sweep;
+
+  // Counter map buffer - direct access
+  typename PosteriorImage::PixelType *countermap_buffer = 
+    (sweep ? sweep->counter : m_CounterMap)->GetBufferPointer();
+
+  // Perform voting using Hongzhi's averaging scheme. Iterate over all segmentation patches
+  for(unsigned int ni = 0; ni < m_NPatch; ni++)
+    {
+    // The index of the patch voxel. This index may fall outside of the thread's output
+    // region. In this case, we must use a mutex to ensure that two threads are not writing
+    // to the same location at the same time. Hopefully this will not create a bottleneck!
+    IndexType idxPatch = idx + m_PatchOffsets[ni];
+
+    // Outside of the overall region - ignore
+    if(!this->GetOutput()->GetRequestedRegion().IsInside(idxPatch))
+      continue;
+
+    // Outside of the threaded region - need to have exclusivity. However, the chances 
+    // of two threads trying to write to the same location at once are next to nil, so
+    // for now we will just sweep it under the rug!
+      
+    // To save some time, we can convert this index into an offset since all the images
+    // below use the same regions
+    typename InputImageType::OffsetValueType idx_offset = this->GetOutput()->ComputeOffset(idxPatch);
+
+    // The labels of this voxel are next to each other in the votes
+    float *votes_row = votes ? votes + idx_offset * m_LabelStride : NULL;
+
+    for(int i = 0; i < n; i++)
+      {
+      // Update the posteriors - if they exist!
+      if(votes_row)
+        {
+        // The segmentation at the corresponding patch location in atlas i
+        InputImagePixelType label = *(patchSeg[i] + m_OffPatchSeg[i][ni]);
+
+        // Find the index of the label - reduce number of lookups
+        if(!have_last || label != last_label)
+          {
+          last_label = label;
+          last_index = LookupLabelIndex(label);
+          have_last = true;
+          }
+
+        // Add that weight the posterior for voxel at idx
+        votes_row[last_index] += W[i];
+        }
+
+      // Add the weight to the weight map too
+      if(update_weights)
+        {
+        m_WeightMapArrayBuffer[i][idx_offset] += W[i];
+        }
+      }
+
+    // Add the weight to the counter
+    countermap_buffer[idx_offset] += Wsum;
+    }
+
+  clkPhase.Lap(td.m_PhaseWall[PHASE_VOTE], td.m_PhaseCPU[PHASE_VOTE]);
+  if(!sweep)
+    td.m_VoxelCount++;
+}
+
+/**
+ * Vote for each pair of the parameter sweep. Mx is recomputed from the patch 
+ * differences, so ws.Mx and ws.W are overwritten. The badly conditioned voxels
+ * are not counted, the counts are only reported for Alpha and Beta.
+ */
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::SweepVote(const IndexType &idx, InputImagePixelType * const *apd, 
+            const InputImagePixelType * const *patchSeg, 
+            VoxelWorkspace &ws, ThreadData &td, LFPhaseClock &clkPhase)
+{
+  int n = m_Atlases.size();
+  for(size_t s = 0; s < m_Sweep.size(); s++)
+    {
+    SweepSet &set = m_Sweep[s];
+    ComputeErrorMatrix(apd, n, m_NPatch, set.alpha, set.beta, ws.Mx);
+    clkPhase.Lap(td.m_PhaseWall[PHASE_MX], td.m_PhaseCPU[PHASE_MX]);
+
+    SolveWeights(ws.Mx, ws.ones, ws.W, m_SolveFallback, set.alpha, m_RidgeRetries);
+    clkPhase.Lap(td.m_PhaseWall[PHASE_SOLVE], td.m_PhaseCPU[PHASE_SOLVE]);
+
+    Vote(idx, ws.W, patchSeg, td, clkPhase, &set);
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::FlushSolveBatch(SolveBatch &batch, 
+                  VoxelWorkspace &ws, ThreadData &td, LFPhaseClock &clkPhase)
+{
+  // Solve all the voxels that we can in one go
+  bool solved[SolveBatchSize];
+  int nSolved = SolveWeightsBatched(batch.Mx, batch.size, m_Alpha, m_Beta, batch.W, solved);
+  td.m_BatchSolveCount += nSolved;
+  td.m_BatchFallbackCount += batch.size - nSolved;
+
+  // The rest go through the regular solver
+  for(int k = 0; k < batch.size; k++)
+    if(!solved[k])
+      SolveVoxelWeights(batch.Mx[k], ws.ones, batch.W[k], td);
+
+  clkPhase.Lap(td.m_PhaseWall[PHASE_SOLVE], td.m_PhaseCPU[PHASE_SOLVE]);
+
+  // Vote in the order in which the voxels were visited
+  for(int k = 0; k < batch.size; k++)
+    Vote(batch.idx[k], batch.W[k], &batch.patchSeg[k][0], td, clkPhase);
+
+  batch.size = 0;
+}
+
+template <class TInputImage, class TOutputImage>
+bool
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::IsOnStrideLattice(const IndexType &idx)
+{
+  const IndexType &origin = this->GetOutput()->GetRequestedRegion().GetIndex();
+  for(unsigned int d = 0; d < InputImageDimension; d++)
+    if(m_WeightStride[d] > 1 && (idx[d] - origin[d]) % m_WeightStride[d] != 0)
+      return false;
+  return true;
+}
+
+template <class TInputImage, class TOutputImage>
+bool
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::IsEstimated(const IndexType &idx)
+{
+  // If this point is outside of the mask, skip it for posterior computation
+  if(!InMask(this->GetOutput()->ComputeOffset(idx)))
+    return false;
+
+  // With strided estimation, only voxels on the lattice are estimated, and the
+  // patch voting fills in the rest
+  if(m_UseWeightStride && !IsOnStrideLattice(idx))
+    return false;
+
+  return true;
+}
+
+template <class TInputImage, class TOutputImage>
+unsigned long
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::CountEstimated(const RegionType &region)
+{
+  unsigned long nVox = 0;
+  typedef itk::ImageRegionIteratorWithIndex<TOutputImage> OutIter;
+  for(OutIter it(this->GetOutput(), region); !it.IsAtEnd(); ++it)
+    if(IsEstimated(it.GetIndex()))
+      nVox++;
+  return nVox;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::SolveAndVote(const IndexType &idx, VoxelWorkspace &ws, SolveBatch &batch,
+               ThreadData &td, LFPhaseClock &clkPhase)
+{
+  if(m_BatchedSolve)
+    {
+    // Leave the solve and the voting until the batch is full
+    batch.idx[batch.size] = idx;
+    batch.Mx[batch.size] = ws.Mx;
+    batch.patchSeg[batch.size].assign(ws.patchSeg, ws.patchSeg + m_Atlases.size());
+    if(++batch.size == SolveBatchSize)
+      FlushSolveBatch(batch, ws, td, clkPhase);
+    }
+  else
+    {
+    SolveVoxelWeights(ws.Mx, ws.ones, ws.W, td);
+    clkPhase.Lap(td.m_PhaseWall[PHASE_SOLVE], td.m_PhaseCPU[PHASE_SOLVE]);
+    Vote(idx, ws.W, ws.patchSeg, td, clkPhase);
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::AllocateTileWorkspace(TileWorkspace &tw)
+{
+  int n = m_Atlases.size();
+  int nTile = 1;
+  for(unsigned int d = 0; d < InputImageDimension; d++)
+    nTile *= m_TileSize[d];
+
+  tw.idx.resize(nTile);
+  tw.apd = AllocatePatchDifferences(nTile * n, m_NPatch);
+  tw.patchSeg.resize(nTile * n);
+  tw.xNormTargetPatch = new InputImagePixelType[nTile * m_TargetPatchLength];
+}
+
+/**
+ * Estimate the weights and vote for the voxels of a tile. The search goes one atlas
+ * at a time over the whole tile, so that the part of the atlas around the tile stays
+ * in cache. The apd rows are kept for all the voxels until Mx can be computed.
+ */
+template <class TInputImage, class TOutputImage>
+int
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::ProcessTile(const RegionType &tile, TileWorkspace &tw, VoxelWorkspace &ws, SolveBatch &batch,
+              ThreadData &td, LFPhaseClock &clkPhase, itk::ProgressReporter &progress)
+{
+  int n = m_Atlases.size();
+
+  // Find the voxels in the tile that need estimation
+  int nVox = 0;
+  typedef itk::ImageRegionIteratorWithIndex<TOutputImage> OutIter;
+  for(OutIter it(this->GetOutput(), tile); !it.IsAtEnd(); ++it)
+    {
+    progress.CompletedPixel();
+    if(IsEstimated(it.GetIndex()))
+      tw.idx[nVox++] = it.GetIndex();
+    }
+
+  clkPhase.Skip();
+
+  // Normalize the target patches
+  for(int v = 0; v < nVox; v++)
+    NormalizeTargetPatch(tw.idx[v], tw.xNormTargetPatch + v * m_TargetPatchLength);
+
+  // Search the atlases one at a time
+  for(int i = 0; i < n; i++)
+    for(int v = 0; v < nVox; v++)
+      SearchAtlas(i, tw.idx[v], tw.xNormTargetPatch + v * m_TargetPatchLength, 
+                  tw.apd[v * n + i], tw.patchSeg[v * n + i], td);
+
+  clkPhase.Lap(td.m_PhaseWall[PHASE_SEARCH], td.m_PhaseCPU[PHASE_SEARCH]);
+
+  // Compute Mx, solve and vote at each voxel
+  for(int v = 0; v < nVox; v++)
+    {
+    ComputeErrorMatrix(tw.apd + v * n, n, m_NPatch, m_Alpha, m_Beta, ws.Mx);
+    for(int i = 0; i < n; i++)
+      ws.patchSeg[i] = tw.patchSeg[v * n + i];
+
+    clkPhase.Lap(td.m_PhaseWall[PHASE_MX], td.m_PhaseCPU[PHASE_MX]);
+
+    SolveAndVote(tw.idx[v], ws, batch, td, clkPhase);
+    SweepVote(tw.idx[v], tw.apd + v * n, ws.patchSeg, ws, td, clkPhase);
+    }
+
+  return nVox;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::ThreadedGenerateData(const OutputImageRegionType &outputRegionForThread, itk::ThreadIdType threadId)
+{
+  // Thread-specific data and timers
+  ThreadData &td = m_ThreadData[threadId];
+  td.m_Region = outputRegionForThread;
+  double tStart = LFWallTime();
+  LFPhaseClock clkPhase(m_Profile != NULL);
+
+  // Collect search statistics. Large search radii (e.g., with PatchMatch) can have
+  // distances beyond the usual 100 bins
+  int maxDist = 99;
+  for(size_t k = 0; k < m_NSearch; k++)
+    maxDist = std::max(maxDist, m_Manhattan[k]);
+  td.m_SearchHisto.resize(maxDist + 1, 0);
+
+  // Run on the NUMA node that holds this thread's slab
+  std::vector<int> cpus;
+  if(m_NUMANodes.size() && !m_NUMAInterleaveOnly)
+    cpus = m_NUMANodes[GetNodeOfSlab(threadId)].cpus;
+  LFThreadPin pin(cpus);
+  td.m_NUMANode = pin.IsPinned() ? m_NUMANodes[GetNodeOfSlab(threadId)].id : -1;
+
+  // Keep track of iterations
+  int iter = 0;
+
+  // Scratch space for the per-voxel computation
+  VoxelWorkspace ws;
+  AllocateWorkspace(ws);
+
+  // Progress reporting (this also handles aborting the filter)
+  itk::ProgressReporter progress(this, threadId, outputRegionForThread.GetNumberOfPixels(), 
+                                 100, m_ChunkProgressStart, m_ChunkProgressWeight);
+
+  // Voxels waiting for the batched solver
+  SolveBatch batch;
+
+  if(m_UseTiles)
+    {
+    // Scratch space for a tile
+    TileWorkspace tw;
+    AllocateTileWorkspace(tw);
+
+    // Go over the tiles of the region, first dimension fastest
+    const RegionType &region = outputRegionForThread;
+    IndexType tileStart = region.GetIndex();
+    while(true)
+      {
+      RegionType tile;
+      for(unsigned int d = 0; d < InputImageDimension; d++)
+        {
+        long end = region.GetIndex(d) + (long) region.GetSize(d);
+        tile.SetIndex(d, tileStart[d]);
+        tile.SetSize(d, std::min((long) m_TileSize[d], end - tileStart[d]));
+        }
+
+      // Report progress to the heartbeat, or print a dot every 1000 voxels
+      int nVox = ProcessTile(tile, tw, ws, batch, td, clkPhase, progress);
+      if(m_Heartbeat)
+        m_Heartbeat->Add(nVox);
+      else
+        for(iter += nVox; iter >= 1000; iter -= 1000)
+          std::cout << "." << std::flush;
+
+      // Move on to the next tile
+      unsigned int d = 0;
+      for(; d < InputImageDimension; d++)
+        {
+        tileStart[d] += m_TileSize[d];
+        if(tileStart[d] < region.GetIndex(d) + (long) region.GetSize(d))
+          break;
+        tileStart[d] = region.GetIndex(d);
+        }
+      if(d == InputImageDimension)
+        break;
+      }
+    }
+  else
+    {
+    // Iterate over voxels in the output region
+    typedef itk::ImageRegionIteratorWithIndex<TOutputImage> OutIter;
+    for(OutIter it(this->GetOutput(), outputRegionForThread); !it.IsAtEnd(); ++it)
+      {
+      progress.CompletedPixel();
+
+      // Skip voxels outside of the mask and, with strided estimation, off the lattice
+      if(!IsEstimated(it.GetIndex()))
+        continue;
+
+      // Don't count the mask check against the search
+      clkPhase.Skip();
+
+      // Estimate the weights at this voxel and vote over its patch
+      EstimateErrorMatrix(it.GetIndex(), ws, td, clkPhase);
+      SolveAndVote(it.GetIndex(), ws, batch, td, clkPhase);
+      SweepVote(it.GetIndex(), ws.apd, ws.patchSeg, ws, td, clkPhase);
+
+      if(++iter % 1000 == 0)
+        {
+        if(m_Heartbeat)
+          m_Heartbeat->Add(1000);
+        else
+          std::cout << "." << std::flush;
+        }
+      }
+
+    if(m_Heartbeat)
+      m_Heartbeat->Add(iter % 1000);
+    }
+
+  // Finish the last partial batch
+  if(batch.size)
+    FlushSolveBatch(batch, ws, td, clkPhase);
+
+  td.m_TotalWall += LFWallTime() - tStart;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::GenerateData()
+{
+  if(m_CheckpointFile.empty())
+    {
+    Superclass::GenerateData();
+    return;
+    }
+
+  // With checkpointing, the threads are run over one slab at a time, so that the
+  // vote sums can be saved between slabs, when no thread is voting
+  this->BeforeThreadedGenerateData();
+  this->GenerateDataInChunks();
+  this->AfterThreadedGenerateData();
+}
+
+template <class TInputImage, class TOutputImage>
+unsigned int
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::SplitRegion(const RegionType &region, unsigned int i, unsigned int num, RegionType &split)
+{
+  // Split along the longest dimension, since the slabs are thin
+  unsigned int dSplit = 0;
+  for(unsigned int d = 1; d < InputImageDimension; d++)
+    if(region.GetSize(d) > region.GetSize(dSplit))
+      dSplit = d;
+
+  long size = region.GetSize(dSplit);
+  long perThread = (size + num - 1) / num;
+  unsigned int nUsed = (unsigned int) ((size + perThread - 1) / perThread);
+
+  split = region;
+  if(i < nUsed)
+    {
+    split.SetIndex(dSplit, region.GetIndex(dSplit) + i * perThread);
+    split.SetSize(dSplit, std::min(perThread, size - i * perThread));
+    }
+
+  return nUsed;
+}
+
+template <class TInputImage, class TOutputImage>
+ITK_THREAD_RETURN_TYPE
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::ChunkThreaderCallback(void *arg)
+{
+  typedef itk::MultiThreader::ThreadInfoStruct ThreadInfo;
+  ThreadInfo *info = static_cast<ThreadInfo *>(arg);
+  Self *self = static_cast<Self *>(info->UserData);
+
+  RegionType split;
+  unsigned int nUsed = SplitRegion(self->m_CurrentChunk, info->ThreadID, info->NumberOfThreads, split);
+  if(info->ThreadID < nUsed)
+    self->ThreadedGenerateData(split, info->ThreadID);
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::GenerateDataInChunks()
+{
+  // The slabs are layers of tiles along the last dimension, or single slices
+  const RegionType &region = this->GetOutput()->GetRequestedRegion();
+  const unsigned int dLast = InputImageDimension - 1;
+  long thick = m_UseTiles ? (long) m_TileSize[dLast] : 1;
+  long z0 = region.GetIndex(dLast), nz = region.GetSize(dLast);
+  size_t nChunks = (size_t) ((nz + thick - 1) / thick);
+
+  std::vector<char> done(nChunks, 0);
+  size_t nResumed = 0;
+  m_CheckpointInputs = HashCheckpointInputs();
+  if(m_Resume && ReadCheckpoint(done))
+    {
+    nResumed = std::count(done.begin(), done.end(), 1);
+    std::cout << "  Resuming from checkpoint " << m_CheckpointFile << ": " << nResumed 
+      << " of " << nChunks << " slabs already done" << std::endl;
+
+    // Count the voxels of the slabs already done towards the progress
+    if(m_Heartbeat)
+      {
+      for(size_t c = 0; c < nChunks; c++)
+        {
+        if(!done[c])
+          continue;
+        long zStart = z0 + (long) c * thick;
+        RegionType chunk = region;
+        chunk.SetIndex(dLast, zStart);
+        chunk.SetSize(dLast, std::min(thick, z0 + nz - zStart));
+        m_Heartbeat->Add(CountEstimated(chunk));
+        }
+      }
+    }
+
+  this->GetMultiThreader()->SetNumberOfThreads(this->GetNumberOfThreads());
+  this->GetMultiThreader()->SetSingleMethod(&Self::ChunkThreaderCallback, this);
+
+  double tLast = LFWallTime();
+  unsigned long nWritten = 0;
+  for(size_t c = 0; c < nChunks; c++)
+    {
+    if(done[c])
+      continue;
+
+    long zStart = z0 + (long) c * thick;
+    m_CurrentChunk = region;
+    m_CurrentChunk.SetIndex(dLast, zStart);
+    m_CurrentChunk.SetSize(dLast, std::min(thick, z0 + nz - zStart));
+    m_ChunkProgressStart = c * 1.0f / nChunks;
+    m_ChunkProgressWeight = 1.0f / nChunks;
+
+    this->GetMultiThreader()->SingleMethodExecute();
+    done[c] = 1;
+
+    // Save the progress if it's been long enough, unless this was the last slab
+    if(c + 1 < nChunks && LFWallTime() - tLast >= m_CheckpointInterval)
+      {
+      WriteCheckpoint(done);
+      tLast = LFWallTime();
+      nWritten++;
+      }
+    }
+
+  m_ChunkProgressStart = 0.0f;
+  m_ChunkProgressWeight = 1.0f;
+
+  // All the slabs are done, so the checkpoint is no longer needed
+  std::remove(m_CheckpointFile.c_str());
+
+  if(m_Profile)
+    {
+    m_Profile->SetCounter("checkpoints_written", nWritten);
+    m_Profile->SetCounter("slabs_resumed", nResumed);
+    }
+}
+
+/**
+ * The header of the checkpoint file identifies the run: the region, the number of
+ * atlases, slabs and weight maps, the labels, every parameter that changes the vote
+ * sums, the pairs of the parameter sweep and a checksum of the inputs.
+ */
+template <class TInputImage, class TOutputImage>
+std::string
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::CheckpointHeader(size_t nSlabs)
+{
+  const RegionType &region = this->GetOutput()->GetRequestedRegion();
+
+  std::ostringstream oss;
+  oss << "LFCHECKPOINT " << InputImageDimension;
+  for(unsigned int d = 0; d < InputImageDimension; d++)
+    oss << " " << region.GetIndex(d) << " " << region.GetSize(d);
+  oss << " " << m_Atlases.size() << " " << nSlabs << " " << m_WeightMapArray.size()
+      << " " << (m_Votes.size() ? m_LabelList.size() : 0);
+  for(size_t k = 0; k < m_LabelList.size() && m_Votes.size(); k++)
+    oss << " " << m_LabelList[k];
+  oss << std::setprecision(17);
+  oss << " alpha " << m_Alpha << " beta " << m_Beta 
+      << " patch " << m_PatchRadius << " " << m_PatchRadiusPhysical
+      << " search " << m_SearchRadius << " " << m_SearchRadiusPhysical
+      << " stride " << m_WeightStride << " tiles " << m_TileSize
+      << " cascade " << m_CascadeMargin << " autosearch " << m_AutoSearchFraction
+      << " patchmatch " << m_PatchMatch 
+      << " pca " << m_DescriptorComponents << " " << m_DescriptorCandidates
+      << " ridge " << m_RidgeRetries << " batched " << m_BatchedSolve << " estimate";
+  for(unsigned int d = 0; d < InputImageDimension; d++)
+    oss << " " << m_EstimationRegion.GetIndex(d) << " " << m_EstimationRegion.GetSize(d);
+  if(m_Sweep.size())
+    {
+    oss << " sweep";
+    for(size_t s = 0; s < m_Sweep.size(); s++)
+      oss << " " << m_Sweep[s].alpha << " " << m_Sweep[s].beta;
+    }
+  oss << " inputs " << m_CheckpointInputs;
+
+  return oss.str();
+}
+
+/**
+ * Checksum (64-bit FNV-1a) of the buffers of the target, atlases and atlas 
+ * segmentations, with their regions, and of the final mask and exclusions. This
+ * tells apart runs on different images, or on a different mask, in the same region.
+ */
+template <class TInputImage, class TOutputImage>
+std::string
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::HashCheckpointInputs()
+{
+  std::vector<const InputImageType *> images;
+  images.push_back(m_Target);
+  for(size_t i = 0; i < m_Atlases.size(); i++)
+    images.push_back(m_Atlases[i]);
+  for(size_t i = 0; i < m_AtlasSegs.size(); i++)
+    images.push_back(m_AtlasSegs[i]);
+
+  std::vector<std::pair<const unsigned char *, size_t> > buffers;
+  std::ostringstream regions;
+  for(size_t k = 0; k < images.size(); k++)
+    {
+    const RegionType &r = images[k]->GetBufferedRegion();
+    regions << r.GetIndex() << r.GetSize();
+    buffers.push_back(std::make_pair((const unsigned char *) images[k]->GetBufferPointer(),
+                                     r.GetNumberOfPixels() * sizeof(InputImagePixelType)));
+    }
+  if(m_MaskBits.size())
+    buffers.push_back(std::make_pair((const unsigned char *) &m_MaskBits[0], 
+                                     m_MaskBits.size() * sizeof(unsigned int)));
+  if(m_ExclusionBits.size())
+    buffers.push_back(std::make_pair((const unsigned char *) &m_ExclusionBits[0], 
+                                     m_ExclusionBits.size() * sizeof(unsigned int)));
+
+  std::string text = regions.str();
+  buffers.push_back(std::make_pair((const unsigned char *) text.c_str(), text.size()));
+
+  unsigned long h = 14695981039346656037ul;
+  for(size_t k = 0; k < buffers.size(); k++)
+    for(size_t j = 0; j < buffers[k].second; j++)
+      h = (h ^ buffers[k].first[j]) * 1099511628211ul;
+
+  std::ostringstream oss;
+  oss << std::hex << h;
+  return oss.str();
+}
+
+/** 
+ * The counter, label votes and weight map buffers, followed by those of the sweep,
+ * with their sizes in floats
+ */
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::GetVoteBuffers(BufferList &buffers)
+{
+  size_t nPix = this->GetOutput()->GetRequestedRegion().GetNumberOfPixels();
+
+  buffers.clear();
+  buffers.push_back(std::make_pair(m_CounterMap->GetBufferPointer(), nPix));
+  if(m_Votes.size())
+    buffers.push_back(std::make_pair(&m_Votes[0], m_Votes.size()));
+  for(size_t i = 0; i < m_WeightMapArray.size(); i++)
+    buffers.push_back(std::make_pair(m_WeightMapArray[i]->GetBufferPointer(), nPix));
+  for(size_t s = 0; s < m_Sweep.size(); s++)
+    {
+    buffers.push_back(std::make_pair(m_Sweep[s].counter->GetBufferPointer(), nPix));
+    if(m_Sweep[s].votes.size())
+      buffers.push_back(std::make_pair(&m_Sweep[s].votes[0], m_Sweep[s].votes.size()));
+    }
+}
+
+/**
+ * The checkpoint file holds the header, the list of finished slabs, and the vote
+ * buffers as raw floats. It is written to a temporary file first and then renamed,
+ * so that a run killed while saving leaves the previous checkpoint intact.
+ */
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::WriteCheckpoint(const std::vector<char> &done)
+{
+  std::string fnTemp = m_CheckpointFile + ".tmp";
+  std::ofstream fout(fnTemp.c_str(), std::ios::binary);
+
+  fout << CheckpointHeader(done.size()) << "\n";
+  fout.write(&done[0], done.size());
+
+  BufferList buffers;
+  GetVoteBuffers(buffers);
+  for(size_t k = 0; k < buffers.size(); k++)
+    fout.write((const char *) buffers[k].first, buffers[k].second * sizeof(float));
+  fout.close();
+
+  // A failed save is not fatal, the run just can not be resumed from here
+  if(!fout.good() || std::rename(fnTemp.c_str(), m_CheckpointFile.c_str()) != 0)
+    {
+    std::cerr << "Failed to write checkpoint " << m_CheckpointFile << std::endl;
+    std::remove(fnTemp.c_str());
+    return;
+    }
+
+  std::cout << std::endl << "  Saved checkpoint: " << std::count(done.begin(), done.end(), 1) 
+    << " of " << done.size() << " slabs done" << std::endl;
+}
+
+template <class TInputImage, class TOutputImage>
+bool
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::ReadCheckpoint(std::vector<char> &done)
+{
+  std::ifstream fin(m_CheckpointFile.c_str(), std::ios::binary);
+  if(!fin.good())
+    {
+    std::cout << "  No checkpoint " << m_CheckpointFile << " to resume from, starting over" << std::endl;
+    return false;
+    }
+
+  // Compare the header this run would write to the one in the file
+  std::string header;
+  std::getline(fin, header);
+  if(header != CheckpointHeader(done.size()))
+    {
+    std::cout << "  Checkpoint " << m_CheckpointFile << " is from a different run, starting over" << std::endl;
+    return false;
+    }
+
+  // Read into temporary storage first, so that a truncated file leaves no trace
+  BufferList buffers;
+  GetVoteBuffers(buffers);
+  size_t nData = 0;
+  for(size_t k = 0; k < buffers.size(); k++)
+    nData += buffers[k].second;
+
+  std::vector<char> doneFile(done.size());
+  std::vector<float> data(nData);
+  fin.read(&doneFile[0], doneFile.size());
+  fin.read((char *) &data[0], data.size() * sizeof(float));
+  if(!fin.good())
+    {
+    std::cout << "  Checkpoint " << m_CheckpointFile << " is truncated, starting over" << std::endl;
+    return false;
+    }
+
+  // The loaded sums replace the votes made in BeforeThreadedGenerateData (by the
+  // cascade), which are already included in them
+  const float *src = &data[0];
+  for(size_t k = 0; k < buffers.size(); k++)
+    {
+    std::copy(src, src + buffers[k].second, buffers[k].first);
+    src += buffers[k].second;
+    }
+
+  done = doneFile;
+  return true;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::FillStrideGaps()
+{
+  // Voxels in the mask that received no votes from the lattice (e.g., because the
+  // nearby lattice voxels are outside of the mask) get the full estimation. This is
+  // done serially, as there should be few of them
+  OutputImageRegionType region = this->GetOutput()->GetRequestedRegion();
+  ThreadData &td = m_ThreadData[0];
+  td.m_Region = region;
+  LFPhaseClock clkPhase(m_Profile != NULL);
+
+  VoxelWorkspace ws;
+  AllocateWorkspace(ws);
+
+  unsigned long nFilled = 0;
+  typedef itk::ImageRegionIteratorWithIndex<TOutputImage> OutIter;
+  for(OutIter it(this->GetOutput(), region); !it.IsAtEnd(); ++it)
+    {
+    OffsetValueType off = this->GetOutput()->ComputeOffset(it.GetIndex());
+    if(!InMask(off) || m_CounterMap->GetBufferPointer()[off] > 0)
+      continue;
+
+    clkPhase.Skip();
+    EstimateAndVote(it.GetIndex(), ws, td, clkPhase);
+    nFilled++;
+    }
+
+  std::cout << std::endl << "  Estimated weights at " << nFilled 
+    << " voxels not covered by the stride lattice" << std::endl;
+
+  if(m_Profile)
+    m_Profile->SetCounter("stride_gap_voxels", nFilled);
+}
+
+/**
+ * NUMA placement. The threads are given consecutive slabs of the output region, and
+ * the atlases are in the space of the target, so the thread of a slab mostly reads
+ * and writes the same slab of each buffer. Each buffer is interleaved over the
+ * nodes, and then each slab is bound to the node of its thread, which moves the
+ * pages that were first touched by the loader thread.
+ */
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::PlaceBuffersOnNodes()
+{
+  m_NUMANodes = LFGetNUMANodes();
+  if(m_NUMANodes.size() < 2)
+    {
+    std::cout << "  NUMA placement: single node, nothing to place" << std::endl;
+    m_NUMANodes.clear();
+    return;
+    }
+
+  // The number of slabs that the threads will be given. When checkpointing, the
+  // threads split each slab of the checkpoint instead, so there is no slab of the
+  // region that a thread keeps using
+  OutputImageRegionType slab;
+  m_NUMASlabs = this->SplitRequestedRegion(0, this->GetNumberOfThreads(), slab);
+  m_NUMAInterleaveOnly = !m_CheckpointFile.empty();
+
+  const RegionType &region = this->GetOutput()->GetRequestedRegion();
+  double mbPlaced = PlaceBuffer(m_Target->GetBufferPointer(), m_Target->GetBufferedRegion(), 
+                                sizeof(InputImagePixelType));
+  for(size_t i = 0; i < m_Atlases.size(); i++)
+    mbPlaced += PlaceBuffer(m_Atlases[i]->GetBufferPointer(), m_Atlases[i]->GetBufferedRegion(), 
+                            sizeof(InputImagePixelType));
+  for(size_t i = 0; i < m_AtlasSegs.size(); i++)
+    mbPlaced += PlaceBuffer(m_AtlasSegs[i]->GetBufferPointer(), m_AtlasSegs[i]->GetBufferedRegion(), 
+                            sizeof(InputImagePixelType));
+  mbPlaced += PlaceBuffer(m_CounterMap->GetBufferPointer(), region, sizeof(float));
+  if(m_Votes.size())
+    mbPlaced += PlaceBuffer(&m_Votes[0], region, m_LabelStride * sizeof(float));
+
+  if(m_NUMAInterleaveOnly)
+    std::cout << "  NUMA placement: interleaved over " << m_NUMANodes.size() << " nodes, " 
+      << mbPlaced << " MB placed, threads not pinned because of checkpointing" << std::endl;
+  else
+    std::cout << "  NUMA placement: " << m_NUMASlabs << " slabs over " << m_NUMANodes.size() 
+      << " nodes, " << mbPlaced << " MB placed" << std::endl;
+
+  if(m_Profile)
+    {
+    m_Profile->SetInfo("numa_mode", m_NUMAInterleaveOnly ? "interleave" : "bind");
+    m_Profile->SetCounter("numa_nodes", m_NUMANodes.size());
+    m_Profile->SetCounter("numa_placed_mb", mbPlaced);
+    }
+}
+
+/** Place one buffer, returning the megabytes placed (zero if mbind failed) */
+template <class TInputImage, class TOutputImage>
+double
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::PlaceBuffer(const void *buffer, const RegionType &bufferRegion, size_t bytesPerVoxel)
+{
+  unsigned long allNodes = 0;
+  for(size_t k = 0; k < m_NUMANodes.size(); k++)
+    allNodes |= 1ul << m_NUMANodes[k].id;
+
+  size_t nBytes = bufferRegion.GetNumberOfPixels() * bytesPerVoxel;
+  if(!LFSetMemoryPolicy(buffer, nBytes, LF_MPOL_INTERLEAVE, allNodes))
+    return 0.0;
+  if(m_NUMAInterleaveOnly)
+    return nBytes / 1048576.0;
+
+  for(unsigned int t = 0; t < m_NUMASlabs; t++)
+    {
+    OutputImageRegionType slab;
+    this->SplitRequestedRegion(t, this->GetNumberOfThreads(), slab);
+    if(!slab.Crop(bufferRegion))
+      continue;
+
+    // The range of the buffer from the first to the last voxel of the slab
+    size_t first = 0, last = 0, stride = 1;
+    for(unsigned int d = 0; d < InputImageDimension; d++)
+      {
+      first += (slab.GetIndex(d) - bufferRegion.GetIndex(d)) * stride;
+      last += (slab.GetIndex(d) + slab.GetSize(d) - 1 - bufferRegion.GetIndex(d)) * stride;
+      stride *= bufferRegion.GetSize(d);
+      }
+
+    LFSetMemoryPolicy((const char *) buffer + first * bytesPerVoxel, (last + 1 - first) * bytesPerVoxel,
+                      LF_MPOL_BIND, 1ul << m_NUMANodes[GetNodeOfSlab(t)].id);
+    }
+
+  return nBytes / 1048576.0;
+}
+
+template <class TInputImage, class TOutputImage>
+typename WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>::PosteriorImagePtr
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::NewPosteriorImage()
+{
+  PosteriorImagePtr img = PosteriorImage::New();
+  img->SetLargestPossibleRegion(m_Target->GetLargestPossibleRegion());
+  img->SetRequestedRegion(this->GetOutput()->GetRequestedRegion());
+  img->SetBufferedRegion(this->GetOutput()->GetRequestedRegion());
+  img->Allocate();
+  img->FillBuffer(0.0f);
+  return img;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::VoteLabels(const VoteTensor &votes, TOutputImage *output)
+{
+  // The output is visited in buffer order, so the offset just counts up
+  typedef itk::ImageRegionIterator<TOutputImage> OutIter;
+  OffsetValueType off = 0;
+  for(OutIter it(output, output->GetBufferedRegion()); !it.IsAtEnd(); ++it, ++off)
+    {
+    // If this point is outside of the mask, skip it for posterior computation
+    if(!InMask(off))
+      continue;
+
+    const float *row = &votes[off * m_LabelStride];
+
+    // Check if any labels are excluded at this voxel
+    bool have_excl = false;
+    for(unsigned int w = 0; w < m_ExclusionWords; w++)
+      if(m_ExclusionBits[off * m_ExclusionWords + w])
+        have_excl = true;
+
+    int winner = -1;
+    if(!have_excl)
+      {
+      winner = argmax_positive(row, m_LabelStride);
+      }
+    else
+      {
+      float wmax = 0;
+      for(size_t k = 0; k < m_LabelList.size(); k++)
+        {
+        if(wmax < row[k] && !IsExcluded(off, k))
+          {
+          wmax = row[k];
+          winner = k;
+          }
+        }
+      }
+
+    it.Set(winner < 0 ? 0 : m_LabelList[winner]);
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::ExportPosteriorMaps(VoteTensor &votes, PosteriorImage *counter, PosteriorMap &posteriorMap)
+{
+  size_t nPix = counter->GetBufferedRegion().GetNumberOfPixels();
+  const float *scale = counter->GetBufferPointer();
+
+  posteriorMap.clear();
+  for(size_t k = 0; k < m_LabelList.size(); k++)
+    {
+    PosteriorImagePtr post = NewPosteriorImage();
+    float *p = post->GetBufferPointer();
+    const float *v = &votes[k];
+    for(size_t j = 0; j < nPix; j++, v += m_LabelStride)
+      p[j] = (m_NormalizePosteriorMaps && scale[j] >= 0.1) ? *v / scale[j] : *v;
+    posteriorMap[m_LabelList[k]] = post;
+    }
+
+  VoteTensor().swap(votes);
+}
+
+/**
+ * Number the labels in increasing order. If they are all small non-negative integers,
+ * as they usually are, a lookup table replaces the binary search for the index.
+ */
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::IndexLabels()
+{
+  m_LabelList.assign(m_LabelSet.begin(), m_LabelSet.end());
+  m_LabelStride = (m_LabelList.size() + 3) & ~((size_t) 3);
+
+  m_LabelLUT.clear();
+  for(size_t k = 0; k < m_LabelList.size(); k++)
+    {
+    InputImagePixelType label = m_LabelList[k];
+    if(label < 0 || label >= 65536 || label != (int) label)
+      {
+      m_LabelLUT.clear();
+      return;
+      }
+    m_LabelLUT.resize((int) label + 1, -1);
+    m_LabelLUT[(int) label] = k;
+    }
+}
+
+template <class TInputImage, class TOutputImage>
+int
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::GetLabelIndex(InputImagePixelType label) const
+{
+  return std::lower_bound(m_LabelList.begin(), m_LabelList.end(), label) - m_LabelList.begin();
+}
+
+/**
+ * Pack the exclusion maps into a bitset over the labels for each voxel of the output
+ * region. Exclusions of labels that are not in any atlas segmentation can not affect
+ * the vote, and are left out.
+ */
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::CompileExclusions()
+{
+  m_ExclusionBits.clear();
+  m_ExclusionWords = 0;
+  if(m_Exclusions.empty() || m_LabelList.empty())
+    return;
+
+  const RegionType &region = this->GetOutput()->GetBufferedRegion();
+  m_ExclusionWords = (m_LabelList.size() + 31) / 32;
+  m_ExclusionBits.assign(region.GetNumberOfPixels() * m_ExclusionWords, 0u);
+
+  int nUsed = 0;
+  for(typename ExclusionMap::iterator xit = m_Exclusions.begin(); xit != m_Exclusions.end(); ++xit)
+    {
+    if(m_LabelSet.find(xit->first) == m_LabelSet.end())
+      continue;
+
+    int k = GetLabelIndex(xit->first);
+    unsigned int *word = &m_ExclusionBits[k >> 5], bit = 1u << (k & 31);
+    typedef itk::ImageRegionConstIterator<InputImageType> XIter;
+    for(XIter it(xit->second, region); !it.IsAtEnd(); ++it, word += m_ExclusionWords)
+      if(it.Get() != 0)
+        *word |= bit;
+    nUsed++;
+    }
+
+  std::cout << "  Packed " << nUsed << " exclusion maps into " 
+    << m_ExclusionBits.size() * sizeof(unsigned int) / 1048576.0 << " MB" << std::endl;
+}
+
+/**
+ * Pack the mask into one bit per voxel of the output region. The mask image is 
+ * released, unless it was passed in by the user.
+ */
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::CompileMask()
+{
+  m_MaskBits.clear();
+  m_UseMaskBits = m_Mask.IsNotNull();
+  if(!m_UseMaskBits)
+    return;
+
+  const RegionType &region = this->GetOutput()->GetBufferedRegion();
+  m_MaskBits.assign((region.GetNumberOfPixels() + 31) / 32, 0u);
 
-  // Perform voting at each voxel
-  if(m_AtlasSegs.size() == m_Atlases.size())
+  OffsetValueType off = 0;
+  typedef itk::ImageRegionConstIterator<InputImageType> MaskIter;
+  for(MaskIter it(m_Mask, region); !it.IsAtEnd(); ++it, ++off)
+    if(it.Get() != 0)
+      m_MaskBits[off >> 5] |= 1u << (off & 31);
+
+  m_Mask = NULL;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::AfterThreadedGenerateData()
+{
+  if(m_Heartbeat)
+    m_Heartbeat->StartPhase("voting", 0, "");
+
+  // Cover the gaps left by strided estimation
+  if(m_UseWeightStride)
+    FillStrideGaps();
+
+  // Report the voxels that were too badly conditioned for plain Cholesky
+  unsigned long nIllRidge = 0, nIllSVD = 0;
+  for(size_t t = 0; t < m_ThreadData.size(); t++)
     {
-    typedef itk::ImageRegionIteratorWithIndex<TOutputImage> OutIter;
-    for(OutIter it(this->GetOutput(), this->GetOutput()->GetBufferedRegion()); !it.IsAtEnd(); ++it)
+    nIllRidge += m_ThreadData[t].m_RidgeCount;
+    nIllSVD += m_ThreadData[t].m_SVDCount;
+    }
+  if(nIllRidge + nIllSVD > 0)
+    std::cout << std::endl << "  Badly conditioned voxels: " << nIllRidge 
+      << " solved with increased alpha, " << nIllSVD << " with SVD" << std::endl;
+
+  // Report how the PatchMatch search compares to the exhaustive search
+  unsigned long nPMTests = 0, nPMChecked = 0, nPMDiffer = 0, nPMSearches = 0;
+  if(m_PatchMatchBest.size())
+    {
+    for(size_t t = 0; t < m_ThreadData.size(); t++)
       {
-      // If this point is outside of the mask, skip it for posterior computation
-      if(m_Mask && m_Mask->GetPixel(it.GetIndex()) == 0)
-        continue;
+      nPMTests += m_ThreadData[t].m_PatchMatchTests;
+      nPMChecked += m_ThreadData[t].m_PatchMatchChecked;
+      nPMDiffer += m_ThreadData[t].m_PatchMatchDiffer;
+      for(size_t k = 0; k < m_ThreadData[t].m_SearchHisto.size(); k++)
+        nPMSearches += m_ThreadData[t].m_SearchHisto[k];
+      }
 
-      double wmax = 0;
-      InputImagePixelType winner = 0;
+    std::cout << std::endl << "  PatchMatch search: " << nPMTests * 1.0 / std::max(1ul, nPMSearches)
+      << " patches tested per search (exhaustive: " << m_NSearch << ")";
+    if(nPMChecked)
+      std::cout << ", best match differs from the exhaustive search in " << nPMDiffer << " of " 
+        << nPMChecked << " checked (" << nPMDiffer * 100.0 / nPMChecked << "%)";
+    std::cout << std::endl;
 
-      for(typename std::set<InputImagePixelType>::iterator sit = m_LabelSet.begin();
-        sit != m_LabelSet.end(); ++sit)
-        {
-        double posterior = m_PosteriorMap[*sit]->GetPixel(it.GetIndex());
+    // Release the memory
+    std::vector<int>().swap(m_PatchMatchBest);
+    }
+
+  // Report the NUMA nodes of the threads
+  if(m_NUMANodes.size())
+    {
+    std::ostringstream oss;
+    int nPinned = 0;
+    for(size_t t = 0; t < m_ThreadData.size(); t++)
+      {
+      oss << (t ? " " : "") << m_ThreadData[t].m_NUMANode;
+      if(m_ThreadData[t].m_NUMANode >= 0)
+        nPinned++;
+      }
+
+    std::cout << std::endl << "  NUMA nodes of the threads: " << oss.str() << std::endl;
+    if(m_Profile)
+      {
+      m_Profile->SetInfo("numa_thread_nodes", oss.str());
+      m_Profile->SetCounter("numa_pinned_threads", nPinned);
+      }
+    }
 
-        // check if the label is excluded
-        typename ExclusionMap::iterator xit = m_Exclusions.find(*sit);
-        bool excluded = (xit != m_Exclusions.end() && xit->second->GetPixel(it.GetIndex()) != 0);
+  // The descriptors are no longer needed either
+  std::vector<std::vector<float> >().swap(m_Descriptors);
+  m_DescriptorBasis.clear();
 
-        // Vote!
-        if (wmax < posterior && !excluded)
-          {
-          wmax = posterior;
-          winner = *sit;
-          }
-        }
+  // Merge the thread statistics into the profile
+  if(m_Profile)
+    {
+    static const char *phase_names[] = { "search", "mx", "solve", "vote" };
+    std::vector<double> &thrVoxels = m_Profile->GetThreadVoxels();
+    std::vector<double> &thrWall = m_Profile->GetThreadWallTime();
+    std::vector<double> &histo = m_Profile->GetSearchHistogram();
+    thrVoxels.assign(m_ThreadData.size(), 0.0);
+    thrWall.assign(m_ThreadData.size(), 0.0);
+
+    unsigned long nSVD = 0, nRidge = 0, nVox = 0, nBatch = 0, nBatchFallback = 0;
+    for(size_t t = 0; t < m_ThreadData.size(); t++)
+      {
+      const ThreadData &td = m_ThreadData[t];
+      for(int k = 0; k < NUM_THREAD_PHASES; k++)
+        m_Profile->AddPhase(phase_names[k], td.m_PhaseWall[k], td.m_PhaseCPU[k], true);
+
+      thrVoxels[t] = td.m_VoxelCount;
+      thrWall[t] = td.m_TotalWall;
+      nVox += td.m_VoxelCount;
+      nSVD += td.m_SVDCount;
+      nRidge += td.m_RidgeCount;
+      nBatch += td.m_BatchSolveCount;
+      nBatchFallback += td.m_BatchFallbackCount;
+
+      if(histo.size() < td.m_SearchHisto.size())
+        histo.resize(td.m_SearchHisto.size(), 0.0);
+      for(size_t i = 0; i < td.m_SearchHisto.size(); i++)
+        histo[i] += td.m_SearchHisto[i];
+      }
+
+    // Trim the trailing zeros of the histogram
+    while(histo.size() && histo.back() == 0)
+      histo.pop_back();
 
-      it.Set(winner);
+    m_Profile->AddCounter("voxels_processed", nVox);
+    m_Profile->AddCounter("cholesky_solves", nVox - nSVD - nRidge);
+    m_Profile->AddCounter("ridge_fallbacks", nRidge);
+    m_Profile->AddCounter("svd_fallbacks", nSVD);
+    if(m_BatchedSolve)
+      {
+      m_Profile->AddCounter("batched_solves", nBatch);
+      m_Profile->AddCounter("batched_solve_fallbacks", nBatchFallback);
+      }
+    m_Profile->SetCounter("atlases", m_Atlases.size());
+    m_Profile->SetCounter("labels", m_LabelSet.size());
+    m_Profile->SetCounter("patch_size", m_NPatch);
+    m_Profile->SetCounter("search_size", m_NSearch);
+    m_Profile->SetCounter("threads", m_ThreadData.size());
+    if(m_Sweep.size())
+      m_Profile->SetCounter("sweep_pairs", m_Sweep.size() + 1);
+    if(m_PatchMatch)
+      {
+      m_Profile->SetCounter("patchmatch_tests", nPMTests);
+      m_Profile->SetCounter("patchmatch_checked", nPMChecked);
+      m_Profile->SetCounter("patchmatch_differ", nPMDiffer);
       }
+    }
 
-    // Clear posterior maps
-    if(!m_RetainPosteriorMaps)
+  std::cout << std::endl << "VOTING " << std::endl;
+
+  double tFinalWall = 0.0, tFinalCPU = 0.0;
+  LFPhaseClock clkFinal(m_Profile != NULL);
+
+  // Filter type for normalizing by the counter
+  typedef NormalizeFunctor<float, float, float> FloatNormalizeFunctor;
+  typedef itk::BinaryFunctorImageFilter<PosteriorImage, PosteriorImage, PosteriorImage, FloatNormalizeFunctor> NormFilter;
+
+  // Perform voting at each voxel
+  if(m_AtlasSegs.size() == m_Atlases.size())
+    {
+    // The sweep pairs start from the labels assigned before voting
+    for(size_t s = 0; s < m_Sweep.size(); s++)
       {
-      m_PosteriorMap.clear();
+      TOutputImage *output = this->GetOutput();
+      m_Sweep[s].output = TOutputImage::New();
+      m_Sweep[s].output->CopyInformation(output);
+      m_Sweep[s].output->SetRequestedRegion(output->GetRequestedRegion());
+      m_Sweep[s].output->SetBufferedRegion(output->GetBufferedRegion());
+      m_Sweep[s].output->Allocate();
+      std::copy(output->GetBufferPointer(), 
+                output->GetBufferPointer() + output->GetBufferedRegion().GetNumberOfPixels(),
+                m_Sweep[s].output->GetBufferPointer());
+      VoteLabels(m_Sweep[s].votes, m_Sweep[s].output);
       }
-    else
+
+    VoteLabels(m_Votes, this->GetOutput());
+
+    // Split the votes into the posterior maps, or just release them
+    for(size_t s = 0; s <= m_Sweep.size(); s++)
       {
-      for(typename PosteriorMap::const_iterator itp = m_PosteriorMap.begin();
-        itp != m_PosteriorMap.end(); ++itp)
-        {
-        typename NormFilter::Pointer norm = NormFilter::New();
-        norm->SetInput1(itp->second);
-        norm->SetInput2(m_CounterMap);
-        norm->GraftOutput(itp->second);
-        norm->Update();
-        }
+      VoteTensor &votes = (s == 0) ? m_Votes : m_Sweep[s-1].votes;
+      PosteriorMap &pm = (s == 0) ? m_PosteriorMap : m_Sweep[s-1].posterior;
+      PosteriorImage *counter = (s == 0) ? m_CounterMap : m_Sweep[s-1].counter;
+      if(m_RetainPosteriorMaps)
+        ExportPosteriorMaps(votes, counter, pm);
+      else
+        VoteTensor().swap(votes);
       }
     }
 
@@ -719,6 +2624,12 @@ WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
       norm->Update();
       }
     }
+
+  if(m_Profile)
+    {
+    clkFinal.Lap(tFinalWall, tFinalCPU);
+    m_Profile->AddPhase("finalize", tFinalWall, tFinalCPU, false);
+    }
 }
 
 template <class TInputImage, class TOutputImage>
@@ -767,6 +2678,25 @@ WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
   InputImagePixelType &sum_psearch,
   InputImagePixelType &ssq_psearch)
 {
+  return PatchSimilarityN<0>(psearch, normtrg, n, offsets, sum_psearch, ssq_psearch);
+}
+
+template <class TInputImage, class TOutputImage>
+template <unsigned int VN>
+double
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::PatchSimilarityN(
+  const InputImagePixelType *psearch, 
+  const InputImagePixelType *normtrg, 
+  size_t n, 
+  const int *offsets,
+  InputImagePixelType &sum_psearch,
+  InputImagePixelType &ssq_psearch)
+{
+  // Use the compile-time patch size if there is one
+  if(VN)
+    n = VN;
+
   // Here the patch normtrg should already be normalized.
   // We simultaneously compute the patch stats and solve the problem
   InputImagePixelType sum_uv = 0;
@@ -792,6 +2722,460 @@ WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
   // return 2 * ((n - 1) - sum_uv / sd_u);
 }
 
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::ComputePatchDifference(
+  const InputImagePixelType *pmatch,
+  InputImagePixelType sum_pmatch,
+  InputImagePixelType ssq_pmatch,
+  const InputImagePixelType *normtrg,
+  size_t n,
+  const int *offsets,
+  float *apd)
+{
+  ComputePatchDifferenceN<0>(pmatch, sum_pmatch, ssq_pmatch, normtrg, n, offsets, apd);
+}
+
+template <class TInputImage, class TOutputImage>
+template <unsigned int VN>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::ComputePatchDifferenceN(
+  const InputImagePixelType *pmatch,
+  InputImagePixelType sum_pmatch,
+  InputImagePixelType ssq_pmatch,
+  const InputImagePixelType *normtrg,
+  size_t n,
+  const int *offsets,
+  float *apd)
+{
+  // Use the compile-time patch size if there is one
+  if(VN)
+    n = VN;
+
+  // Normalize the matching patch using the sums computed during the search
+  InputImagePixelType mean = sum_pmatch / n;
+  InputImagePixelType var = (ssq_pmatch - n * mean * mean) / (n - 1);
+  if(var < 1.0e-12)
+    var = 1.0e-12;
+  InputImagePixelType sd = sqrt(var);
+
+  for(unsigned int m = 0; m < n; m++)
+    {
+    InputImagePixelType x = *(pmatch + offsets[m]);
+    apd[m] = fabs(normtrg[m] - (x - mean) / sd);
+    }
+}
+
+/**
+ * Dot products between two pairs of rows, a0/a1 and b0/b1, of length len. Each
+ * chunk of a row loaded from memory is used for two products. The rows must be
+ * 16-byte aligned and len must be a multiple of 4. The results are in the order
+ * a0.b0, a0.b1, a1.b0, a1.b1.
+ */
+inline void dot_products_2x2(
+  const float *a0, const float *a1, const float *b0, const float *b1, 
+  unsigned int len, float *d)
+{
+#ifdef _NO_SSE_
+
+  float s00 = 0.0f, s01 = 0.0f, s10 = 0.0f, s11 = 0.0f;
+  for(unsigned int m = 0; m < len; m++)
+    {
+    s00 += a0[m] * b0[m];
+    s01 += a0[m] * b1[m];
+    s10 += a1[m] * b0[m];
+    s11 += a1[m] * b1[m];
+    }
+  d[0] = s00; d[1] = s01; d[2] = s10; d[3] = s11;
+
+#else
+
+  __m128 acc00 = _mm_setzero_ps(), acc01 = _mm_setzero_ps();
+  __m128 acc10 = _mm_setzero_ps(), acc11 = _mm_setzero_ps();
+  for(unsigned int m = 0; m < len; m+=4)
+    {
+    __m128 x0 = _mm_load_ps(a0 + m), x1 = _mm_load_ps(a1 + m);
+    __m128 y0 = _mm_load_ps(b0 + m), y1 = _mm_load_ps(b1 + m);
+    acc00 = _mm_add_ps(acc00, _mm_mul_ps(x0, y0));
+    acc01 = _mm_add_ps(acc01, _mm_mul_ps(x0, y1));
+    acc10 = _mm_add_ps(acc10, _mm_mul_ps(x1, y0));
+    acc11 = _mm_add_ps(acc11, _mm_mul_ps(x1, y1));
+    }
+
+  // Transpose and add so that each lane holds one of the four sums
+  _MM_TRANSPOSE4_PS(acc00, acc01, acc10, acc11);
+  __m128 sums = _mm_add_ps(_mm_add_ps(acc00, acc01), _mm_add_ps(acc10, acc11));
+  _mm_storeu_ps(d, sums);
+
+#endif
+}
+
+/** Dot product of two rows, same requirements as above */
+inline float dot_product_aligned(const float *a, const float *b, unsigned int len)
+{
+#ifdef _NO_SSE_
+
+  float s = 0.0f;
+  for(unsigned int m = 0; m < len; m++)
+    s += a[m] * b[m];
+  return s;
+
+#else
+
+  __m128 acc = _mm_setzero_ps();
+  for(unsigned int m = 0; m < len; m+=4)
+    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_load_ps(a + m), _mm_load_ps(b + m)));
+
+  __m128 shuf   = _mm_shuffle_ps(acc, acc, _MM_SHUFFLE(2, 3, 0, 1));  // [ C D | B A ]
+  __m128 sums   = _mm_add_ps(acc, shuf);      // sums = [ D+C C+D | B+A A+B ]
+  shuf          = _mm_movehl_ps(shuf, sums);      //  [   C   D | D+C C+D ]  // let the compiler avoid a mov by reusing shuf
+  sums          = _mm_add_ss(sums, shuf);
+  return _mm_cvtss_f32(sums);
+
+#endif
+}
+
+/**
+ * Compute the matrix of pairwise joint errors Mx from the absolute patch differences.
+ * The apd rows must be 16-byte aligned and zero-padded to a multiple of 4 entries.
+ *
+ * The rows form an n x nPatch matrix A, and the core of the computation is the
+ * Gram matrix A A^T, computed like a symmetric rank-k update: the patch dimension
+ * is split into blocks that stay in cache while all atlas pairs are processed, and
+ * rows are taken two at a time so that each loaded chunk feeds two dot products.
+ * The normalization, the beta exponent and alpha are applied at the end.
+ */
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::ComputeErrorMatrix(
+  float * const *apd, int n, size_t nPatch, double alpha, double beta, MatrixType &Mx)
+{
+  unsigned int n_PatchRnd = (nPatch % 4 == 0) ? nPatch : ((nPatch >> 2) + 1) << 2;
+
+  // Number of patch entries per cache block (a multiple of 4)
+  const unsigned int blockSize = 256;
+
+  // Accumulate the lower triangle of A A^T
+  Mx.fill(0.0);
+  float d[4];
+  for(unsigned int m0 = 0; m0 < n_PatchRnd; m0 += blockSize)
+    {
+    unsigned int len = std::min(blockSize, n_PatchRnd - m0);
+
+    int i = 0;
+    for(; i + 1 < n; i += 2)
+      {
+      const float *a0 = apd[i] + m0, *a1 = apd[i+1] + m0;
+
+      // 2x2 blocks strictly below the diagonal
+      for(int k = 0; k < i; k += 2)
+        {
+        dot_products_2x2(a0, a1, apd[k] + m0, apd[k+1] + m0, len, d);
+        Mx(i,k) += d[0]; Mx(i,k+1) += d[1];
+        Mx(i+1,k) += d[2]; Mx(i+1,k+1) += d[3];
+        }
+
+      // The 2x2 block on the diagonal
+      dot_products_2x2(a0, a1, a0, a1, len, d);
+      Mx(i,i) += d[0]; Mx(i+1,i) += d[2]; Mx(i+1,i+1) += d[3];
+      }
+
+    // The last row if the number of atlases is odd
+    if(i < n)
+      {
+      for(int k = 0; k <= i; k++)
+        Mx(i,k) += dot_product_aligned(apd[i] + m0, apd[k] + m0, len);
+      }
+    }
+
+  // Map the sums to joint errors
+  for(int i = 0; i < n; i++) 
+    {
+    for(int k = 0; k <= i; k++) 
+      {
+      double mxval = Mx(i,k) / (nPatch - 1);
+
+      if(beta == 2)
+        mxval *= mxval;
+      else
+        mxval = pow(mxval, beta);
+
+      Mx(i,k) = Mx(k,i) = mxval;
+      }
+
+    // Add alpha
+    Mx(i,i) += alpha;
+    }
+}
+
+/**
+ * Allocate the apd rows for n atlases as one contiguous, 16-byte aligned, zeroed
+ * block with each row padded to a multiple of 4 entries.
+ */
+template <class TInputImage, class TOutputImage>
+float **
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::AllocatePatchDifferences(int n, size_t nPatch)
+{
+  int n_PatchRnd = (nPatch % 4 == 0) ? nPatch : ((nPatch >> 2) + 1) << 2;
+  float *block = allocate_aligned<float>(n * n_PatchRnd);
+  for(int j = 0; j < n * n_PatchRnd; j++)
+    block[j] = 0.0f;
+
+  float **apd = new float *[n];
+  for(int i = 0; i < n; i++)
+    apd[i] = block + i * n_PatchRnd;
+  return apd;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::FreePatchDifferences(float **apd)
+{
+  if(apd)
+    {
+    free(apd[0]);
+    delete[] apd;
+    }
+}
+
+/**
+ * Solve Mx W = 1 for the weights and normalize them to sum to one. Cholesky
+ * factorization is used unless the matrix is badly conditioned. In that case, 
+ * with FALLBACK_RIDGE, Cholesky is retried with alpha increased tenfold up to
+ * the given number of times, and if all else fails we fall back to the SVD.
+ */
+template <class TInputImage, class TOutputImage>
+typename WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>::SolveMethod
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::SolveWeights(const MatrixType &Mx, const VectorType &ones, VectorType &W,
+               SolveFallback fallback, double alpha, int retries)
+{
+  SolveMethod method = SOLVE_CHOLESKY;
+  vnl_cholesky cholesky(Mx, vnl_cholesky::estimate_condition);
+  if(cholesky.rcond() > vnl_math::sqrteps)
+    {
+    // Well-conditioned matrix
+    cholesky.solve(ones, &W);
+    }
+  else
+    {
+    method = SOLVE_SVD;
+    if(fallback == FALLBACK_RIDGE && retries > 0)
+      {
+      // Without an alpha to scale, start from a small fraction of the diagonal
+      double ridge = alpha;
+      if(ridge <= 0.0)
+        {
+        ridge = 0.0;
+        for(unsigned int i = 0; i < Mx.rows(); i++)
+          ridge += Mx(i,i);
+        ridge *= vnl_math::sqrteps / Mx.rows();
+        }
+
+      MatrixType Mr = Mx;
+      for(int k = 0; k < retries && method == SOLVE_SVD; k++)
+        {
+        // Go from alpha * 10^k to alpha * 10^(k+1)
+        for(unsigned int i = 0; i < Mr.rows(); i++)
+          Mr(i,i) += 9.0 * ridge;
+        ridge *= 10.0;
+
+        vnl_cholesky chRidge(Mr, vnl_cholesky::estimate_condition);
+        if(chRidge.rcond() > vnl_math::sqrteps)
+          {
+          chRidge.solve(ones, &W);
+          method = SOLVE_RIDGE;
+          }
+        }
+      }
+
+    // Matrix badly conditioned
+    if(method == SOLVE_SVD)
+      W = vnl_svd<double>(Mx).solve(ones);
+    }
+
+  // Normalize the weights
+  W *= 1.0 / dot_product(W, ones);
+
+  return method;
+}
+
+template <class TInputImage, class TOutputImage>
+void
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::SolveVoxelWeights(const MatrixType &Mx, const VectorType &ones, VectorType &W, ThreadData &td)
+{
+  switch(SolveWeights(Mx, ones, W, m_SolveFallback, m_Alpha, m_RidgeRetries))
+    {
+    case SOLVE_RIDGE: td.m_RidgeCount++; break;
+    case SOLVE_SVD: td.m_SVDCount++; break;
+    default: break;
+    }
+}
+
+/**
+ * Batched version of SolveWeights. The lower triangles of the matrices are stored
+ * interleaved, so that entry (i,j) of all the matrices is contiguous, and the
+ * Cholesky factorization and the triangular solves are done on all of them at once,
+ * one matrix per SIMD lane. The loops over the lanes are kept trivial so that the
+ * compiler can vectorize them.
+ *
+ * SolveWeights tests the LINPACK condition estimate, which does not batch well.
+ * Instead, each matrix is accepted only if a lower bound on its reciprocal condition
+ * number passes the same test, i.e., if SolveWeights would also use Cholesky. The
+ * bound uses ||A^-1||_1 <= sqrt(n) / lambda_min. For beta = 2, Mx - alpha I is the
+ * elementwise square of a Gram matrix, which is positive semidefinite (Schur product
+ * theorem), so lambda_min >= alpha. Otherwise, the Gershgorin bound is used.
+ */
+template <class TInputImage, class TOutputImage>
+int
+WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
+::SolveWeightsBatched(const MatrixType *Mx, int count, double alpha, double beta, 
+                      VectorType *W, bool *solved)
+{
+  const int B = SolveBatchSize;
+  int n = Mx[0].rows();
+
+  // Interleaved lower triangles: entry (i,j) of lane l is at L[(i * n + j) * B + l]. 
+  // The unused lanes are given the identity matrix
+  std::vector<double> L(n * n * B, 0.0);
+  for(int i = 0; i < n; i++)
+    for(int j = 0; j <= i; j++)
+      for(int l = 0; l < B; l++)
+        L[(i * n + j) * B + l] = (l < count) ? Mx[l](i,j) : (i == j ? 1.0 : 0.0);
+
+  // Bound the smallest eigenvalue from below and compute the 1-norm (the matrices
+  // are symmetric, so the row sums are the column sums)
+  double lmin[B], norm1[B], offsum[B];
+  bool ok[B];
+  for(int l = 0; l < B; l++)
+    {
+    lmin[l] = (beta == 2) ? alpha : 1e100;
+    norm1[l] = 0.0;
+    ok[l] = l < count;
+    }
+
+  for(int i = 0; i < n; i++)
+    {
+    for(int l = 0; l < B; l++)
+      offsum[l] = 0.0;
+    for(int j = 0; j < n; j++)
+      {
+      if(j == i)
+        continue;
+      const double *Aij = &L[(i > j ? i * n + j : j * n + i) * B];
+      for(int l = 0; l < B; l++)
+        offsum[l] += fabs(Aij[l]);
+      }
+
+    const double *Aii = &L[(i * n + i) * B];
+    for(int l = 0; l < B; l++)
+      {
+      norm1[l] = std::max(norm1[l], fabs(Aii[l]) + offsum[l]);
+      if(beta != 2)
+        lmin[l] = std::min(lmin[l], Aii[l] - offsum[l]);
+      }
+    }
+
+  for(int l = 0; l < B; l++)
+    if(!(lmin[l] > vnl_math::sqrteps * sqrt((double) n) * norm1[l]))
+      ok[l] = false;
+
+  // Cholesky factorization, one column at a time
+  for(int j = 0; j < n; j++)
+    {
+    double *Ljj = &L[(j * n + j) * B];
+    for(int k = 0; k < j; k++)
+      {
+      const double *Ljk = &L[(j * n + k) * B];
+      for(int l = 0; l < B; l++)
+        Ljj[l] -= Ljk[l] * Ljk[l];
+      }
+
+    // Rounding could still produce a bad pivot. Flag the lane and keep going
+    for(int l = 0; l < B; l++)
+      {
+      if(!(Ljj[l] > 0.0))
+        {
+        ok[l] = false;
+        Ljj[l] = 1.0;
+        }
+      Ljj[l] = sqrt(Ljj[l]);
+      }
+
+    for(int i = j + 1; i < n; i++)
+      {
+      double *Lij = &L[(i * n + j) * B];
+      for(int k = 0; k < j; k++)
+        {
+        const double *Lik = &L[(i * n + k) * B], *Ljk = &L[(j * n + k) * B];
+        for(int l = 0; l < B; l++)
+          Lij[l] -= Lik[l] * Ljk[l];
+        }
+      for(int l = 0; l < B; l++)
+        Lij[l] /= Ljj[l];
+      }
+    }
+
+  // Solve L y = 1 and then L' x = y
+  std::vector<double> x(n * B);
+  for(int i = 0; i < n; i++)
+    {
+    double *xi = &x[i * B];
+    const double *Lii = &L[(i * n + i) * B];
+    for(int l = 0; l < B; l++)
+      xi[l] = 1.0;
+    for(int k = 0; k < i; k++)
+      {
+      const double *Lik = &L[(i * n + k) * B], *xk = &x[k * B];
+      for(int l = 0; l < B; l++)
+        xi[l] -= Lik[l] * xk[l];
+      }
+    for(int l = 0; l < B; l++)
+      xi[l] /= Lii[l];
+    }
+
+  for(int i = n - 1; i >= 0; i--)
+    {
+    double *xi = &x[i * B];
+    const double *Lii = &L[(i * n + i) * B];
+    for(int k = i + 1; k < n; k++)
+      {
+      const double *Lki = &L[(k * n + i) * B], *xk = &x[k * B];
+      for(int l = 0; l < B; l++)
+        xi[l] -= Lki[l] * xk[l];
+      }
+    for(int l = 0; l < B; l++)
+      xi[l] /= Lii[l];
+    }
+
+  // Scatter the weights of the accepted lanes, normalized to sum to one
+  int nSolved = 0;
+  for(int l = 0; l < count; l++)
+    {
+    solved[l] = ok[l];
+    if(!ok[l])
+      continue;
+
+    double wsum = 0.0;
+    for(int i = 0; i < n; i++)
+      wsum += x[i * B + l];
+
+    W[l].set_size(n);
+    for(int i = 0; i < n; i++)
+      W[l][i] = x[i * B + l] / wsum;
+
+    nSolved++;
+    }
+
+  return nSolved;
+}
+
 template <class TInputImage, class TOutputImage>
 double
 WeightedVotingLabelFusionImageFilter<TInputImage, TOutputImage>
@@ -57,8 +57,10 @@
 #include "vtkCellArray.h"
 #include "vtkVertex.h"
 #include <vtkMatrix4x4.h>
+#include "vtkMultiThreader.h"
 #include "vnl/vnl_matrix_fixed.h"
 #include "itk_to_nifti_xform.h"
+#include "ASHSRuntime.h"
 #include <string>
 #include <vector>
 #include <set>
@@ -78,6 +80,7 @@ struct Parameters
   double temp_init;
   double anneal_rate;
   bool debug;
+  int threads;
 };
 
 int usage()
@@ -106,6 +109,8 @@ int usage()
       "  -a value     Annealing rate, default = 0.93. Probably does not matter.\n"
       "  -d           Debug mode. Program will spit out some vtk meshes in the \n"
       "               current directory.\n"
+      "  -threads N   Limit number of threads to N. Default: the number of CPUs \n"
+      "               this process may use (CPU affinity, cgroup quota, SLURM).\n"
       "notes:\n"
       "  - To reslice the moving image to the target image, use the c3d command\n"
       "       c3d target.nii moving.nii -int 0 -reslice-matrix output.mat -o out.nii\n"
@@ -529,6 +534,7 @@ int main(int argc, char *argv[])
   p.n_bins = 8;
   p.temp_init = 4.0;
   p.debug = false;
+  p.threads = 0;
 
   // Read the optional parameters
   for(int iarg = 1; iarg < argc-3; iarg++)
@@ -550,6 +556,10 @@ int main(int argc, char *argv[])
       {
       p.debug = true;
       }
+    else if(arg == "-threads")
+      {
+      p.threads = atoi(argv[++iarg]);
+      }
     else
       {
       cerr << "Bad parameter " << arg << endl;
@@ -577,6 +587,13 @@ int main(int argc, char *argv[])
     return -1;
     }
 
+  // Use the same number of threads in ITK and VTK
+  string threadSource;
+  int nThreads = ASHSSetNumberOfThreads(p.threads, &threadSource);
+  vtkMultiThreader::SetGlobalMaximumNumberOfThreads(nThreads);
+  vtkMultiThreader::SetGlobalDefaultNumberOfThreads(nThreads);
+  cout << "Executing with " << nThreads << " threads (" << threadSource << ")" << endl;
+
   // Read the input datasets
   typedef ImageFileReader<LabelImageType> ReaderType;
   ReaderType::Pointer readerTrg = ReaderType::New();
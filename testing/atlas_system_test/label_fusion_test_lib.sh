@@ -0,0 +1,80 @@
+#!/bin/bash
+#######################################################################
+#
+#  Helper functions for the label fusion regression tests. These put
+#  the TSE images and left segmentations of sub01-sub05 on the grid
+#  of sub01 (the atlases are not registered, which does not matter for
+#  comparing two ways of computing the same fusion) and compare the
+#  outputs of two runs.
+#
+#######################################################################
+
+# Directory with label_fusion, label_fusion_merge and c3d
+LF_BIN=${LF_BIN:-$ASHS_ROOT/ext/$(uname)/bin}
+
+# Arguments of the runs: small patch and search, to keep the tests quick
+LF_ARGS="-m Joint[0.1,2] -rp 1x1x1 -rs 2x2x1"
+
+# Number of failed comparisons
+LF_FAILED=0
+
+# Make the target, atlases, segmentations and an exclusion map in $1
+function lf_prepare_data()
+{
+  local WORK=${1?}
+  mkdir -p $WORK
+
+  cp images/sub01_tse.nii.gz $WORK/target.nii.gz
+  LF_ATLASES=""
+  LF_SEGS=""
+  for id in 02 03 04 05; do
+    $LF_BIN/c3d $WORK/target.nii.gz images/sub${id}_tse.nii.gz \
+      -copy-transform -o $WORK/atlas_${id}.nii.gz
+    $LF_BIN/c3d $WORK/target.nii.gz images/sub${id}_seg_L.nii.gz \
+      -copy-transform -o $WORK/seg_${id}.nii.gz
+    LF_ATLASES="$LF_ATLASES $WORK/atlas_${id}.nii.gz"
+    LF_SEGS="$LF_SEGS $WORK/seg_${id}.nii.gz"
+  done
+
+  # Exclude label 1 (BODY) from half of the image
+  $LF_BIN/c3d $WORK/target.nii.gz -cmv -pop -pop -thresh 63 inf 1 0 -o $WORK/excl_1.nii.gz
+}
+
+# Number of voxels where images $1 and $2 differ by more than $3
+function lf_count_diff()
+{
+  $LF_BIN/c3d $1 $2 -scale -1 -add -abs -thresh $3 inf 1 0 -voxel-sum | awk '{printf "%d\n", $NF}'
+}
+
+# Compare two images with a tolerance. Args: description, image1, image2, tolerance
+function lf_compare()
+{
+  local DESC=${1?} A=${2?} B=${3?} TOL=${4?}
+  if [[ ! -f $A || ! -f $B ]]; then
+    echo "FAIL: $DESC: missing $A or $B"
+    LF_FAILED=$((LF_FAILED+1))
+    return
+  fi
+
+  local NDIFF=$(lf_count_diff $A $B $TOL)
+  if [[ $NDIFF -eq 0 ]]; then
+    echo "OK:   $DESC"
+  else
+    echo "FAIL: $DESC: $NDIFF voxels differ by more than $TOL"
+    LF_FAILED=$((LF_FAILED+1))
+  fi
+}
+
+# Compare the segmentations and posteriors of two runs. The posteriors are saved
+# with the pattern prefix_%06d.nii.gz. Args: description, seg1, seg2, posterior
+# prefix 1, posterior prefix 2, tolerance for the posteriors
+function lf_compare_runs()
+{
+  local DESC=${1?} SEG1=${2?} SEG2=${3?} POST1=${4?} POST2=${5?} TOL=${6?}
+  lf_compare "$DESC: segmentation" $SEG1 $SEG2 0.5
+
+  local fn
+  for fn in ${POST1}_*.nii.gz; do
+    lf_compare "$DESC: posterior $(basename $fn)" $fn ${POST2}_${fn#${POST1}_} $TOL
+  done
+}
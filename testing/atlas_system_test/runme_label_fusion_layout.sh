@@ -0,0 +1,102 @@
+#!/bin/bash
+#######################################################################
+#
+#  Regression test for the layout of the voting mask, the exclusion maps
+#  and the votes in label_fusion. The results must not change with the
+#  layout, which is checked in two ways:
+#
+#  1. The labels of the atlases are moved above 100000, which turns off
+#     the label lookup table. The segmentation, mapped back to the
+#     original labels, and the posteriors must match those of a run on
+#     the original labels. Done with and without -x exclusions.
+#
+#  2. If LF_BASELINE_BIN is set to a directory with a label_fusion built
+#     before the voting mask and exclusions were packed into bits, i.e.
+#     from 'git checkout 9859e5f~1', the same runs must give the same
+#     segmentation and posteriors with both binaries.
+#
+#  Usage: runme_label_fusion_layout.sh output_dir
+#
+#######################################################################
+echo "ASHS_ROOT:   ${ASHS_ROOT?}"
+echo "Output Dir:  ${1?}"
+
+OUTDIR=${1?}
+
+source label_fusion_test_lib.sh
+
+lf_prepare_data $OUTDIR/data
+
+# The labels of the test data, and the same labels moved above the lookup table
+LABELS="0 1 5 6 8 9 10"
+BIG=100000
+TO_BIG=""
+FROM_BIG=""
+for label in $LABELS; do
+  if [[ $label -gt 0 ]]; then
+    TO_BIG="$TO_BIG $label $((label+BIG))"
+    FROM_BIG="$FROM_BIG $((label+BIG)) $label"
+  fi
+done
+
+LF_SEGS_BIG=""
+for fn in $LF_SEGS; do
+  $LF_BIN/c3d $fn -replace $TO_BIG -o ${fn%.nii.gz}_big.nii.gz
+  LF_SEGS_BIG="$LF_SEGS_BIG ${fn%.nii.gz}_big.nii.gz"
+done
+
+# Name of the case, its segmentations and its exclusions
+CASES=(plain excl big big_excl)
+CASE_SEGS=("$LF_SEGS" "$LF_SEGS" "$LF_SEGS_BIG" "$LF_SEGS_BIG")
+CASE_OPTS=("" "-x 1 $OUTDIR/data/excl_1.nii.gz" "" "-x $((1+BIG)) $OUTDIR/data/excl_1.nii.gz")
+
+# Run each case with the binaries in directory $1, output in $2
+function run_cases()
+{
+  local BIN=${1?} WORK=${2?}
+  mkdir -p $WORK
+  for ((k=0; k<${#CASES[*]}; k++)); do
+    $BIN/label_fusion 3 $LF_ARGS ${CASE_OPTS[k]} \
+      -g $LF_ATLASES -l ${CASE_SEGS[k]} -p $WORK/${CASES[k]}_post_%06d.nii.gz \
+      $OUTDIR/data/target.nii.gz $WORK/${CASES[k]}_seg.nii.gz > $WORK/${CASES[k]}_stdout.txt
+  done
+}
+
+run_cases $LF_BIN $OUTDIR/current
+
+# Compare the runs on the big labels with those on the original labels
+W=$OUTDIR/current
+for CASE in plain excl; do
+  BIGCASE=big
+  [[ $CASE != plain ]] && BIGCASE=big_$CASE
+
+  $LF_BIN/c3d $W/${BIGCASE}_seg.nii.gz -replace $FROM_BIG -o $W/${BIGCASE}_mapped_seg.nii.gz
+  lf_compare "$CASE, labels above $BIG: segmentation" \
+    $W/${CASE}_seg.nii.gz $W/${BIGCASE}_mapped_seg.nii.gz 0.5
+
+  for label in $LABELS; do
+    BL=$label
+    [[ $label -gt 0 ]] && BL=$((label+BIG))
+    lf_compare "$CASE, labels above $BIG: posterior of label $label" \
+      $(printf "$W/${CASE}_post_%06d.nii.gz" $label) \
+      $(printf "$W/${BIGCASE}_post_%06d.nii.gz" $BL) 1e-6
+  done
+done
+
+# Compare with the baseline binaries
+if [[ -n $LF_BASELINE_BIN ]]; then
+  run_cases $LF_BASELINE_BIN $OUTDIR/baseline
+  for CASE in ${CASES[*]}; do
+    lf_compare_runs "$CASE, baseline" \
+      $OUTDIR/baseline/${CASE}_seg.nii.gz $OUTDIR/current/${CASE}_seg.nii.gz \
+      $OUTDIR/baseline/${CASE}_post $OUTDIR/current/${CASE}_post 1e-6
+  done
+else
+  echo "LF_BASELINE_BIN is not set, skipping the comparison with the baseline"
+fi
+
+if [[ $LF_FAILED -gt 0 ]]; then
+  echo "label_fusion layout: $LF_FAILED comparisons FAILED"
+  exit 1
+fi
+echo "label_fusion layout: all comparisons PASSED"
@@ -0,0 +1,57 @@
+#!/bin/bash
+#######################################################################
+#
+#  Regression test for label_fusion --partition: the partitions 0/2 and
+#  1/2, combined by label_fusion_merge, must give the segmentation of a 
+#  single run, and the same posteriors up to round-off. Tested with the
+#  plain fusion, with --cascade and with -x exclusions.
+#
+#  Usage: runme_label_fusion_partition.sh output_dir
+#
+#######################################################################
+echo "ASHS_ROOT:   ${ASHS_ROOT?}"
+echo "Output Dir:  ${1?}"
+
+OUTDIR=${1?}
+
+source label_fusion_test_lib.sh
+
+lf_prepare_data $OUTDIR/data
+
+# Name of the case and the extra options of label_fusion and label_fusion_merge
+CASES=(plain cascade excl)
+CASE_LF_OPTS=("" "--cascade 0.8" "-x 1 $OUTDIR/data/excl_1.nii.gz")
+CASE_MERGE_OPTS=("" "" "-x 1 $OUTDIR/data/excl_1.nii.gz")
+
+for ((k=0; k<${#CASES[*]}; k++)); do
+
+  CASE=${CASES[k]}
+  WORK=$OUTDIR/$CASE
+  mkdir -p $WORK
+
+  # The reference: a single run
+  $LF_BIN/label_fusion 3 $LF_ARGS ${CASE_LF_OPTS[k]} \
+    -g $LF_ATLASES -l $LF_SEGS -p $WORK/single_post_%06d.nii.gz \
+    $OUTDIR/data/target.nii.gz $WORK/single_seg.nii.gz > $WORK/single_stdout.txt
+
+  # The two partitions and their merge
+  for i in 0 1; do
+    $LF_BIN/label_fusion 3 $LF_ARGS ${CASE_LF_OPTS[k]} --partition $i/2 \
+      -g $LF_ATLASES -l $LF_SEGS \
+      $OUTDIR/data/target.nii.gz $WORK/part$i > $WORK/part${i}_stdout.txt
+  done
+
+  $LF_BIN/label_fusion_merge 3 ${CASE_MERGE_OPTS[k]} -p $WORK/merged_post_%06d.nii.gz \
+    $OUTDIR/data/target.nii.gz $WORK/merged_seg.nii.gz $WORK/part0 $WORK/part1 \
+    > $WORK/merge_stdout.txt
+
+  lf_compare_runs "$CASE" $WORK/single_seg.nii.gz $WORK/merged_seg.nii.gz \
+    $WORK/single_post $WORK/merged_post 1e-4
+
+done
+
+if [[ $LF_FAILED -gt 0 ]]; then
+  echo "label_fusion --partition: $LF_FAILED comparisons FAILED"
+  exit 1
+fi
+echo "label_fusion --partition: all comparisons PASSED"